@@ -10,55 +10,172 @@
  */
 #include "aqueue.h"
 
-#include "libchik.h"
+#include <stdlib.h>
+
+#include "log.h"
+
+typedef struct {
+    aqueue_t     *queue;
+    task_t       *tasks;
+    unsigned long max;
+    unsigned long n;
+} _aqueue_poll_t;
+
+__thread aqueue_stats_t  _aqueue_own   = {0, 0, 0};
+__thread aqueue_stats_t *_aqueue_stats = 0;
+
+/*
+ *    Bumps one of the calling thread's counters. Only this thread
+ *    writes them, so there's no need for a locked add.
+ *
+ *    @param unsigned long *counter    The counter.
+ */
+static void _aqueue_count(unsigned long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *    Returns where the calling thread counts, its own counters unless
+ *    aqueue_thread_stats_set() pointed it elsewhere.
+ *
+ *    @return aqueue_stats_t*    The counters.
+ */
+static aqueue_stats_t *_aqueue_counters(void) {
+    return _aqueue_stats != 0 ? _aqueue_stats : &_aqueue_own;
+}
+
+/*
+ *    Takes up to max tasks from the head of the queue, copying them
+ *    out before the slots are handed back to the producers.
+ *
+ *    @param aqueue_t     *queue    The queue to take from.
+ *    @param task_t       *tasks    The array to copy the tasks into.
+ *    @param unsigned long max      The maximum number of tasks to take.
+ *
+ *    @return unsigned long    The number of tasks taken, 0 if the queue is
+ *                             empty.
+ */
+static unsigned long _aqueue_take(aqueue_t *queue, task_t *tasks,
+                                  unsigned long max) {
+    aqueue_slot_t *slot;
+    unsigned long  pos;
+    unsigned long  seq;
+    unsigned long  i;
+    unsigned long  n;
+    long           diff;
+
+    pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &queue->slots[pos & queue->mask];
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)(pos + 1);
+
+        if (diff < 0) {
+            _aqueue_count(&_aqueue_counters()->empty);
+            return 0;
+        }
+
+        if (diff > 0) {
+            _aqueue_count(&_aqueue_counters()->retries);
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /*
+         *    Extend the claim over every published slot behind the
+         *    first one, then take them all with a single swap.
+         */
+        for (n = 1; n < max && n <= queue->mask; n++) {
+            slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + n + 1)
+                break;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->head, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+
+        _aqueue_count(&_aqueue_counters()->retries);
+    }
+
+    for (i = 0; i < n; i++) {
+        slot     = &queue->slots[(pos + i) & queue->mask];
+        tasks[i] = slot->task;
+
+        __atomic_store_n(&slot->seq, pos + i + queue->size, __ATOMIC_RELEASE);
+    }
+
+    sync_event_notify(&queue->space, (int)n);
+
+    return n;
+}
+
+/*
+ *    Polls the queue while backing off.
+ *
+ *    @param void *arg    The _aqueue_poll_t describing the request.
+ *
+ *    @return int    1 if tasks were taken, 0 otherwise.
+ */
+static int _aqueue_poll(void *arg) {
+    _aqueue_poll_t *poll = (_aqueue_poll_t *)arg;
+
+    poll->n = _aqueue_take(poll->queue, poll->tasks, poll->max);
+
+    return poll->n != 0;
+}
 
 /*
  *    Creates a new async queue.
+ *    The size is rounded up to the next power of two, at least two.
  *
  *    @param unsigned long size    The size of the queue.
  *
  *    @return aqueue_t*    A pointer to the new queue.
  */
 aqueue_t *aqueue_new(unsigned long size) {
-    aqueue_t *queue = (aqueue_t *)malloc(sizeof(aqueue_t));
+    unsigned long i;
+    unsigned long cap;
+    aqueue_t     *queue;
+
+    if (size == 0) {
+        LOGF_ERR("Invalid async queue size\n");
+        return nullptr;
+    }
+
+    /*
+     *    A single slot can't tell a full ring from an empty one.
+     */
+    for (cap = 2; cap < size; cap <<= 1)
+        ;
+
+    queue = (aqueue_t *)aligned_alloc(CHIK_CACHE_LINE, sizeof(aqueue_t));
 
     if (queue == nullptr) {
         LOGF_ERR("Failed to allocate memory for async queue\n");
         return nullptr;
     }
 
-    queue->tasks = (task_t *)malloc(sizeof(task_t) * size);
+    queue->slots = (aqueue_slot_t *)malloc(sizeof(aqueue_slot_t) * cap);
 
-    if (queue->tasks == nullptr) {
+    if (queue->slots == nullptr) {
         LOGF_ERR("Failed to allocate memory for async queue tasks\n");
         free(queue);
         return nullptr;
     }
 
-    queue->size    = size;
+    for (i = 0; i < cap; i++)
+        queue->slots[i].seq = i;
+
+    queue->size    = cap;
+    queue->mask    = cap - 1;
     queue->head    = 0;
     queue->tail    = 0;
-    queue->count   = 0;
     queue->waiting = 0;
 
-#if __unix__
-    if (pthread_mutex_init(&queue->lock, nullptr) != 0) {
-        LOGF_ERR("Failed to initialize async queue mutex\n");
-        free(queue->tasks);
-        free(queue);
-        return nullptr;
-    }
-
-    if (pthread_cond_init(&queue->cond, nullptr) != 0) {
-        LOGF_ERR("Failed to initialize async queue condition variable\n");
-        pthread_mutex_destroy(&queue->lock);
-        free(queue->tasks);
-        free(queue);
-        return nullptr;
-    }
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
+    sync_event_init(&queue->event);
+    sync_event_init(&queue->space);
+    sync_backoff_init(&queue->backoff);
 
     return queue;
 }
@@ -69,14 +186,7 @@ aqueue_t *aqueue_new(unsigned long size) {
  *    @param aqueue_t *queue    The queue to destroy.
  */
 void aqueue_destroy(aqueue_t *queue) {
-#if __unix__
-    pthread_mutex_destroy(&queue->lock);
-    pthread_cond_destroy(&queue->cond);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-
-    free(queue->tasks);
+    free(queue->slots);
     free(queue);
 }
 
@@ -89,74 +199,232 @@ void aqueue_destroy(aqueue_t *queue) {
  *    @return int    0 on success, -1 on failure.
  */
 int aqueue_add(aqueue_t *queue, task_t *task) {
-    task_t *dest;
-#if __unix__
-    pthread_mutex_lock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-
-    if (queue->count == queue->size) {
-#if __unix__
-        pthread_mutex_unlock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-        return -1;
+    return aqueue_add_many(queue, task, 1) == 1 ? 0 : -1;
+}
+
+/*
+ *    Adds as many tasks as fit to the queue. Their slots are claimed
+ *    with a single swap of the tail, and up to that many sleeping
+ *    consumers are woken.
+ *
+ *    @param aqueue_t     *queue    The queue to add the tasks to.
+ *    @param task_t       *tasks    The tasks to add.
+ *    @param unsigned long count    The number of tasks to add.
+ *
+ *    @return unsigned long    The number of tasks added.
+ */
+unsigned long aqueue_add_many(aqueue_t *queue, task_t *tasks,
+                              unsigned long count) {
+    aqueue_slot_t *slot;
+    unsigned long  pos;
+    unsigned long  seq;
+    unsigned long  i;
+    unsigned long  n;
+    long           diff;
+
+    if (count == 0)
+        return 0;
+
+    pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &queue->slots[pos & queue->mask];
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+
+        if (diff < 0) {
+            _aqueue_count(&_aqueue_counters()->full);
+            return 0;
+        }
+
+        if (diff > 0) {
+            _aqueue_count(&_aqueue_counters()->retries);
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /*
+         *    Extend the claim over every free slot behind the first
+         *    one, then reserve them all with a single swap.
+         */
+        for (n = 1; n < count && n <= queue->mask; n++) {
+            slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + n)
+                break;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+
+        _aqueue_count(&_aqueue_counters()->retries);
+    }
+
+    for (i = 0; i < n; i++) {
+        slot       = &queue->slots[(pos + i) & queue->mask];
+        slot->task = tasks[i];
+
+        __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    sync_event_notify(&queue->event, (int)n);
+
+    return n;
+}
+
+/*
+ *    Adds a task to the queue, waiting for room until a deadline.
+ *
+ *    @param aqueue_t     *queue       The queue to add the task to.
+ *    @param task_t       *task        The task to add.
+ *    @param unsigned long deadline    The sync_now() time to give up
+ *                                     at, or 0 to wait forever.
+ *
+ *    @return int    0 on success, -1 on timeout.
+ */
+static int _aqueue_add_until(aqueue_t *queue, task_t *task,
+                             unsigned long deadline) {
+    unsigned long now;
+    unsigned int  key;
+
+    while (aqueue_add(queue, task) != 0) {
+        now = deadline != 0 ? sync_now() : 0;
+
+        if (now >= deadline && deadline != 0)
+            return -1;
+
+        key = sync_event_prepare(&queue->space);
+
+        if (aqueue_add(queue, task) == 0) {
+            sync_event_cancel(&queue->space);
+            return 0;
+        }
+
+        if (deadline != 0)
+            sync_event_wait_timeout(&queue->space, key, deadline - now);
+        else
+            sync_event_wait(&queue->space, key);
     }
 
-    dest      = &queue->tasks[queue->tail];
-    dest->fun = task->fun;
-    dest->arg = task->arg;
+    return 0;
+}
+
+/*
+ *    Adds a task to the queue, waiting for room if it is full.
+ *
+ *    @param aqueue_t *queue    The queue to add the task to.
+ *    @param task_t   *task     The task to add.
+ *
+ *    @return int    0 on success.
+ */
+int aqueue_add_wait(aqueue_t *queue, task_t *task) {
+    return _aqueue_add_until(queue, task, 0);
+}
+
+/*
+ *    Adds a task to the queue, waiting at most ns nanoseconds for
+ *    room if it is full.
+ *
+ *    @param aqueue_t     *queue    The queue to add the task to.
+ *    @param task_t       *task     The task to add.
+ *    @param unsigned long ns       The timeout in nanoseconds.
+ *
+ *    @return int    0 on success, -1 on timeout.
+ */
+int aqueue_add_timeout(aqueue_t *queue, task_t *task, unsigned long ns) {
+    unsigned long now = sync_now();
+
+    if (ns == 0)
+        return aqueue_add(queue, task);
 
-    queue->tail = (queue->tail + 1) % queue->size;
-    queue->count++;
+    /*
+     *    A timeout too long to represent is no timeout at all.
+     */
+    return _aqueue_add_until(queue, task, now + ns < now ? 0 : now + ns);
+}
 
-#if __unix__
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
+/*
+ *    Gets a task from the queue, blocking until one is available.
+ *    The task is copied out, so the slot may be reused immediately.
+ *
+ *    @param aqueue_t *queue    The queue to get the task from.
+ *    @param task_t   *task     Where to store the task.
+ *
+ *    @return int    0 on success.
+ */
+int aqueue_get(aqueue_t *queue, task_t *task) {
+    aqueue_get_many(queue, task, 1);
 
     return 0;
 }
 
 /*
- *    Gets a task from the queue.
+ *    Gets a task from the queue without blocking.
  *
  *    @param aqueue_t *queue    The queue to get the task from.
+ *    @param task_t   *task     Where to store the task.
  *
- *    @return task_t*    The task.
- */
-task_t *aqueue_get(aqueue_t *queue) {
-#if __unix__
-    pthread_mutex_lock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-
-    queue->waiting++;
-    while (queue->count == 0) {
-#if __unix__
-        pthread_cond_wait(&queue->cond, &queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
+ *    @return int    0 on success, -1 if the queue is empty.
+ */
+int aqueue_try_get(aqueue_t *queue, task_t *task) {
+    return _aqueue_take(queue, task, 1) == 1 ? 0 : -1;
+}
+
+/*
+ *    Gets a batch of tasks from the queue, blocking until at least
+ *    one is available.
+ *
+ *    @param aqueue_t     *queue    The queue to get the tasks from.
+ *    @param task_t       *tasks    The array to store the tasks in.
+ *    @param unsigned long max      The maximum number of tasks to get.
+ *
+ *    @return unsigned long    The number of tasks stored.
+ */
+unsigned long aqueue_get_many(aqueue_t *queue, task_t *tasks,
+                              unsigned long max) {
+    _aqueue_poll_t poll;
+    unsigned long  n;
+    unsigned int   key;
+    int            slept = 0;
+
+    if (max == 0)
+        return 0;
+
+    poll.queue = queue;
+    poll.tasks = tasks;
+    poll.max   = max;
+
+    __atomic_fetch_add(&queue->waiting, 1, __ATOMIC_RELAXED);
+
+    while ((n = _aqueue_take(queue, tasks, max)) == 0) {
+        slept = 1;
+
+        if (sync_backoff(&queue->backoff, &queue->event, _aqueue_poll, &poll)) {
+            n = poll.n;
+            break;
+        }
+
+        key = sync_event_prepare(&queue->event);
+
+        if ((n = _aqueue_take(queue, tasks, max)) != 0) {
+            sync_event_cancel(&queue->event);
+            break;
+        }
+
+        sync_event_wait(&queue->event, key);
     }
-    queue->waiting--;
 
-    task_t *task = &queue->tasks[queue->head];
-    queue->head  = (queue->head + 1) % queue->size;
-    queue->count--;
+    __atomic_fetch_sub(&queue->waiting, 1, __ATOMIC_RELAXED);
 
-#if __unix__
-    pthread_mutex_unlock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
+    /*
+     *    Producers only wake one sleeper per burst, and none while
+     *    somebody spins, so pass the wake-up along if there is more
+     *    work behind us.
+     */
+    if (slept && __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) !=
+                     __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST))
+        sync_event_notify(&queue->event, 1);
 
-    return task;
+    return n;
 }
 
 /*
@@ -167,19 +435,19 @@ task_t *aqueue_get(aqueue_t *queue) {
  *    @return int    The count of accessors waiting on the queue.
  */
 int aqueue_waiting(aqueue_t *queue) {
-#if __unix__
-    pthread_mutex_lock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-
-    int waiting = queue->waiting;
-
-#if __unix__
-    pthread_mutex_unlock(&queue->lock);
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
-
-    return waiting;
-}
\ No newline at end of file
+    return (int)__atomic_load_n(&queue->waiting, __ATOMIC_RELAXED);
+}
+
+/*
+ *    Returns the queue counters of the calling thread.
+ *
+ *    @return aqueue_stats_t*    The counters.
+ */
+aqueue_stats_t *aqueue_thread_stats(void) { return _aqueue_counters(); }
+
+/*
+ *    Makes the calling thread count into stats from now on.
+ *
+ *    @param aqueue_stats_t *stats    The counters, 0 for the thread's own.
+ */
+void aqueue_thread_stats_set(aqueue_stats_t *stats) { _aqueue_stats = stats; }
@@ -7,38 +7,69 @@
  *    library for the Chik engine and her games.
  *
  *    This file provides the declaration for an async queue.
+ *
+ *    The queue is a bounded multi-producer/multi-consumer ring
+ *    where every slot carries a sequence number, so producers
+ *    and consumers only ever contend on a single compare and
+ *    swap of the tail or the head. Consumers that find the ring
+ *    empty spin and yield for an adaptive while before they sleep
+ *    on a futex.
  */
 #ifndef CHIK_AQUEUE_H
 #define CHIK_AQUEUE_H
 
-#if __unix__
-#include <pthread.h>
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
+#include "sync.h"
 
 typedef struct {
     void *(*fun)(void *);
     void *arg;
+    void *group; /* Completion group, owned by the submitter.  */
+
+    unsigned int  priority; /* Priority class, see thread.h.        */
+    unsigned long time;     /* Submission time, for wait statistics. */
+    unsigned long flow;     /* Profiler flow from the submitter.     */
 } task_t;
 
 typedef struct {
-    task_t       *tasks;
-    unsigned long size;
-    unsigned long head;
-    unsigned long tail;
-    unsigned long count;
+    unsigned long seq;
+    task_t        task;
+} aqueue_slot_t;
+
+/*
+ *    Every thread counts the slow paths it takes through any queue.
+ *    The counters are only written by their thread.
+ */
+typedef struct {
+    unsigned long retries; /* Claims lost to another thread.        */
+    unsigned long full;    /* Adds that found a queue full.         */
+    unsigned long empty;   /* Takes that found a queue empty.       */
+} aqueue_stats_t;
+
+typedef struct {
+    aqueue_slot_t *slots;
+    unsigned long  size;
+    unsigned long  mask;
+
+    /*
+     *    Producers and consumers each get their own cache line.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long tail;
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long head;
+
+    /*
+     *    Producers waiting for room, signalled by the consumers.
+     */
+    sync_event_t space;
+
+    sync_backoff_t backoff;
+
+    CHIK_ALIGNED(CHIK_CACHE_LINE) sync_event_t event;
     unsigned long waiting;
-#if __unix__
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
-#else
-//#error "Unsupported platform"
-#endif /* __unix__  */
 } aqueue_t;
 
 /*
  *    Creates a new async queue.
+ *    The size is rounded up to the next power of two, at least two.
  *
  *    @param unsigned long size    The size of the queue.
  *
@@ -64,13 +95,74 @@ void aqueue_destroy(aqueue_t *queue);
 int aqueue_add(aqueue_t *queue, task_t *task);
 
 /*
- *    Gets a task from the queue.
+ *    Adds as many tasks as fit to the queue. Their slots are claimed
+ *    with a single swap of the tail, and up to that many sleeping
+ *    consumers are woken.
+ *
+ *    @param aqueue_t     *queue    The queue to add the tasks to.
+ *    @param task_t       *tasks    The tasks to add.
+ *    @param unsigned long count    The number of tasks to add.
+ *
+ *    @return unsigned long    The number of tasks added.
+ */
+unsigned long aqueue_add_many(aqueue_t *queue, task_t *tasks,
+                              unsigned long count);
+
+/*
+ *    Adds a task to the queue, waiting for room if it is full.
+ *
+ *    @param aqueue_t *queue    The queue to add the task to.
+ *    @param task_t   *task     The task to add.
+ *
+ *    @return int    0 on success.
+ */
+int aqueue_add_wait(aqueue_t *queue, task_t *task);
+
+/*
+ *    Adds a task to the queue, waiting at most ns nanoseconds for
+ *    room if it is full.
+ *
+ *    @param aqueue_t     *queue    The queue to add the task to.
+ *    @param task_t       *task     The task to add.
+ *    @param unsigned long ns       The timeout in nanoseconds.
+ *
+ *    @return int    0 on success, -1 on timeout.
+ */
+int aqueue_add_timeout(aqueue_t *queue, task_t *task, unsigned long ns);
+
+/*
+ *    Gets a task from the queue, blocking until one is available.
+ *    The task is copied out, so the slot may be reused immediately.
+ *
+ *    @param aqueue_t *queue    The queue to get the task from.
+ *    @param task_t   *task     Where to store the task.
+ *
+ *    @return int    0 on success.
+ */
+int aqueue_get(aqueue_t *queue, task_t *task);
+
+/*
+ *    Gets a task from the queue without blocking.
  *
  *    @param aqueue_t *queue    The queue to get the task from.
+ *    @param task_t   *task     Where to store the task.
+ *
+ *    @return int    0 on success, -1 if the queue is empty.
+ */
+int aqueue_try_get(aqueue_t *queue, task_t *task);
+
+/*
+ *    Gets a batch of tasks from the queue, blocking until at least
+ *    one is available.
  *
- *    @return task_t*    The task.
+ *    @param aqueue_t     *queue    The queue to get the tasks from.
+ *    @param task_t       *tasks    The array to store the tasks in.
+ *    @param unsigned long max      The maximum number of tasks to get.
+ *
+ *    @return unsigned long    The number of tasks stored.
  */
-task_t *aqueue_get(aqueue_t *queue);
+unsigned long aqueue_get_many(aqueue_t *queue, task_t *tasks,
+                              unsigned long max);
 
 /*
  *    Returns the count of accessors waiting on the queue.
@@ -81,4 +173,22 @@ task_t *aqueue_get(aqueue_t *queue);
  */
 int aqueue_waiting(aqueue_t *queue);
 
+/*
+ *    Returns the queue counters of the calling thread. They live and
+ *    die with the thread, unless aqueue_thread_stats_set() gave it
+ *    counters of the caller's.
+ *
+ *    @return aqueue_stats_t*    The counters.
+ */
+aqueue_stats_t *aqueue_thread_stats(void);
+
+/*
+ *    Makes the calling thread count into the given counters from now
+ *    on, so others can read them without depending on the thread's
+ *    lifetime. Only one thread at a time may count into them.
+ *
+ *    @param aqueue_stats_t *stats    The counters, 0 for the thread's own.
+ */
+void aqueue_thread_stats_set(aqueue_stats_t *stats);
+
 #endif /* CHIK_AQUEUE_H  */
\ No newline at end of file
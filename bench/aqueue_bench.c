@@ -0,0 +1,325 @@
+/*
+ *    aqueue_bench.c    --    Throughput and latency benchmark for aqueue
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file measures the async queue against a queue guarded by a
+ *    mutex, the way aqueue used to be, with 1 to 64 threads. Half of
+ *    the threads add tasks and half take them, a single thread does
+ *    both in turn. Every task carries the time it was added, so the
+ *    consumers also measure how long tasks sit in the queue.
+ *
+ *    Producers wait for room with aqueue_add_wait(), which sleeps like
+ *    the mutex queue's producers do. Retrying aqueue_add() with a
+ *    yield in between keeps the cpu from consumers that went to
+ *    sleep, and the ring falls well behind the mutex with 4 to 32
+ *    threads on few cores.
+ *
+ *    It isn't part of the library build, build it from the root with:
+ *
+ *        cc -O2 -I. bench/aqueue_bench.c aqueue.c sync.c log.c \
+ *            -o aqueue_bench -lpthread
+ *
+ *    and run it as aqueue_bench [tasks] [size].
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aqueue.h"
+
+#define AQUEUE_BENCH_TASKS   2000000UL
+#define AQUEUE_BENCH_SIZE    1024
+#define AQUEUE_BENCH_THREADS 64
+
+/*
+ *    The queue aqueue replaced: a ring under a mutex, with condition
+ *    variables for room and for work.
+ */
+typedef struct {
+    task_t         *tasks;
+    unsigned long   size;
+    unsigned long   head;
+    unsigned long   count;
+    pthread_mutex_t lock;
+    pthread_cond_t  space;
+    pthread_cond_t  work;
+} _mutex_queue_t;
+
+typedef struct {
+    int             ring;
+    aqueue_t       *queue;
+    _mutex_queue_t *mutex;
+    unsigned long   tasks;   /* Per producer.                          */
+    unsigned long   latency; /* Nanoseconds, summed over all tasks.    */
+    unsigned long   taken;
+} _aqueue_bench_t;
+
+/*
+ *    Creates a mutex queue.
+ *
+ *    @param unsigned long size    The number of tasks it holds.
+ *
+ *    @return _mutex_queue_t*    The queue, or 0 on failure.
+ */
+static _mutex_queue_t *_mutex_queue_new(unsigned long size) {
+    _mutex_queue_t *queue = (_mutex_queue_t *)calloc(1, sizeof(_mutex_queue_t));
+
+    if (queue == 0)
+        return 0;
+
+    queue->tasks = (task_t *)calloc(size, sizeof(task_t));
+    if (queue->tasks == 0) {
+        free(queue);
+        return 0;
+    }
+
+    queue->size = size;
+    pthread_mutex_init(&queue->lock, 0);
+    pthread_cond_init(&queue->space, 0);
+    pthread_cond_init(&queue->work, 0);
+
+    return queue;
+}
+
+/*
+ *    Destroys a mutex queue.
+ *
+ *    @param _mutex_queue_t *queue    The queue.
+ */
+static void _mutex_queue_destroy(_mutex_queue_t *queue) {
+    pthread_cond_destroy(&queue->work);
+    pthread_cond_destroy(&queue->space);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->tasks);
+    free(queue);
+}
+
+/*
+ *    Adds a task to a mutex queue, waiting for room.
+ *
+ *    @param _mutex_queue_t *queue    The queue.
+ *    @param task_t         *task     The task.
+ */
+static void _mutex_queue_add(_mutex_queue_t *queue, task_t *task) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->size)
+        pthread_cond_wait(&queue->space, &queue->lock);
+
+    queue->tasks[(queue->head + queue->count) % queue->size] = *task;
+    queue->count++;
+
+    pthread_cond_signal(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ *    Takes a task from a mutex queue, waiting for one.
+ *
+ *    @param _mutex_queue_t *queue    The queue.
+ *    @param task_t         *task     Where to store the task.
+ */
+static void _mutex_queue_get(_mutex_queue_t *queue, task_t *task) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->work, &queue->lock);
+
+    *task       = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+
+    pthread_cond_signal(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ *    Adds a task to the queue under test.
+ *
+ *    @param _aqueue_bench_t *bench    The benchmark.
+ *    @param task_t          *task     The task.
+ */
+static void _aqueue_bench_add(_aqueue_bench_t *bench, task_t *task) {
+    task->time = sync_now();
+
+    if (bench->ring)
+        aqueue_add_wait(bench->queue, task);
+    else
+        _mutex_queue_add(bench->mutex, task);
+}
+
+/*
+ *    Takes a task from the queue under test and counts its latency.
+ *
+ *    @param _aqueue_bench_t *bench    The benchmark.
+ *    @param task_t          *task     Where to store the task.
+ *
+ *    @return unsigned long    The latency of the task in nanoseconds.
+ */
+static unsigned long _aqueue_bench_get(_aqueue_bench_t *bench, task_t *task) {
+    if (bench->ring)
+        aqueue_get(bench->queue, task);
+    else
+        _mutex_queue_get(bench->mutex, task);
+
+    return sync_now() - task->time;
+}
+
+/*
+ *    Adds the producer's share of tasks.
+ *
+ *    @param void *arg    The benchmark.
+ *
+ *    @return void*    Always 0.
+ */
+static void *_aqueue_bench_produce(void *arg) {
+    _aqueue_bench_t *bench = (_aqueue_bench_t *)arg;
+    task_t           task  = {0};
+    unsigned long    i;
+
+    task.arg = (void *)1;
+
+    for (i = 0; i < bench->tasks; i++)
+        _aqueue_bench_add(bench, &task);
+
+    return 0;
+}
+
+/*
+ *    Takes tasks until it gets the one telling it to stop, one
+ *    without an argument.
+ *
+ *    @param void *arg    The benchmark.
+ *
+ *    @return void*    Always 0.
+ */
+static void *_aqueue_bench_consume(void *arg) {
+    _aqueue_bench_t *bench   = (_aqueue_bench_t *)arg;
+    unsigned long    latency = 0;
+    unsigned long    taken   = 0;
+    unsigned long    time;
+    task_t           task;
+
+    while (1) {
+        time = _aqueue_bench_get(bench, &task);
+
+        if (task.arg == 0)
+            break;
+
+        latency += time;
+        taken++;
+    }
+
+    __atomic_fetch_add(&bench->latency, latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bench->taken, taken, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ *    Runs one configuration and prints its throughput and the mean
+ *    latency of its tasks.
+ *
+ *    @param int           ring       Non-zero for aqueue, 0 for the mutex.
+ *    @param int           threads    The number of threads.
+ *    @param unsigned long tasks      The number of tasks to transfer.
+ *    @param unsigned long size       The size of the queue.
+ *
+ *    @return int    0 on success, -1 on failure.
+ */
+static int _aqueue_bench_run(int ring, int threads, unsigned long tasks,
+                             unsigned long size) {
+    _aqueue_bench_t bench;
+    pthread_t       ids[AQUEUE_BENCH_THREADS];
+    task_t          task = {0};
+    unsigned long   start;
+    unsigned long   time;
+    int             producers = threads / 2;
+    int             i;
+
+    bench.ring    = ring;
+    bench.queue   = ring ? aqueue_new(size) : 0;
+    bench.mutex   = ring ? 0 : _mutex_queue_new(size);
+    bench.latency = 0;
+    bench.taken   = 0;
+
+    if (bench.queue == 0 && bench.mutex == 0) {
+        fprintf(stderr, "Could not create a queue of %lu\n", size);
+        return -1;
+    }
+
+    start = sync_now();
+
+    if (threads == 1) {
+        /*
+         *    A single thread adds a task and takes it right back.
+         */
+        task.arg = (void *)1;
+
+        for (i = 0; (unsigned long)i < tasks; i++) {
+            _aqueue_bench_add(&bench, &task);
+            bench.latency += _aqueue_bench_get(&bench, &task);
+        }
+
+        bench.taken = tasks;
+    } else {
+        bench.tasks = tasks / (unsigned long)producers;
+
+        for (i = 0; i < threads; i++)
+            pthread_create(&ids[i], 0,
+                           i < producers ? _aqueue_bench_produce
+                                         : _aqueue_bench_consume,
+                           &bench);
+
+        for (i = 0; i < producers; i++)
+            pthread_join(ids[i], 0);
+
+        for (i = producers; i < threads; i++)
+            _aqueue_bench_add(&bench, &task);
+
+        for (i = producers; i < threads; i++)
+            pthread_join(ids[i], 0);
+    }
+
+    time = sync_now() - start;
+
+    if (ring)
+        aqueue_destroy(bench.queue);
+    else
+        _mutex_queue_destroy(bench.mutex);
+
+    printf("%2d threads %-5s: %6.2f Mops/s, %8.1f us mean latency\n", threads,
+           ring ? "ring" : "mutex", (double)bench.taken * 1000.0 / (double)time,
+           bench.taken != 0
+               ? (double)bench.latency / (double)bench.taken / 1000.0
+               : 0.0);
+    fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long tasks = AQUEUE_BENCH_TASKS;
+    unsigned long size  = AQUEUE_BENCH_SIZE;
+    int           threads;
+    int           ring;
+
+    if (argc > 1)
+        tasks = strtoul(argv[1], 0, 0);
+
+    if (argc > 2)
+        size = strtoul(argv[2], 0, 0);
+
+    for (threads = 1; threads <= AQUEUE_BENCH_THREADS; threads *= 2) {
+        for (ring = 0; ring < 2; ring++) {
+            if (_aqueue_bench_run(ring, threads, tasks, size) != 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
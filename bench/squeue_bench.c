@@ -0,0 +1,190 @@
+/*
+ *    squeue_bench.c    --    Throughput benchmark for squeue
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file measures how many items a producer thread gets through
+ *    a single producer/consumer queue to a consumer thread, pushing
+ *    and popping in batches of 1 to 64, polling and blocking.
+ *
+ *    It isn't part of the library build, build it from the root with:
+ *
+ *        cc -O2 -I. bench/squeue_bench.c squeue.c sync.c log.c \
+ *            -o squeue_bench -lpthread
+ *
+ *    and run it as squeue_bench [items] [size].
+ *
+ *    Single items come out well below the batched rates, as every
+ *    push and pop pays for its own index update, and a blocking
+ *    queue adds a fence per push. Only batched push and pop reach
+ *    hundreds of millions of items a second.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "squeue.h"
+
+#define SQUEUE_BENCH_ITEMS 200000000UL
+#define SQUEUE_BENCH_SIZE  4096
+#define SQUEUE_BENCH_BATCH 64
+
+typedef struct {
+    squeue_t     *queue;
+    unsigned long items;
+    unsigned long batch;
+    unsigned long sum;
+} _squeue_bench_t;
+
+/*
+ *    Lets the other side run. Yielding rather than spinning keeps
+ *    the numbers meaningful with both threads on a single core.
+ */
+static void _squeue_bench_backoff(void) { sched_yield(); }
+
+/*
+ *    Pushes the items 1 to items, batch at a time.
+ *
+ *    @param void *arg    The benchmark.
+ *
+ *    @return void*    Always 0.
+ */
+static void *_squeue_bench_produce(void *arg) {
+    _squeue_bench_t *bench = (_squeue_bench_t *)arg;
+    void            *items[SQUEUE_BENCH_BATCH];
+    unsigned long    next = 1;
+    unsigned long    done;
+    unsigned long    n;
+    unsigned long    i;
+
+    while (next <= bench->items) {
+        n = bench->batch;
+        if (n > bench->items - next + 1)
+            n = bench->items - next + 1;
+
+        for (i = 0; i < n; i++)
+            items[i] = (void *)(next + i);
+
+        done = 0;
+        while (done < n) {
+            if (n == 1)
+                done += squeue_push(bench->queue, items[0]) == 0;
+            else
+                done += squeue_push_many(bench->queue, items + done, n - done);
+
+            if (done < n)
+                _squeue_bench_backoff();
+        }
+
+        next += n;
+    }
+
+    return 0;
+}
+
+/*
+ *    Pops every item, batch at a time, and sums them up so the
+ *    transfer can be checked.
+ *
+ *    @param _squeue_bench_t *bench    The benchmark.
+ */
+static void _squeue_bench_consume(_squeue_bench_t *bench) {
+    void         *items[SQUEUE_BENCH_BATCH];
+    unsigned long got = 0;
+    unsigned long n;
+    unsigned long i;
+
+    while (got < bench->items) {
+        if (bench->queue->blocking)
+            n = squeue_wait(bench->queue, items, bench->batch);
+        else if (bench->batch == 1)
+            n = squeue_pop(bench->queue, items) == 0;
+        else
+            n = squeue_pop_many(bench->queue, items, bench->batch);
+
+        if (n == 0) {
+            _squeue_bench_backoff();
+            continue;
+        }
+
+        for (i = 0; i < n; i++)
+            bench->sum += (unsigned long)items[i];
+
+        got += n;
+    }
+}
+
+/*
+ *    Runs one configuration and prints its throughput.
+ *
+ *    @param unsigned long items       The number of items to transfer.
+ *    @param unsigned long size        The size of the queue.
+ *    @param unsigned long batch       The batch size.
+ *    @param int           blocking    Non-zero for a blocking queue.
+ *
+ *    @return int    0 on success, -1 if the items didn't arrive intact.
+ */
+static int _squeue_bench_run(unsigned long items, unsigned long size,
+                             unsigned long batch, int blocking) {
+    _squeue_bench_t bench;
+    pthread_t       producer;
+    unsigned long   start;
+    unsigned long   time;
+
+    bench.queue = squeue_new(size, blocking);
+    bench.items = items;
+    bench.batch = batch;
+    bench.sum   = 0;
+
+    if (bench.queue == 0) {
+        fprintf(stderr, "Could not create a queue of %lu\n", size);
+        return -1;
+    }
+
+    start = sync_now();
+
+    pthread_create(&producer, 0, _squeue_bench_produce, &bench);
+    _squeue_bench_consume(&bench);
+    pthread_join(producer, 0);
+
+    time = sync_now() - start;
+
+    squeue_destroy(bench.queue);
+
+    printf("%-8s batch %2lu: %8.1f Mops/s\n", blocking ? "blocking" : "polling",
+           batch, (double)items * 1000.0 / (double)time);
+    fflush(stdout);
+
+    if (bench.sum != items * (items + 1) / 2) {
+        fprintf(stderr, "Items were lost or duplicated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long items = SQUEUE_BENCH_ITEMS;
+    unsigned long size  = SQUEUE_BENCH_SIZE;
+    unsigned long batch;
+    int           blocking;
+
+    if (argc > 1)
+        items = strtoul(argv[1], 0, 0);
+
+    if (argc > 2)
+        size = strtoul(argv[2], 0, 0);
+
+    for (blocking = 0; blocking < 2; blocking++) {
+        for (batch = 1; batch <= SQUEUE_BENCH_BATCH; batch *= 4) {
+            if (_squeue_bench_run(items, size, batch, blocking) != 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ *    deque.c    --    Source for work-stealing deque
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file provides the definition of the work-stealing deque,
+ *    following the C11 formulation of the Chase-Lev deque by
+ *    Le, Pop, Cohen and Zappa Nardelli.
+ */
+#include "deque.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+
+/*
+ *    Task slots are read by thieves while the owner may be writing
+ *    them, so every field is accessed atomically. A torn read is
+ *    harmless since the thief's compare and swap will fail.
+ */
+#define DEQUE_LOAD(slot, task)                                               \
+    do {                                                                     \
+        (task)->fun   = __atomic_load_n(&(slot)->fun, __ATOMIC_RELAXED);    \
+        (task)->arg   = __atomic_load_n(&(slot)->arg, __ATOMIC_RELAXED);    \
+        (task)->group = __atomic_load_n(&(slot)->group, __ATOMIC_RELAXED);  \
+        (task)->priority =                                                   \
+            __atomic_load_n(&(slot)->priority, __ATOMIC_RELAXED);            \
+        (task)->time = __atomic_load_n(&(slot)->time, __ATOMIC_RELAXED);    \
+        (task)->flow = __atomic_load_n(&(slot)->flow, __ATOMIC_RELAXED);    \
+    } while (0)
+
+#define DEQUE_STORE(slot, task)                                              \
+    do {                                                                     \
+        __atomic_store_n(&(slot)->fun, (task)->fun, __ATOMIC_RELAXED);      \
+        __atomic_store_n(&(slot)->arg, (task)->arg, __ATOMIC_RELAXED);      \
+        __atomic_store_n(&(slot)->group, (task)->group, __ATOMIC_RELAXED);  \
+        __atomic_store_n(&(slot)->priority, (task)->priority,                \
+                         __ATOMIC_RELAXED);                                  \
+        __atomic_store_n(&(slot)->time, (task)->time, __ATOMIC_RELAXED);    \
+        __atomic_store_n(&(slot)->flow, (task)->flow, __ATOMIC_RELAXED);    \
+    } while (0)
+
+/*
+ *    Creates a new work-stealing deque.
+ *    The size is rounded up to the next power of two.
+ *
+ *    @param unsigned long size    The size of the deque.
+ *
+ *    @return deque_t*    A pointer to the new deque.
+ */
+deque_t *deque_new(unsigned long size) {
+    unsigned long cap;
+    deque_t      *deque;
+
+    if (size == 0) {
+        LOGF_ERR("Invalid deque size\n");
+        return nullptr;
+    }
+
+    for (cap = 1; cap < size; cap <<= 1)
+        ;
+
+    deque = (deque_t *)aligned_alloc(CHIK_CACHE_LINE, sizeof(deque_t));
+
+    if (deque == nullptr) {
+        LOGF_ERR("Failed to allocate memory for deque\n");
+        return nullptr;
+    }
+
+    deque->tasks = (task_t *)malloc(sizeof(task_t) * cap);
+
+    if (deque->tasks == nullptr) {
+        LOGF_ERR("Failed to allocate memory for deque tasks\n");
+        free(deque);
+        return nullptr;
+    }
+
+    deque->size   = cap;
+    deque->mask   = cap - 1;
+    deque->top    = 0;
+    deque->bottom = 0;
+
+    return deque;
+}
+
+/*
+ *    Destroys a work-stealing deque.
+ *
+ *    @param deque_t *deque    The deque to destroy.
+ */
+void deque_destroy(deque_t *deque) {
+    free(deque->tasks);
+    free(deque);
+}
+
+/*
+ *    Pushes a task onto the bottom of the deque. Owner only.
+ *
+ *    @param deque_t *deque    The deque to push onto.
+ *    @param task_t  *task     The task to push.
+ *
+ *    @return int    0 on success, -1 if the deque is full.
+ */
+int deque_push(deque_t *deque, task_t *task) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= (long)deque->size)
+        return -1;
+
+    DEQUE_STORE(&deque->tasks[b & deque->mask], task);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ *    Pops the most recently pushed task. Owner only.
+ *
+ *    @param deque_t *deque    The deque to pop from.
+ *    @param task_t  *task     Where to store the task.
+ *
+ *    @return int    0 on success, -1 if the deque is empty.
+ */
+int deque_pop(deque_t *deque, task_t *task) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    int  ret = 0;
+
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    DEQUE_LOAD(&deque->tasks[b & deque->mask], task);
+
+    if (t == b) {
+        /*
+         *    Last task, race the thieves for it.
+         */
+        if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ret = -1;
+
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return ret;
+}
+
+/*
+ *    Steals the oldest task from the deque. Any thread.
+ *
+ *    @param deque_t *deque    The deque to steal from.
+ *    @param task_t  *task     Where to store the task.
+ *
+ *    @return int    0 on success, -1 if the deque is empty, 1 if another
+ *                   thread won the race and the steal may be retried.
+ */
+int deque_steal(deque_t *deque, task_t *task) {
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long b;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return -1;
+
+    DEQUE_LOAD(&deque->tasks[t & deque->mask], task);
+
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 1;
+
+    return 0;
+}
+
+/*
+ *    Returns an estimate of the number of tasks in the deque.
+ *
+ *    @param deque_t *deque    The deque to check.
+ *
+ *    @return unsigned long    The number of tasks.
+ */
+unsigned long deque_count(deque_t *deque) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+    return b > t ? (unsigned long)(b - t) : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ *    deque.h    --    Header for work-stealing deque
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file provides the declaration for a bounded Chase-Lev
+ *    deque. The owning thread pushes and pops tasks at the bottom
+ *    without any atomic read-modify-write in the common case,
+ *    while other threads steal from the top.
+ */
+#ifndef CHIK_DEQUE_H
+#define CHIK_DEQUE_H
+
+#include "aqueue.h"
+
+typedef struct {
+    task_t       *tasks;
+    unsigned long size;
+    unsigned long mask;
+
+    CHIK_ALIGNED(CHIK_CACHE_LINE) long top;
+    CHIK_ALIGNED(CHIK_CACHE_LINE) long bottom;
+} deque_t;
+
+/*
+ *    Creates a new work-stealing deque.
+ *    The size is rounded up to the next power of two.
+ *
+ *    @param unsigned long size    The size of the deque.
+ *
+ *    @return deque_t*    A pointer to the new deque.
+ */
+deque_t *deque_new(unsigned long size);
+
+/*
+ *    Destroys a work-stealing deque.
+ *
+ *    @param deque_t *deque    The deque to destroy.
+ */
+void deque_destroy(deque_t *deque);
+
+/*
+ *    Pushes a task onto the bottom of the deque. Owner only.
+ *
+ *    @param deque_t *deque    The deque to push onto.
+ *    @param task_t  *task     The task to push.
+ *
+ *    @return int    0 on success, -1 if the deque is full.
+ */
+int deque_push(deque_t *deque, task_t *task);
+
+/*
+ *    Pops the most recently pushed task. Owner only.
+ *
+ *    @param deque_t *deque    The deque to pop from.
+ *    @param task_t  *task     Where to store the task.
+ *
+ *    @return int    0 on success, -1 if the deque is empty.
+ */
+int deque_pop(deque_t *deque, task_t *task);
+
+/*
+ *    Steals the oldest task from the deque. Any thread.
+ *
+ *    @param deque_t *deque    The deque to steal from.
+ *    @param task_t  *task     Where to store the task.
+ *
+ *    @return int    0 on success, -1 if the deque is empty, 1 if another
+ *                   thread won the race and the steal may be retried.
+ */
+int deque_steal(deque_t *deque, task_t *task);
+
+/*
+ *    Returns an estimate of the number of tasks in the deque.
+ *
+ *    @param deque_t *deque    The deque to check.
+ *
+ *    @return unsigned long    The number of tasks.
+ */
+unsigned long deque_count(deque_t *deque);
+
+#endif /* CHIK_DEQUE_H  */
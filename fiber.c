@@ -0,0 +1,323 @@
+/*
+ *    fiber.c    --    source for user-space fibers
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file defines fibers, their context switch and the pool
+ *    their stacks are kept in. Stacks are expensive to map, so a
+ *    finished fiber goes back to the pool and its stack is reused
+ *    by the next one.
+ */
+#include "fiber.h"
+
+#include <malloc.h>
+
+#if __unix__
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
+#include "log.h"
+
+__thread fiber_t *_fiber_current = 0;
+
+fiber_t *_fiber_pool = 0;
+#if __unix__
+pthread_mutex_t _fiber_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* __unix__  */
+
+#ifndef LIBCHIK_FIBER_UCONTEXT
+/*
+ *    Saves the callee-saved registers on the current stack, stores
+ *    the stack pointer in *from and continues on the stack in to.
+ *    A fresh stack starts in _fiber_start, which calls the function
+ *    in the second saved register with the first one as argument.
+ */
+void _fiber_switch(void **from, void *to);
+void _fiber_start(void);
+
+#if defined(__x86_64__)
+__asm__(".text\n"
+        ".p2align 4\n"
+        "_fiber_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        "_fiber_start:\n"
+        "    movq %rbx, %rdi\n"
+        "    andq $-16, %rsp\n"
+        "    callq *%r12\n"
+        "    ud2\n");
+
+#define FIBER_FRAME_WORDS 9
+#define FIBER_FRAME_ARG   5
+#define FIBER_FRAME_FUN   4
+#define FIBER_FRAME_RET   7
+#elif defined(__aarch64__)
+__asm__(".text\n"
+        ".p2align 4\n"
+        "_fiber_switch:\n"
+        "    sub sp, sp, #160\n"
+        "    stp x19, x20, [sp, #0]\n"
+        "    stp x21, x22, [sp, #16]\n"
+        "    stp x23, x24, [sp, #32]\n"
+        "    stp x25, x26, [sp, #48]\n"
+        "    stp x27, x28, [sp, #64]\n"
+        "    stp x29, x30, [sp, #80]\n"
+        "    stp d8, d9, [sp, #96]\n"
+        "    stp d10, d11, [sp, #112]\n"
+        "    stp d12, d13, [sp, #128]\n"
+        "    stp d14, d15, [sp, #144]\n"
+        "    mov x2, sp\n"
+        "    str x2, [x0]\n"
+        "    mov sp, x1\n"
+        "    ldp x19, x20, [sp, #0]\n"
+        "    ldp x21, x22, [sp, #16]\n"
+        "    ldp x23, x24, [sp, #32]\n"
+        "    ldp x25, x26, [sp, #48]\n"
+        "    ldp x27, x28, [sp, #64]\n"
+        "    ldp x29, x30, [sp, #80]\n"
+        "    ldp d8, d9, [sp, #96]\n"
+        "    ldp d10, d11, [sp, #112]\n"
+        "    ldp d12, d13, [sp, #128]\n"
+        "    ldp d14, d15, [sp, #144]\n"
+        "    add sp, sp, #160\n"
+        "    ret\n"
+        "_fiber_start:\n"
+        "    mov x0, x19\n"
+        "    blr x20\n"
+        "    brk #0\n");
+
+#define FIBER_FRAME_WORDS 20
+#define FIBER_FRAME_ARG   0
+#define FIBER_FRAME_FUN   1
+#define FIBER_FRAME_RET   11
+#endif /* __x86_64__  */
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+/*
+ *    Runs a fiber's function and switches back for good.
+ *
+ *    @param fiber_t *fiber    The fiber.
+ */
+static void _fiber_main(fiber_t *fiber) {
+    fiber->result = fiber->fun(fiber->arg);
+    fiber->done   = 1;
+
+    fiber_suspend();
+}
+
+#ifdef LIBCHIK_FIBER_UCONTEXT
+/*
+ *    The ucontext entry point. makecontext() can only pass int
+ *    arguments portably, so the fiber is taken from the thread.
+ */
+static void _fiber_ucontext_main(void) { _fiber_main(_fiber_current); }
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+/*
+ *    Allocates a fiber and its stack. On unix the stack gets a guard
+ *    page below it, so an overflow faults instead of corrupting the
+ *    neighbouring memory.
+ *
+ *    @return fiber_t*    The fiber, or 0 on failure.
+ */
+static fiber_t *_fiber_alloc(void) {
+    fiber_t *fiber = (fiber_t *)calloc(1, sizeof(fiber_t));
+
+    if (fiber == 0) {
+        LOGF_ERR("Could not allocate memory for fiber.\n");
+        return 0;
+    }
+
+    fiber->stack_size = LIBCHIK_FIBER_STACK_SIZE;
+
+#if __unix__
+    long page = sysconf(_SC_PAGESIZE);
+
+    fiber->stack = (char *)mmap(0, fiber->stack_size + page,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+    if (fiber->stack == MAP_FAILED) {
+        LOGF_ERR("Could not map fiber stack.\n");
+        free(fiber);
+        return 0;
+    }
+
+    mprotect(fiber->stack, page, PROT_NONE);
+    fiber->stack += page;
+#else
+    fiber->stack = (char *)malloc(fiber->stack_size);
+
+    if (fiber->stack == 0) {
+        LOGF_ERR("Could not allocate fiber stack.\n");
+        free(fiber);
+        return 0;
+    }
+#endif /* __unix__  */
+
+    return fiber;
+}
+
+/*
+ *    Takes a fiber from the pool and prepares it to run a function.
+ *
+ *    @param void *(*fun)(void *)    The function to run on the fiber.
+ *    @param void *arg               The argument to pass to the function.
+ *
+ *    @return fiber_t*    The fiber, or 0 on failure.
+ *                        Should be released with fiber_free().
+ */
+fiber_t *fiber_new(void *(*fun)(void *), void *arg) {
+    fiber_t *fiber;
+
+#if __unix__
+    pthread_mutex_lock(&_fiber_lock);
+#endif /* __unix__  */
+
+    fiber = _fiber_pool;
+    if (fiber != 0)
+        _fiber_pool = fiber->next;
+
+#if __unix__
+    pthread_mutex_unlock(&_fiber_lock);
+#endif /* __unix__  */
+
+    if (fiber == 0 && (fiber = _fiber_alloc()) == 0)
+        return 0;
+
+    fiber->fun      = fun;
+    fiber->arg      = arg;
+    fiber->result   = 0;
+    fiber->done     = 0;
+    fiber->pool     = 0;
+    fiber->group    = 0;
+    fiber->wait_fun = 0;
+    fiber->wait_arg = 0;
+    fiber->next     = 0;
+
+#ifdef LIBCHIK_FIBER_UCONTEXT
+    getcontext(&fiber->ctx);
+
+    fiber->ctx.uc_stack.ss_sp   = fiber->stack;
+    fiber->ctx.uc_stack.ss_size = fiber->stack_size;
+    fiber->ctx.uc_link          = 0;
+
+    makecontext(&fiber->ctx, _fiber_ucontext_main, 0);
+#else
+    /*
+     *    Lay out the frame _fiber_switch() expects to pop, returning
+     *    into _fiber_start with the fiber and _fiber_main in the
+     *    registers it reads them from.
+     */
+    void **frame = (void **)(((unsigned long)(fiber->stack + fiber->stack_size) &
+                              ~15UL)) - FIBER_FRAME_WORDS;
+    int    i;
+
+    for (i = 0; i < FIBER_FRAME_WORDS; i++)
+        frame[i] = 0;
+
+#if defined(__x86_64__)
+    /*
+     *    Default MXCSR and x87 control words.
+     */
+    ((unsigned int *)frame)[0] = 0x1F80;
+    ((unsigned int *)frame)[1] = 0x037F;
+#endif /* __x86_64__  */
+
+    frame[FIBER_FRAME_ARG] = fiber;
+    frame[FIBER_FRAME_FUN] = (void *)_fiber_main;
+    frame[FIBER_FRAME_RET] = (void *)_fiber_start;
+
+    fiber->sp = frame;
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+    return fiber;
+}
+
+/*
+ *    Returns a fiber to the pool. The fiber must not be running.
+ *
+ *    @param fiber_t *fiber    The fiber.
+ */
+void fiber_free(fiber_t *fiber) {
+    if (fiber == 0)
+        return;
+
+#if __unix__
+    pthread_mutex_lock(&_fiber_lock);
+#endif /* __unix__  */
+
+    fiber->next = _fiber_pool;
+    _fiber_pool = fiber;
+
+#if __unix__
+    pthread_mutex_unlock(&_fiber_lock);
+#endif /* __unix__  */
+}
+
+/*
+ *    Switches to a fiber. Returns once the fiber suspends itself or
+ *    its function returns, in which case fiber->done is set.
+ *
+ *    @param fiber_t *fiber    The fiber to run.
+ */
+void fiber_resume(fiber_t *fiber) {
+    fiber_t *prev = _fiber_current;
+
+    _fiber_current = fiber;
+
+#ifdef LIBCHIK_FIBER_UCONTEXT
+    swapcontext(&fiber->caller, &fiber->ctx);
+#else
+    _fiber_switch(&fiber->caller_sp, fiber->sp);
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+    _fiber_current = prev;
+}
+
+/*
+ *    Suspends the running fiber and switches back to whoever resumed
+ *    it. Must be called from a fiber.
+ */
+void fiber_suspend(void) {
+    fiber_t *fiber = _fiber_current;
+
+#ifdef LIBCHIK_FIBER_UCONTEXT
+    swapcontext(&fiber->ctx, &fiber->caller);
+#else
+    _fiber_switch(&fiber->sp, fiber->caller_sp);
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+}
+
+/*
+ *    Returns the fiber running on the calling thread.
+ *
+ *    @return fiber_t*    The fiber, or 0 if the thread isn't on a fiber.
+ */
+fiber_t *fiber_current(void) { return _fiber_current; }
@@ -0,0 +1,98 @@
+/*
+ *    fiber.h    --    header for user-space fibers
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file declares fibers, small user-space execution contexts
+ *    with their own stacks. A fiber can suspend itself in the middle
+ *    of a function and be resumed later, which is what lets a job
+ *    wait on another job without blocking the thread it runs on.
+ *
+ *    On x86-64 and aarch64 the switch only saves the callee-saved
+ *    registers. Other platforms, or builds that define
+ *    LIBCHIK_FIBER_UCONTEXT, fall back to ucontext.
+ */
+#ifndef LIBCHIK_FIBER_H
+#define LIBCHIK_FIBER_H
+
+#if !defined(LIBCHIK_FIBER_UCONTEXT) &&                                      \
+    !defined(__x86_64__) && !defined(__aarch64__)
+#define LIBCHIK_FIBER_UCONTEXT
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+#ifdef LIBCHIK_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+#define LIBCHIK_FIBER_STACK_SIZE (64 * 1024)
+
+typedef struct fiber_s {
+    void *sp;
+    void *caller_sp;
+#ifdef LIBCHIK_FIBER_UCONTEXT
+    ucontext_t ctx;
+    ucontext_t caller;
+#endif /* LIBCHIK_FIBER_UCONTEXT  */
+
+    char         *stack;
+    unsigned long stack_size;
+
+    void *(*fun)(void *);
+    void *arg;
+    void *result;
+    int   done;
+
+    /*
+     *    Scheduler state, owned by whoever resumes the fiber.
+     */
+    void *pool;
+    void *group;
+    int (*wait_fun)(void *);
+    void *wait_arg;
+
+    struct fiber_s *next;
+} fiber_t;
+
+/*
+ *    Takes a fiber from the pool and prepares it to run a function.
+ *
+ *    @param void *(*fun)(void *)    The function to run on the fiber.
+ *    @param void *arg               The argument to pass to the function.
+ *
+ *    @return fiber_t*    The fiber, or 0 on failure.
+ *                        Should be released with fiber_free().
+ */
+fiber_t *fiber_new(void *(*fun)(void *), void *arg);
+
+/*
+ *    Returns a fiber to the pool. The fiber must not be running.
+ *
+ *    @param fiber_t *fiber    The fiber.
+ */
+void fiber_free(fiber_t *fiber);
+
+/*
+ *    Switches to a fiber. Returns once the fiber suspends itself or
+ *    its function returns, in which case fiber->done is set.
+ *
+ *    @param fiber_t *fiber    The fiber to run.
+ */
+void fiber_resume(fiber_t *fiber);
+
+/*
+ *    Suspends the running fiber and switches back to whoever resumed
+ *    it. Must be called from a fiber.
+ */
+void fiber_suspend(void);
+
+/*
+ *    Returns the fiber running on the calling thread.
+ *
+ *    @return fiber_t*    The fiber, or 0 if the thread isn't on a fiber.
+ */
+fiber_t *fiber_current(void);
+
+#endif /* LIBCHIK_FIBER_H  */
@@ -0,0 +1,413 @@
+/*
+ *    frame.c    --    source for per-frame job scheduling
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file defines the frame scheduler. The jobs of a frame form
+ *    one threadpool group that frame_end() waits on. Jobs that must
+ *    finish within the frame go into the high priority class, jobs
+ *    that may be deferred into the normal one. Deferred jobs are kept
+ *    on a lock-free stack until the next frame begins.
+ */
+#include "frame.h"
+
+#include <malloc.h>
+#include <string.h>
+
+#include "log.h"
+#include "profiler.h"
+#include "sync.h"
+
+threadpool_t      *_frame_pool = 0;
+threadpool_group_t _frame_group;
+
+unsigned long _frame_start  = 0;
+unsigned long _frame_budget = 0;
+unsigned long _frame_index  = 0;
+
+/*
+ *    A frame is active from frame_begin() until frame_end() returns.
+ *    It only takes submissions from outside its jobs while it is open,
+ *    which ends when the barrier starts; from then on deferrable jobs
+ *    that haven't started are deferred.
+ */
+unsigned int _frame_active   = 0;
+unsigned int _frame_open     = 0;
+unsigned int _frame_closing  = 0;
+unsigned int _frame_entering = 0;
+
+frame_job_t  *_frame_deferred = 0;
+frame_stats_t _frame_current;
+frame_stats_t _frame_last;
+
+__thread unsigned int _frame_running = 0;
+
+/*
+ *    The profiler counters frame_end() records, registered on first use.
+ */
+unsigned int _frame_jobs_region     = CHIK_PROFILER_NO_REGION;
+unsigned int _frame_late_region     = CHIK_PROFILER_NO_REGION;
+unsigned int _frame_deferred_region = CHIK_PROFILER_NO_REGION;
+
+/*
+ *    Records the value of a profiler counter, registering its name the
+ *    first time.
+ *
+ *    @param unsigned int *region    Where the ID of the counter is kept.
+ *    @param const char   *name      The name of the counter.
+ *    @param long          value     The value.
+ */
+static void _frame_counter(unsigned int *region, const char *name,
+                           long value) {
+    unsigned int id = __atomic_load_n(region, __ATOMIC_RELAXED);
+
+    if (id == CHIK_PROFILER_NO_REGION) {
+        id = chik_profiler_region(name);
+        __atomic_store_n(region, id, __ATOMIC_RELAXED);
+    }
+
+    chik_profiler_counter(id, value);
+}
+
+/*
+ *    Pushes a job onto the stack of jobs for the next frame.
+ *
+ *    @param frame_job_t *job    The job.
+ */
+static void _frame_defer(frame_job_t *job) {
+    job->next = __atomic_load_n(&_frame_deferred, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&_frame_deferred, &job->next, job, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ *    Returns the time a job is due at.
+ *
+ *    @param frame_job_t *job    The job.
+ *
+ *    @return unsigned long    The sync_now() time, or -1 if the job
+ *                             has no deadline.
+ */
+static unsigned long _frame_due(frame_job_t *job) {
+    unsigned long deadline = job->deadline != 0 ? job->deadline : _frame_budget;
+
+    if (deadline == 0)
+        return (unsigned long)-1;
+
+    return __atomic_load_n(&_frame_start, __ATOMIC_RELAXED) + deadline;
+}
+
+/*
+ *    Runs a frame job, or defers it if it may wait and would start
+ *    late. Everything needed is read from the job before it runs, as
+ *    the job may submit itself again.
+ *
+ *    @param void *arg    The job.
+ *
+ *    @return void *    Unused.
+ */
+static void *_frame_job_task(void *arg) {
+    frame_job_t  *job = (frame_job_t *)arg;
+    unsigned long due = _frame_due(job);
+    unsigned int  prev;
+    int           owned;
+    void *(*fun)(void *);
+    void         *fun_arg;
+
+    if (job->carried == 0 && (job->flags & FRAME_JOB_DEFER) &&
+        (__atomic_load_n(&_frame_closing, __ATOMIC_ACQUIRE) ||
+         sync_now() > due)) {
+        job->carried = 1;
+        _frame_defer(job);
+        __atomic_fetch_add(&_frame_current.deferred, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    fun          = job->fun;
+    fun_arg      = job->arg;
+    owned        = job->owned;
+    job->carried = 0;
+
+    prev           = _frame_running;
+    _frame_running = 1;
+
+    fun(fun_arg);
+
+    _frame_running = prev;
+
+    if (owned)
+        free(job);
+
+    __atomic_fetch_add(&_frame_current.jobs, 1, __ATOMIC_RELAXED);
+
+    if (sync_now() > due)
+        __atomic_fetch_add(&_frame_current.late, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ *    Submits a job into the group of the current frame. If the pool
+ *    won't take it, the job runs on the calling thread instead.
+ *
+ *    @param frame_job_t *job    The job.
+ */
+static void _frame_dispatch(frame_job_t *job) {
+    threadpool_priority_e priority = THREADPOOL_PRIORITY_HIGH;
+
+    if (job->carried == 0 && (job->flags & FRAME_JOB_DEFER))
+        priority = THREADPOOL_PRIORITY_NORMAL;
+
+    if (threadpool_submit_to(_frame_pool, &_frame_group, priority,
+                             _frame_job_task, job) != 0)
+        _frame_job_task(job);
+}
+
+/*
+ *    Submits the jobs waiting for the next frame, oldest first.
+ */
+static void _frame_dispatch_deferred(void) {
+    frame_job_t *list;
+    frame_job_t *prev = 0;
+    frame_job_t *next;
+
+    list = __atomic_exchange_n(&_frame_deferred, 0, __ATOMIC_ACQUIRE);
+
+    while (list != 0) {
+        next       = list->next;
+        list->next = prev;
+        prev       = list;
+        list       = next;
+    }
+
+    while (prev != 0) {
+        next = prev->next;
+        _frame_dispatch(prev);
+        prev = next;
+    }
+}
+
+/*
+ *    Sets the threadpool frame jobs run on. Without a call to this,
+ *    they run on the default threadpool. Must not be called while a
+ *    frame is open.
+ *
+ *    @param threadpool_t *pool    The pool, 0 for the default one.
+ */
+void frame_init(threadpool_t *pool) { _frame_pool = pool; }
+
+/*
+ *    Starts a frame. Jobs deferred from the last frame, or submitted
+ *    between frames, are submitted first.
+ *
+ *    @param unsigned long budget    The length the frame should take in
+ *                                   nanoseconds, the deadline of jobs
+ *                                   that don't have one.
+ *
+ *    @return int    0 on success, -1 if a frame is already open.
+ */
+int frame_begin(unsigned long budget) {
+    if (_frame_active) {
+        LOGF_ERR("Frame is already open\n");
+        return -1;
+    }
+
+    if (_frame_pool == 0)
+        _frame_pool = threadpool_default();
+
+    chik_profiler_frame(_frame_index);
+
+    memset(&_frame_current, 0, sizeof(frame_stats_t));
+    _frame_current.index = _frame_index;
+
+    _frame_budget = budget;
+    __atomic_store_n(&_frame_start, sync_now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&_frame_active, 1, __ATOMIC_RELEASE);
+
+    _frame_dispatch_deferred();
+
+    /*
+     *    Jobs submitted while the frame was opening may have gone
+     *    onto the stack after it was taken.
+     */
+    __atomic_store_n(&_frame_open, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&_frame_entering, __ATOMIC_SEQ_CST) != 0)
+        sync_pause();
+
+    _frame_dispatch_deferred();
+
+    return 0;
+}
+
+/*
+ *    Ends a frame, running jobs of the frame on the calling thread
+ *    until every one of them has run or been deferred.
+ *
+ *    @return int    0 on success, -1 if no frame is open.
+ */
+int frame_end(void) {
+    if (!_frame_active) {
+        LOGF_ERR("No frame is open\n");
+        return -1;
+    }
+
+    __atomic_store_n(&_frame_closing, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&_frame_open, 0, __ATOMIC_SEQ_CST);
+
+    /*
+     *    A submitter that saw the frame open has its job in the group
+     *    once it leaves, so waiting for the group can't miss it.
+     */
+    while (__atomic_load_n(&_frame_entering, __ATOMIC_SEQ_CST) != 0)
+        sync_pause();
+
+    threadpool_group_wait_pool(_frame_pool, &_frame_group);
+
+    _frame_current.time = sync_now() - _frame_start;
+    _frame_last         = _frame_current;
+
+    _frame_counter(&_frame_jobs_region, "Frame jobs",
+                   (long)_frame_current.jobs);
+    _frame_counter(&_frame_late_region, "Frame late jobs",
+                   (long)_frame_current.late);
+    _frame_counter(&_frame_deferred_region, "Frame deferred jobs",
+                   (long)_frame_current.deferred);
+
+    __atomic_store_n(&_frame_index, _frame_index + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&_frame_closing, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_frame_active, 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ *    Initializes a frame job.
+ *
+ *    @param frame_job_t *job         The job to initialize.
+ *    @param void *(*fun)(void *)     The function to execute.
+ *    @param void *arg                The argument to pass to the function.
+ *    @param unsigned long deadline   Nanoseconds after the frame starts,
+ *                                    0 for the end of the frame's budget.
+ *    @param unsigned int  flags      FRAME_JOB_* flags.
+ */
+void frame_job_init(frame_job_t *job, void *(*fun)(void *), void *arg,
+                    unsigned long deadline, unsigned int flags) {
+    job->fun      = fun;
+    job->arg      = arg;
+    job->deadline = deadline;
+    job->flags    = flags;
+    job->carried  = 0;
+    job->owned    = 0;
+    job->next     = 0;
+}
+
+/*
+ *    Submits a job to the current frame, or to the next one if no
+ *    frame is open. The job must stay alive until it has run.
+ *    Jobs submitted by a running frame job always join its frame.
+ *
+ *    @param frame_job_t *job    The job.
+ *
+ *    @return int    0 on success, -1 on failure.
+ */
+int frame_job_submit(frame_job_t *job) {
+    if (job->fun == 0) {
+        LOGF_ERR("Frame job has no function\n");
+        return -1;
+    }
+
+    /*
+     *    The running job keeps the group busy, so the frame can't
+     *    finish before this one is in it.
+     */
+    if (_frame_running) {
+        _frame_dispatch(job);
+        return 0;
+    }
+
+    __atomic_fetch_add(&_frame_entering, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&_frame_open, __ATOMIC_SEQ_CST))
+        _frame_dispatch(job);
+    else
+        _frame_defer(job);
+
+    __atomic_fetch_sub(&_frame_entering, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ *    Submits a function to the current frame like frame_job_submit(),
+ *    with a job that is allocated and freed by the scheduler.
+ *
+ *    @param void *(*fun)(void *)     The function to execute.
+ *    @param void *arg                The argument to pass to the function.
+ *    @param unsigned long deadline   Nanoseconds after the frame starts,
+ *                                    0 for the end of the frame's budget.
+ *    @param unsigned int  flags      FRAME_JOB_* flags.
+ *
+ *    @return int    0 on success, -1 on failure.
+ */
+int frame_submit(void *(*fun)(void *), void *arg, unsigned long deadline,
+                 unsigned int flags) {
+    frame_job_t *job = (frame_job_t *)malloc(sizeof(frame_job_t));
+
+    if (job == 0) {
+        LOGF_ERR("Failed to allocate frame job\n");
+        return -1;
+    }
+
+    frame_job_init(job, fun, arg, deadline, flags);
+    job->owned = 1;
+
+    if (frame_job_submit(job) != 0) {
+        free(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *    Returns the index of the current frame, or of the next one
+ *    between frames.
+ *
+ *    @return unsigned long    The index.
+ */
+unsigned long frame_index(void) {
+    return __atomic_load_n(&_frame_index, __ATOMIC_RELAXED);
+}
+
+/*
+ *    Returns how much of the current frame's budget is left, which
+ *    jobs can use to size their work.
+ *
+ *    @return unsigned long    The time left in nanoseconds, 0 if the
+ *                             budget is spent or no frame is open.
+ */
+unsigned long frame_remaining(void) {
+    unsigned long end;
+    unsigned long now;
+
+    if (!__atomic_load_n(&_frame_active, __ATOMIC_ACQUIRE))
+        return 0;
+
+    end = __atomic_load_n(&_frame_start, __ATOMIC_RELAXED) + _frame_budget;
+    now = sync_now();
+
+    return now < end ? end - now : 0;
+}
+
+/*
+ *    Reads the statistics of the last frame that ended.
+ *
+ *    @param frame_stats_t *stats    Where to store them.
+ */
+void frame_stats(frame_stats_t *stats) { *stats = _frame_last; }
@@ -0,0 +1,145 @@
+/*
+ *    frame.h    --    header for per-frame job scheduling
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file declares the frame scheduler. The engine brackets each
+ *    frame with frame_begin() and frame_end(), and modules submit jobs
+ *    from their chik_module_update() that should finish within the
+ *    frame. Every job has a deadline relative to the start of the
+ *    frame. Jobs that may wait are deferred to the next frame if they
+ *    would start after their deadline, so a busy frame sheds optional
+ *    work instead of running long.
+ *
+ *    frame_end() is a barrier: the calling thread helps run the jobs
+ *    of the frame until all of them have either run or been deferred.
+ */
+#ifndef LIBCHIK_FRAME_H
+#define LIBCHIK_FRAME_H
+
+#include "thread.h"
+
+/*
+ *    The job may be moved to the next frame if it would start late.
+ *    A deferred job runs early in the next frame and isn't deferred
+ *    again.
+ */
+#define FRAME_JOB_DEFER 1
+
+typedef struct frame_job_s {
+    void *(*fun)(void *);
+    void *arg;
+    unsigned long deadline; /* Nanoseconds after the frame starts,
+                               0 for the end of the frame's budget.   */
+    unsigned int  flags;
+    unsigned int  carried;  /* Deferred from an earlier frame.        */
+    int           owned;    /* Freed once it has run.                 */
+
+    struct frame_job_s *next;
+} frame_job_t;
+
+typedef struct {
+    unsigned long index;    /* The frame the statistics are for.         */
+    unsigned long jobs;     /* Jobs that ran during the frame.           */
+    unsigned long late;     /* Jobs that finished after their deadline.  */
+    unsigned long deferred; /* Jobs moved to the next frame.             */
+    unsigned long time;     /* Nanoseconds from frame_begin() until the
+                               barrier in frame_end() was through.      */
+} frame_stats_t;
+
+/*
+ *    Sets the threadpool frame jobs run on. Without a call to this,
+ *    they run on the default threadpool. Must not be called while a
+ *    frame is open.
+ *
+ *    @param threadpool_t *pool    The pool, 0 for the default one.
+ */
+void frame_init(threadpool_t *pool);
+
+/*
+ *    Starts a frame. Jobs deferred from the last frame, or submitted
+ *    between frames, are submitted first.
+ *
+ *    @param unsigned long budget    The length the frame should take in
+ *                                   nanoseconds, the deadline of jobs
+ *                                   that don't have one.
+ *
+ *    @return int    0 on success, -1 if a frame is already open.
+ */
+int frame_begin(unsigned long budget);
+
+/*
+ *    Ends a frame, running jobs of the frame on the calling thread
+ *    until every one of them has run or been deferred.
+ *
+ *    @return int    0 on success, -1 if no frame is open.
+ */
+int frame_end(void);
+
+/*
+ *    Initializes a frame job.
+ *
+ *    @param frame_job_t *job         The job to initialize.
+ *    @param void *(*fun)(void *)     The function to execute.
+ *    @param void *arg                The argument to pass to the function.
+ *    @param unsigned long deadline   Nanoseconds after the frame starts,
+ *                                    0 for the end of the frame's budget.
+ *    @param unsigned int  flags      FRAME_JOB_* flags.
+ */
+void frame_job_init(frame_job_t *job, void *(*fun)(void *), void *arg,
+                    unsigned long deadline, unsigned int flags);
+
+/*
+ *    Submits a job to the current frame, or to the next one if no
+ *    frame is open. The job must stay alive until it has run.
+ *    Jobs submitted by a running frame job always join its frame.
+ *
+ *    @param frame_job_t *job    The job.
+ *
+ *    @return int    0 on success, -1 on failure.
+ */
+int frame_job_submit(frame_job_t *job);
+
+/*
+ *    Submits a function to the current frame like frame_job_submit(),
+ *    with a job that is allocated and freed by the scheduler.
+ *
+ *    @param void *(*fun)(void *)     The function to execute.
+ *    @param void *arg                The argument to pass to the function.
+ *    @param unsigned long deadline   Nanoseconds after the frame starts,
+ *                                    0 for the end of the frame's budget.
+ *    @param unsigned int  flags      FRAME_JOB_* flags.
+ *
+ *    @return int    0 on success, -1 on failure.
+ */
+int frame_submit(void *(*fun)(void *), void *arg, unsigned long deadline,
+                 unsigned int flags);
+
+/*
+ *    Returns the index of the current frame, or of the next one
+ *    between frames.
+ *
+ *    @return unsigned long    The index.
+ */
+unsigned long frame_index(void);
+
+/*
+ *    Returns how much of the current frame's budget is left, which
+ *    jobs can use to size their work.
+ *
+ *    @return unsigned long    The time left in nanoseconds, 0 if the
+ *                             budget is spent or no frame is open.
+ */
+unsigned long frame_remaining(void);
+
+/*
+ *    Reads the statistics of the last frame that ended.
+ *
+ *    @param frame_stats_t *stats    Where to store them.
+ */
+void frame_stats(frame_stats_t *stats);
+
+#endif /* LIBCHIK_FRAME_H  */
@@ -0,0 +1,319 @@
+/*
+ *    future.c    --    source for task futures
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file defines futures. Free futures are kept on a lock-free
+ *    stack, and new ones are only allocated a chunk at a time when
+ *    the stack runs dry.
+ */
+#include "future.h"
+
+#include "fiber.h"
+#include "log.h"
+#include "sync.h"
+
+#define FUTURE_DONE ((future_t *)1)
+
+future_t     *_future_chunks[LIBCHIK_FUTURE_MAX_CHUNKS];
+unsigned int  _future_chunk_count = 0;
+unsigned long _future_free        = 0;
+
+#if __unix__
+pthread_mutex_t _future_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
+/*
+ *    Returns the future with the given pool index.
+ *
+ *    @param unsigned int index    The index.
+ *
+ *    @return future_t*    The future.
+ */
+static future_t *_future_at(unsigned int index) {
+    return &_future_chunks[index / LIBCHIK_FUTURE_CHUNK]
+                          [index % LIBCHIK_FUTURE_CHUNK];
+}
+
+/*
+ *    Pushes a linked run of futures onto the free stack. The head of
+ *    the stack holds the index of the top future plus one in its low
+ *    half, and a tag in its high half that defeats ABA.
+ *
+ *    @param future_t *first    The first future of the run.
+ *    @param future_t *last     The last future of the run.
+ */
+static void _future_push(future_t *first, future_t *last) {
+    unsigned long head = __atomic_load_n(&_future_free, __ATOMIC_RELAXED);
+    unsigned long next;
+
+    do {
+        __atomic_store_n(&last->free_next, (unsigned int)head, __ATOMIC_RELAXED);
+        next = ((head >> 32) + 1) << 32 | (first->index + 1);
+    } while (!__atomic_compare_exchange_n(&_future_free, &head, next, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ *    Takes a future from the pool, growing the pool if needed.
+ *
+ *    @return future_t*    The future, or 0 if the pool is exhausted.
+ */
+static future_t *_future_alloc(void) {
+    future_t     *future = 0;
+    future_t     *chunk;
+    unsigned long head;
+    unsigned long next;
+    unsigned int  i;
+
+    head = __atomic_load_n(&_future_free, __ATOMIC_ACQUIRE);
+    while ((unsigned int)head != 0) {
+        future = _future_at((unsigned int)head - 1);
+        next   = ((head >> 32) + 1) << 32 |
+               __atomic_load_n(&future->free_next, __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&_future_free, &head, next, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return future;
+    }
+
+#if __unix__
+    pthread_mutex_lock(&_future_lock);
+#endif /* __unix__  */
+
+    if (_future_chunk_count == LIBCHIK_FUTURE_MAX_CHUNKS) {
+        LOGF_ERR("Out of futures.\n");
+        future = 0;
+    } else {
+        chunk = (future_t *)calloc(LIBCHIK_FUTURE_CHUNK, sizeof(future_t));
+
+        if (chunk == 0) {
+            LOGF_ERR("Failed to allocate memory for futures.\n");
+            future = 0;
+        } else {
+            for (i = 0; i < LIBCHIK_FUTURE_CHUNK; i++) {
+                chunk[i].index =
+                    _future_chunk_count * LIBCHIK_FUTURE_CHUNK + i;
+                chunk[i].free_next = chunk[i].index + 2;
+            }
+
+            _future_chunks[_future_chunk_count] = chunk;
+            __atomic_store_n(&_future_chunk_count, _future_chunk_count + 1,
+                             __ATOMIC_RELEASE);
+
+            /*
+             *    Keep the first one, and give the rest to the pool.
+             */
+            future = &chunk[0];
+            _future_push(&chunk[1], &chunk[LIBCHIK_FUTURE_CHUNK - 1]);
+        }
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_future_lock);
+#endif /* __unix__  */
+
+    return future;
+}
+
+/*
+ *    Drops a reference to a future, returning it to the pool if it
+ *    was the last one.
+ *
+ *    @param future_t *future    The future.
+ */
+static void _future_release(future_t *future) {
+    if (__atomic_fetch_sub(&future->refs, 1, __ATOMIC_ACQ_REL) == 1)
+        _future_push(future, future);
+}
+
+/*
+ *    Takes a future from the pool and prepares it for a task. The
+ *    future starts with one reference for the task and one for the
+ *    caller.
+ *
+ *    @param void *(*fun)(void *)    The function to execute.
+ *    @param void *arg               The argument to pass to the function.
+ *
+ *    @return future_t*    The future, or 0 if the pool is exhausted.
+ */
+static future_t *_future_new(void *(*fun)(void *), void *arg) {
+    future_t *future = _future_alloc();
+
+    if (future == 0)
+        return 0;
+
+    future->fun     = fun;
+    future->arg     = arg;
+    future->result  = 0;
+    future->state   = 0;
+    future->waiters = 0;
+    future->refs    = 2;
+    future->then    = 0;
+    future->next    = 0;
+
+    return future;
+}
+
+static void *_future_task(void *arg);
+
+/*
+ *    Submits a future's task, running it inline if the pool is full.
+ *
+ *    @param future_t *future    The future.
+ */
+static void _future_dispatch(future_t *future) {
+    if (threadpool_submit(_future_task, future) != 0)
+        _future_task(future);
+}
+
+/*
+ *    Runs a future's task, publishes its result and releases the
+ *    continuations waiting on it.
+ *
+ *    @param void *arg    The future.
+ *
+ *    @return void*    Always 0.
+ */
+static void *_future_task(void *arg) {
+    future_t *future = (future_t *)arg;
+    future_t *then;
+    future_t *next;
+
+    future->result = future->fun(future->arg);
+
+    __atomic_store_n(&future->state, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&future->waiters, __ATOMIC_SEQ_CST) != 0)
+        threadpool_wake_parked();
+
+    then = __atomic_exchange_n(&future->then, FUTURE_DONE, __ATOMIC_ACQ_REL);
+    while (then != 0) {
+        next       = then->next;
+        then->arg  = future->result;
+        _future_dispatch(then);
+        then = next;
+    }
+
+    _future_release(future);
+
+    return 0;
+}
+
+/*
+ *    Submits a task to the current threadpool and returns a future
+ *    for its return value.
+ *
+ *    @param void *(*fun)(void *)    The function to execute.
+ *    @param void *arg               The argument to pass to the function.
+ *
+ *    @return future_t*    The future, or 0 on failure.
+ *                         Should be released with future_free().
+ */
+future_t *threadpool_submit_future(void *(*fun)(void *), void *arg) {
+    future_t *future = _future_new(fun, arg);
+
+    if (future == 0)
+        return 0;
+
+    if (threadpool_submit(_future_task, future) != 0) {
+        future->refs = 1;
+        _future_release(future);
+        return 0;
+    }
+
+    return future;
+}
+
+/*
+ *    Returns whether a future's task has finished.
+ *
+ *    @param future_t *future    The future.
+ *
+ *    @return int    1 if the result is available, 0 otherwise.
+ */
+int future_ready(future_t *future) {
+    return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != 0;
+}
+
+/*
+ *    future_ready() with the signature threadpool_wait_until() takes.
+ *
+ *    @param void *future    The future.
+ *
+ *    @return int    1 if the result is available, 0 otherwise.
+ */
+static int _future_wait_ready(void *future) {
+    return future_ready((future_t *)future);
+}
+
+/*
+ *    Waits for a future's task to finish and returns its result.
+ *    The calling thread runs queued tasks and its parked fibers while
+ *    it waits, and a fiber is parked instead.
+ *
+ *    @param future_t *future    The future.
+ *
+ *    @return void*    The task's return value.
+ */
+void *future_get(future_t *future) {
+    if (future_ready(future))
+        return future->result;
+
+    /*
+     *    Counted as a waiter, finishing the future wakes parked
+     *    fibers and threads sleeping in threadpool_wait_until().
+     */
+    __atomic_fetch_add(&future->waiters, 1, __ATOMIC_SEQ_CST);
+    threadpool_wait_until(_future_wait_ready, future);
+    __atomic_fetch_sub(&future->waiters, 1, __ATOMIC_RELAXED);
+
+    return future->result;
+}
+
+/*
+ *    Chains a task onto a future. Once the future's task finishes,
+ *    fun is submitted with the future's result as its argument.
+ *
+ *    @param future_t *future        The future to chain onto.
+ *    @param void *(*fun)(void *)    The function to execute.
+ *
+ *    @return future_t*    A future for the continuation, or 0 on failure.
+ *                         Should be released with future_free().
+ */
+future_t *future_then(future_t *future, void *(*fun)(void *)) {
+    future_t *then = _future_new(fun, 0);
+    future_t *head;
+
+    if (then == 0)
+        return 0;
+
+    head = __atomic_load_n(&future->then, __ATOMIC_ACQUIRE);
+    while (1) {
+        if (head == FUTURE_DONE) {
+            then->arg = future->result;
+            _future_dispatch(then);
+            break;
+        }
+
+        then->next = head;
+
+        if (__atomic_compare_exchange_n(&future->then, &head, then, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    return then;
+}
+
+/*
+ *    Releases a future. Its task keeps running if it hasn't finished.
+ *
+ *    @param future_t *future    The future to release.
+ */
+void future_free(future_t *future) { _future_release(future); }
@@ -0,0 +1,87 @@
+/*
+ *    future.h    --    header for task futures
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file declares futures, which capture the return value of
+ *    a task submitted to the current threadpool. Futures come from a
+ *    pool, so creating one doesn't allocate.
+ */
+#ifndef LIBCHIK_FUTURE_H
+#define LIBCHIK_FUTURE_H
+
+#include "thread.h"
+
+#define LIBCHIK_FUTURE_CHUNK      256
+#define LIBCHIK_FUTURE_MAX_CHUNKS 256
+
+typedef struct future_s {
+    void *(*fun)(void *);
+    void *arg;
+    void *result;
+
+    unsigned int state;
+    unsigned int waiters;
+    unsigned int refs;
+    unsigned int index;
+    unsigned int free_next;
+
+    struct future_s *then;
+    struct future_s *next;
+} future_t;
+
+/*
+ *    Submits a task to the current threadpool and returns a future
+ *    for its return value.
+ *
+ *    @param void *(*fun)(void *)    The function to execute.
+ *    @param void *arg               The argument to pass to the function.
+ *
+ *    @return future_t*    The future, or 0 on failure.
+ *                         Should be released with future_free().
+ */
+future_t *threadpool_submit_future(void *(*fun)(void *), void *arg);
+
+/*
+ *    Returns whether a future's task has finished.
+ *
+ *    @param future_t *future    The future.
+ *
+ *    @return int    1 if the result is available, 0 otherwise.
+ */
+int future_ready(future_t *future);
+
+/*
+ *    Waits for a future's task to finish and returns its result.
+ *    The calling thread runs queued tasks while it waits, and a
+ *    fiber is parked instead.
+ *
+ *    @param future_t *future    The future.
+ *
+ *    @return void*    The task's return value.
+ */
+void *future_get(future_t *future);
+
+/*
+ *    Chains a task onto a future. Once the future's task finishes,
+ *    fun is submitted with the future's result as its argument.
+ *
+ *    @param future_t *future        The future to chain onto.
+ *    @param void *(*fun)(void *)    The function to execute.
+ *
+ *    @return future_t*    A future for the continuation, or 0 on failure.
+ *                         Should be released with future_free().
+ */
+future_t *future_then(future_t *future, void *(*fun)(void *));
+
+/*
+ *    Releases a future. Its task keeps running if it hasn't finished.
+ *
+ *    @param future_t *future    The future to release.
+ */
+void future_free(future_t *future);
+
+#endif /* LIBCHIK_FUTURE_H  */
@@ -15,7 +15,10 @@
 #include "app.h"
 #include "args.h"
 #include "dl.h"
+#include "fiber.h"
 #include "file.h"
+#include "frame.h"
+#include "future.h"
 #include "log.h"
 #include "chik_math.h"
 #include "mempool.h"
@@ -261,6 +261,53 @@ void mempool_free(mempool_t *pool, char *data) {
     chunk->flags = MEMFLAG_FREE;
 }
 
+/*
+ *    Allocates from the free end of the memory pool without tracking
+ *    a chunk, which makes the pool a bump arena. Memory allocated
+ *    this way is released with mempool_reset(), not mempool_free().
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *    @param long size             Size of the allocation in bytes.
+ *    @param long align            Alignment, a power of two.
+ *
+ *    @return char *           Pointer to the allocation.
+ *                           Returns NULL if the pool is out of room.
+ */
+char *mempool_bump(mempool_t *pool, long size, long align) {
+    char *buf;
+
+    buf = (char *)(((unsigned long)pool->cur + align - 1) &
+                   ~(unsigned long)(align - 1));
+
+    if (size < 0 || buf + size > pool->end)
+        return 0;
+
+    pool->cur = buf + size;
+
+    return buf;
+}
+
+/*
+ *    Returns the free end of the memory pool, to release everything
+ *    bumped after it later with mempool_reset().
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *
+ *    @return char *           The mark.
+ */
+char *mempool_mark(mempool_t *pool) { return pool->cur; }
+
+/*
+ *    Releases everything bumped since a mark was taken.
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *    @param char *mark             The mark, NULL to release everything
+ *                                  that was bumped.
+ */
+void mempool_reset(mempool_t *pool, char *mark) {
+    pool->cur = mark != 0 ? mark : pool->buf;
+}
+
 /*
  *    Destroys a memory pool.
  *
@@ -72,6 +72,39 @@ char *mempool_alloc(mempool_t *pool, long size);
  */
 void mempool_free(mempool_t *pool, char *data);
 
+/*
+ *    Allocates from the free end of the memory pool without tracking
+ *    a chunk, which makes the pool a bump arena. Memory allocated
+ *    this way is released with mempool_reset(), not mempool_free().
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *    @param long size             Size of the allocation in bytes.
+ *    @param long align            Alignment, a power of two.
+ *
+ *    @return char *           Pointer to the allocation.
+ *                           Returns NULL if the pool is out of room.
+ */
+char *mempool_bump(mempool_t *pool, long size, long align);
+
+/*
+ *    Returns the free end of the memory pool, to release everything
+ *    bumped after it later with mempool_reset().
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *
+ *    @return char *           The mark.
+ */
+char *mempool_mark(mempool_t *pool);
+
+/*
+ *    Releases everything bumped since a mark was taken.
+ *
+ *    @param mempool_t *pool      Pointer to the memory pool.
+ *    @param char *mark             The mark, NULL to release everything
+ *                                  that was bumped.
+ */
+void mempool_reset(mempool_t *pool, char *mark);
+
 /*
  *    Destroys a memory pool.
  *
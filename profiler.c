@@ -6,123 +6,1347 @@
  *    This file is part of the Chik library, a general purpose
  *    library for the Chik engine and her games.
  *
- *    This file defines the profiler, which is used to 
+ *    This file defines the profiler, which is used to
  *    label a section of code and measure its performance.
+ *
+ *    Each thread owns a ring of events, a single producer single
+ *    consumer queue: the thread advances the head, the collector the
+ *    tail. Ends carry the depth they return to instead of a region,
+ *    the collector matches them with the begin at that depth, so a
+ *    dropped event loses at most the regions around it.
+ *
+ *    While a capture runs, the collector also keeps what it consumes
+ *    as timeline records: a slice for every region that ended, and
+ *    the counters, flows and frame marks as they were recorded.
  */
+#if __linux__
+#define _GNU_SOURCE
+#endif /* __linux__  */
+
 #include "profiler.h"
 
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __linux__
+#include <sys/syscall.h>
+#endif /* __linux__  */
+
+#if __unix__
+#include <pthread.h>
+#include <unistd.h>
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
 #include "log.h"
+#include "sync.h"
+
+#define _CHIK_PROFILER_RING_MASK (CHIK_PROFILER_RING_SIZE - 1)
+#define _CHIK_PROFILER_REGION_MASK (CHIK_PROFILER_MAX_REGIONS - 1)
 
-_profiled_t _profiled[_CHIK_PROFILER_MAX_PROFILED];
+#define _CHIK_PROFILER_IDLE      0
+#define _CHIK_PROFILER_ARMED     1
+#define _CHIK_PROFILER_CAPTURING 2
 
-_profiled_stack_t *_profiled_stack = (_profiled_stack_t *)0x0;
+typedef struct _profiler_thread_s {
+    chik_profiler_event_t events[CHIK_PROFILER_RING_SIZE];
+
+    /*
+     *    Written by the thread.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long head;
+    unsigned long dropped;
+    unsigned int  depth;
+    int           exited;
+
+    /*
+     *    Written by the collector, which also keeps the begins that
+     *    are still open.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long tail;
+    unsigned int          top;
+    chik_profiler_event_t open[CHIK_PROFILER_MAX_DEPTH];
+    unsigned long         nodes[CHIK_PROFILER_MAX_DEPTH];
+    unsigned long         traced; /* The last capture it was in.  */
+
+    unsigned long tid;
+    char          name[16];
+
+    struct _profiler_thread_s *next;
+} _profiler_thread_t;
 
 /*
- *    Initializes the profiler.
- *    This function must be called before any other profiler functions.
+ *    A node of the call tree. Node 0 is the root, which is no region
+ *    and also stands for nodes that couldn't be allocated.
  */
-void chik_profiler_init() {
-#if 0
-    for (unsigned long i = 0; i < _CHIK_PROFILER_MAX_PROFILED; ++i) {
-        _profiled[i].name          = (char *)0x0;
-        _profiled[i].calls         = 0;
-        _profiled[i].total_time_s  = 0;
-        _profiled[i].total_time_ns = 0;
+typedef struct {
+    unsigned int  region;
+    unsigned long parent;
+    unsigned long child;    /* The first child.                      */
+    unsigned long sibling;  /* The next child of the parent.         */
+    unsigned long calls;
+    unsigned long time;
+    unsigned long children; /* Time spent in the children.           */
+    unsigned long min;
+    unsigned long max;
+} _profiler_node_t;
+
+typedef struct {
+    unsigned long time;   /* The start of slices.                   */
+    unsigned long arg;    /* The duration of slices, or the event's. */
+    unsigned long tid;
+    unsigned int  region;
+    unsigned int  type;   /* chik_profiler_event_e, END for slices.  */
+} _profiler_record_t;
+
+typedef struct {
+    unsigned long tid;
+    char          name[16];
+} _profiler_track_t;
+
+typedef struct {
+    unsigned int  state;
+    unsigned long frames; /* Frames to capture.                    */
+    unsigned long done;   /* Frames started since the capture did.  */
+    unsigned long start;
+    unsigned long generation;
+    char          path[256];
+
+    _profiler_record_t *records;
+    unsigned long       count;
+    unsigned long       size;
+    unsigned long       lost;
+
+    _profiler_track_t *tracks;
+    unsigned long      track_count;
+    unsigned long      track_size;
+} _profiler_capture_t;
+
+/*
+ *    The ID of a region is its slot in the table. Slot 0 takes the
+ *    regions that didn't fit, once _profiler_full is set no more are
+ *    added.
+ */
+const char   *_profiler_names[CHIK_PROFILER_MAX_REGIONS] = {"Other"};
+unsigned long _profiler_count                             = 1;
+unsigned int  _profiler_full                              = 0;
+
+chik_profiler_stats_t _profiler_totals[CHIK_PROFILER_MAX_REGIONS];
+
+_profiler_node_t *_profiler_nodes      = 0;
+unsigned long     _profiler_node_count = 0;
+unsigned long     _profiler_node_size  = 0;
+
+unsigned long _profiler_dropped = 0;
+
+unsigned int        _profiler_enabled = 0;
+_profiler_thread_t *_profiler_threads = 0;
+
+__thread _profiler_thread_t *_profiler_self = 0;
+
+_profiler_capture_t _profiler_capture;
+unsigned long       _profiler_flows = 0;
+
+#if __unix__
+pthread_mutex_t _profiler_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t   _profiler_key;
+pthread_once_t  _profiler_once = PTHREAD_ONCE_INIT;
+#endif /* __unix__  */
+
+/*
+ *    Hashes the name of a region.
+ *
+ *    @param const char *name    The name.
+ *
+ *    @return unsigned long    The hash.
+ */
+static unsigned long _profiler_hash(const char *name) {
+    unsigned long hash = 14695981039346656037UL;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char)*name++) * 1099511628211UL;
+
+    return hash;
+}
+
+/*
+ *    Marks the ring of a thread that exits, so the collector frees it
+ *    once it is drained.
+ *
+ *    @param void *self    The thread's ring.
+ */
+static void _profiler_thread_exit(void *self) {
+    _profiler_self = 0;
+
+    __atomic_store_n(&((_profiler_thread_t *)self)->exited, 1,
+                     __ATOMIC_RELEASE);
+}
+
+#if __unix__
+/*
+ *    Creates the key rings are released through.
+ */
+static void _profiler_key_init(void) {
+    pthread_key_create(&_profiler_key, _profiler_thread_exit);
+}
+#endif /* __unix__  */
+
+/*
+ *    Gives the calling thread a ring.
+ *
+ *    @return _profiler_thread_t *    The ring, or 0 on failure.
+ */
+static _profiler_thread_t *_profiler_register(void) {
+    _profiler_thread_t *self;
+
+    self = (_profiler_thread_t *)aligned_alloc(CHIK_CACHE_LINE,
+                                               sizeof(_profiler_thread_t));
+
+    if (self == 0) {
+        LOGF_ERR("Failed to allocate profiler ring\n");
+        return 0;
     }
 
-    chik_profiler_begin("Chik Engine");
-#endif
+    memset(self, 0, sizeof(_profiler_thread_t));
+
+#if __linux__
+    self->tid = (unsigned long)syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), self->name, sizeof(self->name));
+#else
+    self->tid = (unsigned long)self;
+#endif /* __linux__  */
+
+#if __unix__
+    pthread_once(&_profiler_once, _profiler_key_init);
+    pthread_setspecific(_profiler_key, self);
+
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    self->next        = _profiler_threads;
+    _profiler_threads = self;
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    _profiler_self = self;
+
+    return self;
 }
 
 /*
- *    Begins profiling a function.
+ *    Appends an event to a thread's ring, or drops it if the ring is
+ *    full.
  *
- *    @param name    The name of the profiled region.
+ *    @param _profiler_thread_t *self      The calling thread's ring.
+ *    @param unsigned long       time      The time of the event.
+ *    @param unsigned long       arg       The argument of the event.
+ *    @param unsigned int        region    The region.
+ *    @param unsigned short      type      chik_profiler_event_e.
+ *    @param unsigned int        depth     The depth.
  */
-void chik_profiler_begin(const char *name) {
-#if 0
-    if (_profiled_stack == (_profiled_stack_t *)0x0) {
-        _profiled_stack = (_profiled_stack_t *)malloc(sizeof(_profiled_stack_t));
+static void _profiler_record(_profiler_thread_t *self, unsigned long time,
+                             unsigned long arg, unsigned int region,
+                             unsigned short type, unsigned int depth) {
+    chik_profiler_event_t *event;
+    unsigned long          head = self->head;
+
+    if (head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) >=
+        CHIK_PROFILER_RING_SIZE) {
+        __atomic_store_n(&self->dropped, self->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    event         = &self->events[head & _CHIK_PROFILER_RING_MASK];
+    event->time   = time;
+    event->arg    = arg;
+    event->region = region;
+    event->type   = type;
+    event->depth  = (unsigned short)depth;
+
+    __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *    Returns the child of a node for a region, adding it if there is
+ *    none yet.
+ *
+ *    @param unsigned long parent    The node.
+ *    @param unsigned int  region    The region.
+ *
+ *    @return unsigned long    The child, or 0 if it couldn't be added.
+ */
+static unsigned long _profiler_child(unsigned long parent, unsigned int region) {
+    _profiler_node_t *nodes;
+    _profiler_node_t *node;
+    unsigned long     size;
+    unsigned long     i;
+
+    for (i = _profiler_nodes[parent].child; i != 0; i = _profiler_nodes[i].sibling) {
+        if (_profiler_nodes[i].region == region)
+            return i;
+    }
 
-        _profiled_stack->name = name;
-        _profiled_stack->next = (_profiled_stack_t *)0x0;
-    } else {
-        _profiled_stack_t *new_stack = (_profiled_stack_t *)malloc(sizeof(_profiled_stack_t));
+    if (_profiler_node_count == _profiler_node_size) {
+        size  = _profiler_node_size * 2;
+        nodes = (_profiler_node_t *)realloc(_profiler_nodes,
+                                            sizeof(_profiler_node_t) * size);
 
-        new_stack->name = name;
-        new_stack->next = _profiled_stack;
+        if (nodes == 0) {
+            LOGF_ERR("Failed to grow the profiler call tree\n");
+            return 0;
+        }
 
-        _profiled_stack = new_stack;
+        _profiler_nodes     = nodes;
+        _profiler_node_size = size;
     }
 
-    for (unsigned long i = 0; i < _CHIK_PROFILER_MAX_PROFILED; ++i) {
-        if (_profiled[i].name != (char *)0x0 && strcmp(_profiled[i].name, name) == 0) {
-            ++_profiled[i].calls;
+    i    = _profiler_node_count++;
+    node = &_profiler_nodes[i];
 
-            clock_gettime(CLOCK_MONOTONIC, &_profiled[i].start);
+    memset(node, 0, sizeof(_profiler_node_t));
+    node->region  = region;
+    node->parent  = parent;
+    node->sibling = _profiler_nodes[parent].child;
+    node->min     = (unsigned long)-1;
 
+    _profiler_nodes[parent].child = i;
+
+    return i;
+}
+
+/*
+ *    Returns the node after another in depth-first order.
+ *
+ *    @param unsigned long node     The node.
+ *    @param unsigned int *depth    The depth of the node, updated to
+ *                                  that of the next one.
+ *
+ *    @return unsigned long    The next node, 0 after the last one.
+ */
+static unsigned long _profiler_next(unsigned long node, unsigned int *depth) {
+    if (_profiler_nodes[node].child != 0) {
+        (*depth)++;
+        return _profiler_nodes[node].child;
+    }
+
+    while (node != 0) {
+        if (_profiler_nodes[node].sibling != 0)
+            return _profiler_nodes[node].sibling;
+
+        node = _profiler_nodes[node].parent;
+        (*depth)--;
+    }
+
+    return 0;
+}
+
+/*
+ *    Appends a record to the capture.
+ *
+ *    @param _profiler_thread_t *thread    The thread it happened on.
+ *    @param unsigned int        type      chik_profiler_event_e.
+ *    @param unsigned int        region    The region.
+ *    @param unsigned long       time      The time.
+ *    @param unsigned long       arg       The argument.
+ */
+static void _profiler_trace(_profiler_thread_t *thread, unsigned int type,
+                            unsigned int region, unsigned long time,
+                            unsigned long arg) {
+    _profiler_capture_t *capture = &_profiler_capture;
+    _profiler_record_t  *records;
+    _profiler_track_t   *tracks;
+    unsigned long        size;
+
+    if (thread->traced != capture->generation) {
+        if (capture->track_count == capture->track_size) {
+            size   = capture->track_size != 0 ? capture->track_size * 2 : 16;
+            tracks = (_profiler_track_t *)realloc(capture->tracks,
+                                                  sizeof(_profiler_track_t) * size);
+
+            if (tracks == 0) {
+                capture->lost++;
+                return;
+            }
+
+            capture->tracks     = tracks;
+            capture->track_size = size;
+        }
+
+        capture->tracks[capture->track_count].tid = thread->tid;
+        memcpy(capture->tracks[capture->track_count].name, thread->name,
+               sizeof(thread->name));
+        capture->track_count++;
+
+        thread->traced = capture->generation;
+    }
+
+    if (capture->count == capture->size) {
+        size    = capture->size != 0 ? capture->size * 2 : 4096;
+        records = 0;
+
+        if (size <= CHIK_PROFILER_CAPTURE_MAX)
+            records = (_profiler_record_t *)realloc(capture->records,
+                                                    sizeof(_profiler_record_t) * size);
+
+        if (records == 0) {
+            capture->lost++;
             return;
         }
 
-        if (_profiled[i].name == (char *)0x0) {
-            _profiled[i].name = name;
-            ++_profiled[i].calls;
-            
-            clock_gettime(CLOCK_MONOTONIC, &_profiled[i].start);
+        capture->records = records;
+        capture->size    = size;
+    }
+
+    records         = &capture->records[capture->count++];
+    records->time   = time;
+    records->arg    = arg;
+    records->tid    = thread->tid;
+    records->region = region;
+    records->type   = type;
+}
+
+/*
+ *    Adds an event taken from a thread's ring to the totals, and to
+ *    the capture if one runs.
+ *
+ *    @param _profiler_thread_t    *thread    The thread.
+ *    @param chik_profiler_event_t *event     The event.
+ */
+static void _profiler_consume(_profiler_thread_t    *thread,
+                              chik_profiler_event_t *event) {
+    chik_profiler_stats_t *stats;
+    chik_profiler_event_t *begin;
+    _profiler_node_t      *node;
+    unsigned long          parent;
+    unsigned long          time;
+    unsigned long          start   = _profiler_capture.start;
+    int                    tracing = _profiler_capture.state ==
+                                     _CHIK_PROFILER_CAPTURING;
+
+    if (event->type != CHIK_PROFILER_BEGIN && event->type != CHIK_PROFILER_END) {
+        if (tracing && event->time >= start)
+            _profiler_trace(thread, event->type, event->region, event->time,
+                            event->arg);
+        return;
+    }
+
+    if (event->depth >= CHIK_PROFILER_MAX_DEPTH)
+        return;
+
+    if (event->type == CHIK_PROFILER_BEGIN) {
+        parent = 0;
+
+        if (event->depth > 0 && event->depth <= thread->top)
+            parent = thread->nodes[event->depth - 1];
+
+        thread->open[event->depth]  = *event;
+        thread->nodes[event->depth] = _profiler_child(parent, event->region);
+        thread->top                 = event->depth + 1;
+        return;
+    }
+
+    /*
+     *    The begin was dropped, or its region was deeper than what
+     *    the collector keeps.
+     */
+    if (event->depth >= thread->top)
+        return;
+
+    begin       = &thread->open[event->depth];
+    thread->top = event->depth;
+
+    time  = event->time - begin->time;
+    stats = &_profiler_totals[begin->region];
+    stats->calls++;
+    stats->time += time;
+
+    if (thread->nodes[event->depth] != 0) {
+        node = &_profiler_nodes[thread->nodes[event->depth]];
+        node->calls++;
+        node->time += time;
+
+        if (time < node->min)
+            node->min = time;
+
+        if (time > node->max)
+            node->max = time;
+
+        _profiler_nodes[node->parent].children += time;
+    }
+
+    /*
+     *    Regions that began before the capture are cut at its start.
+     */
+    if (tracing && event->time >= start) {
+        if (begin->time > start)
+            start = begin->time;
 
+        _profiler_trace(thread, CHIK_PROFILER_END, begin->region, start,
+                        event->time - start);
+    }
+}
+
+/*
+ *    Drains the rings of every thread, with the lock held.
+ */
+static void _profiler_collect(void) {
+    _profiler_thread_t **link;
+    _profiler_thread_t  *thread;
+    unsigned long        head;
+    unsigned long        tail;
+    int                  exited;
+
+    if (_profiler_nodes == 0) {
+        _profiler_nodes = (_profiler_node_t *)calloc(64, sizeof(_profiler_node_t));
+
+        if (_profiler_nodes == 0) {
+            LOGF_ERR("Failed to allocate the profiler call tree\n");
             return;
         }
+
+        _profiler_node_count = 1;
+        _profiler_node_size  = 64;
+    }
+
+    link = &_profiler_threads;
+
+    while ((thread = *link) != 0) {
+        /*
+         *    Once a thread has exited, everything it recorded is in.
+         */
+        exited = __atomic_load_n(&thread->exited, __ATOMIC_ACQUIRE);
+        head   = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+
+        for (tail = thread->tail; tail != head; tail++)
+            _profiler_consume(thread,
+                              &thread->events[tail & _CHIK_PROFILER_RING_MASK]);
+
+        __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+
+        _profiler_dropped += __atomic_exchange_n(&thread->dropped, 0,
+                                                 __ATOMIC_RELAXED);
+
+        if (exited) {
+            *link = thread->next;
+            free(thread);
+            continue;
+        }
+
+        link = &thread->next;
+    }
+}
+
+/*
+ *    Ends the running capture, with the lock held. Regions still open
+ *    are cut at the end of it.
+ *
+ *    @param _profiler_capture_t *capture    Where to move the capture.
+ */
+static void _profiler_capture_finish(_profiler_capture_t *capture) {
+    _profiler_thread_t *thread;
+    unsigned long       now = sync_now();
+    unsigned long       start;
+    unsigned int        i;
+
+    for (thread = _profiler_threads; thread != 0; thread = thread->next) {
+        for (i = 0; i < thread->top; i++) {
+            start = thread->open[i].time;
+
+            if (start < _profiler_capture.start)
+                start = _profiler_capture.start;
+
+            _profiler_trace(thread, CHIK_PROFILER_END, thread->open[i].region,
+                            start, now - start);
+        }
+    }
+
+    *capture = _profiler_capture;
+
+    _profiler_capture.records     = 0;
+    _profiler_capture.count       = 0;
+    _profiler_capture.size        = 0;
+    _profiler_capture.lost        = 0;
+    _profiler_capture.tracks      = 0;
+    _profiler_capture.track_count = 0;
+    _profiler_capture.track_size  = 0;
+
+    __atomic_store_n(&_profiler_capture.state, _CHIK_PROFILER_IDLE,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ *    Writes a string into a JSON file, escaped.
+ *
+ *    @param FILE       *file      The file.
+ *    @param const char *string    The string.
+ */
+static void _profiler_write_string(FILE *file, const char *string) {
+    fputc('"', file);
+
+    for (; *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\')
+            fputc('\\', file);
+
+        if ((unsigned char)*string >= ' ')
+            fputc(*string, file);
+    }
+
+    fputc('"', file);
+}
+
+/*
+ *    Writes a finished capture to its file in the Chrome trace event
+ *    format and frees it. Times are in microseconds from its start.
+ *
+ *    @param _profiler_capture_t *capture    The capture.
+ */
+static void _profiler_capture_write(_profiler_capture_t *capture) {
+    _profiler_record_t *record;
+    FILE               *file;
+    unsigned long       pid = 0;
+    unsigned long       i;
+
+#if __unix__
+    pid = (unsigned long)getpid();
+#endif /* __unix__  */
+
+    file = fopen(capture->path, "w");
+
+    if (file == 0) {
+        VLOGF_ERR("Failed to open %s\n", capture->path);
+        free(capture->records);
+        free(capture->tracks);
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (i = 0; i < capture->track_count; i++) {
+        fprintf(file,
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,"
+                "\"tid\":%lu,\"args\":{\"name\":",
+                pid, capture->tracks[i].tid);
+        _profiler_write_string(file, capture->tracks[i].name);
+        fprintf(file, "}},\n");
+    }
+
+    for (i = 0; i < capture->count; i++) {
+        record = &capture->records[i];
+
+        fprintf(file, "{\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,", pid, record->tid,
+                (record->time - capture->start) / 1000.0);
+
+        switch (record->type) {
+        case CHIK_PROFILER_END:
+            fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,\"name\":",
+                    record->arg / 1000.0);
+            _profiler_write_string(file, _profiler_names[record->region]);
+            break;
+        case CHIK_PROFILER_COUNTER:
+            fprintf(file, "\"ph\":\"C\",\"args\":{\"value\":%ld},\"name\":",
+                    (long)record->arg);
+            _profiler_write_string(file, _profiler_names[record->region]);
+            break;
+        case CHIK_PROFILER_FLOW_START:
+            fprintf(file, "\"ph\":\"s\",\"id\":%lu,\"cat\":\"flow\","
+                          "\"name\":\"flow\"",
+                    record->arg);
+            break;
+        case CHIK_PROFILER_FLOW_END:
+            fprintf(file, "\"ph\":\"f\",\"bp\":\"e\",\"id\":%lu,"
+                          "\"cat\":\"flow\",\"name\":\"flow\"",
+                    record->arg);
+            break;
+        default:
+            fprintf(file, "\"ph\":\"i\",\"s\":\"g\",\"args\":{\"frame\":%lu},"
+                          "\"name\":\"Frame\"",
+                    record->arg);
+            break;
+        }
+
+        fprintf(file, "},\n");
+    }
+
+    /*
+     *    A last event without a comma after it closes the array.
+     */
+    fprintf(file,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,"
+            "\"args\":{\"name\":\"Chik Engine\"}}\n]}\n",
+            pid);
+
+    fclose(file);
+
+    if (capture->lost != 0)
+        VLOGF_WARN("%lu timeline events did not fit into the capture.\n",
+                   capture->lost);
+
+    VLOGF_NOTE("Wrote %lu timeline events to %s\n", capture->count,
+               capture->path);
+
+    free(capture->records);
+    free(capture->tracks);
+}
+
+/*
+ *    Records an event that is not a begin or an end.
+ *
+ *    @param unsigned short type      chik_profiler_event_e.
+ *    @param unsigned int   region    The region.
+ *    @param unsigned long  arg       The argument.
+ */
+static void _profiler_event(unsigned short type, unsigned int region,
+                            unsigned long arg) {
+    _profiler_thread_t *self = _profiler_self;
+
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED))
+        return;
+
+    if (self == 0 && (self = _profiler_register()) == 0)
+        return;
+
+    _profiler_record(self, sync_now(), arg, region, type, self->depth);
+}
+
+/*
+ *    Initializes the profiler.
+ *    This function must be called before any other profiler functions.
+ */
+void chik_profiler_init() {
+    __atomic_store_n(&_profiler_enabled, 1, __ATOMIC_RELEASE);
+
+    chik_profiler_begin("Chik Engine");
+}
+
+/*
+ *    Returns the ID of a region without registering it.
+ *
+ *    @param const char *name    The name of the region.
+ *
+ *    @return unsigned int    The ID, CHIK_PROFILER_NO_REGION if the
+ *                            name isn't registered.
+ */
+unsigned int chik_profiler_find(const char *name) {
+    const char   *found;
+    unsigned long slot = _profiler_hash(name);
+    unsigned long i;
+
+    /*
+     *    Slots are only ever filled, so a name isn't registered if an
+     *    empty slot comes before it.
+     */
+    for (i = 0; i < CHIK_PROFILER_MAX_REGIONS; i++, slot++) {
+        if ((slot & _CHIK_PROFILER_REGION_MASK) == 0)
+            continue;
+
+        found = __atomic_load_n(&_profiler_names[slot & _CHIK_PROFILER_REGION_MASK],
+                                __ATOMIC_ACQUIRE);
+
+        if (found == 0)
+            break;
+
+        if (found == name || strcmp(found, name) == 0)
+            return slot & _CHIK_PROFILER_REGION_MASK;
+    }
+
+    return CHIK_PROFILER_NO_REGION;
+}
+
+/*
+ *    Returns the ID of a region, registering it on first use.
+ *
+ *    @param const char *name    The name of the region, which must
+ *                               stay valid, a string literal usually.
+ *
+ *    @return unsigned int    The ID.
+ */
+unsigned int chik_profiler_region(const char *name) {
+    const char   *found;
+    unsigned long slot = _profiler_hash(name);
+    unsigned long i;
+    unsigned int  id   = chik_profiler_find(name);
+
+    /*
+     *    A name that isn't found takes the lock and goes again, unless
+     *    the table is full and it can't be added anymore.
+     */
+    if (id != CHIK_PROFILER_NO_REGION)
+        return id;
+
+    if (__atomic_load_n(&_profiler_full, __ATOMIC_ACQUIRE))
+        return 0;
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    for (i = 0; i < CHIK_PROFILER_MAX_REGIONS; i++, slot++) {
+        if ((slot & _CHIK_PROFILER_REGION_MASK) == 0)
+            continue;
+
+        found = _profiler_names[slot & _CHIK_PROFILER_REGION_MASK];
+
+        if (found != 0 && strcmp(found, name) == 0)
+            break;
+
+        if (found == 0) {
+            if (_profiler_count >= CHIK_PROFILER_MAX_REGIONS / 4 * 3) {
+                if (!_profiler_full)
+                    VLOGF_ERR("Could not profile %s: too many profiled "
+                              "regions, further ones go to Other.\n",
+                              name);
+
+                __atomic_store_n(&_profiler_full, 1, __ATOMIC_RELEASE);
+                i = CHIK_PROFILER_MAX_REGIONS;
+                break;
+            }
+
+            _profiler_count++;
+            __atomic_store_n(&_profiler_names[slot & _CHIK_PROFILER_REGION_MASK],
+                             name, __ATOMIC_RELEASE);
+            break;
+        }
     }
 
-    VLOGF_ERR("Could not profile %s: too many profiled regions.", name);
-#endif
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    if (i == CHIK_PROFILER_MAX_REGIONS)
+        return 0;
+
+    return slot & _CHIK_PROFILER_REGION_MASK;
+}
+
+/*
+ *    Begins profiling a function.
+ *
+ *    @param name    The name of the profiled region.
+ */
+void chik_profiler_begin(const char *name) {
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED))
+        return;
+
+    chik_profiler_begin_region(chik_profiler_region(name));
+}
+
+/*
+ *    Begins profiling a region by its ID, which skips the name lookup.
+ *
+ *    @param unsigned int region    The ID from chik_profiler_region().
+ */
+void chik_profiler_begin_region(unsigned int region) {
+    _profiler_thread_t *self = _profiler_self;
+
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED))
+        return;
+
+    if (self == 0 && (self = _profiler_register()) == 0)
+        return;
+
+    _profiler_record(self, sync_now(), 0, region, CHIK_PROFILER_BEGIN,
+                     self->depth++);
 }
 
 /*
  *    Ends profiling a function.
  */
 void chik_profiler_end() {
-#if 0
-    if (_profiled_stack == (_profiled_stack_t *)0x0) {
-        LOGF_ERR("No profiler stack.");
+    _profiler_thread_t *self = _profiler_self;
+    unsigned long       time;
+
+    if (self == 0 || self->depth == 0)
         return;
+
+    time = sync_now();
+
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED)) {
+        self->depth--;
+        return;
+    }
+
+    _profiler_record(self, time, 0, 0, CHIK_PROFILER_END, --self->depth);
+}
+
+/*
+ *    Begins the region of a CHIK_PROFILE_SCOPE(), registering it
+ *    first if its ID isn't known yet.
+ *
+ *    @param unsigned int *region    Where the ID of the region is kept.
+ *    @param const char   *name      The name of the region.
+ *
+ *    @return int    0, the value of the scope's variable.
+ */
+int chik_profiler_scope_begin(unsigned int *region, const char *name) {
+    unsigned int id = __atomic_load_n(region, __ATOMIC_RELAXED);
+
+    /*
+     *    Threads that race here get the same ID.
+     */
+    if (id == CHIK_PROFILER_NO_REGION) {
+        id = chik_profiler_region(name);
+        __atomic_store_n(region, id, __ATOMIC_RELAXED);
     }
 
-    for (unsigned long i = 0; i < _CHIK_PROFILER_MAX_PROFILED; ++i) {
-        if (_profiled[i].name != (char *)0x0 && strcmp(_profiled[i].name, _profiled_stack->name) == 0) {
-            clock_gettime(CLOCK_MONOTONIC, &_profiled[i].end);
+    chik_profiler_begin_region(id);
 
-            _profiled[i].total_time_s  += _profiled[i].end.tv_sec  - _profiled[i].start.tv_sec;
-            _profiled[i].total_time_ns += _profiled[i].end.tv_nsec - _profiled[i].start.tv_nsec;
+    return 0;
+}
 
-            if (_profiled[i].total_time_ns > 1000000000) {
-                _profiled[i].total_time_s  += 1;
-                _profiled[i].total_time_ns %= 1000000000;
-            }
+/*
+ *    Ends the region of a CHIK_PROFILE_SCOPE() when its variable goes
+ *    out of scope.
+ *
+ *    @param int *scope    The scope's variable.
+ */
+void chik_profiler_scope_end(int *scope) {
+    (void)scope;
+
+    chik_profiler_end();
+}
+
+/*
+ *    Drains the rings of every thread into the totals of the regions.
+ *    Should be called regularly, once a frame for instance, so rings
+ *    don't fill up.
+ */
+void chik_profiler_collect() {
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    _profiler_collect();
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+}
+
+/*
+ *    Reads the totals of a region, as of the last collection.
+ *
+ *    @param unsigned int           region    The ID of the region.
+ *    @param chik_profiler_stats_t *stats     Where to store them.
+ *
+ *    @return int    0 on success, -1 if the ID isn't registered.
+ */
+int chik_profiler_stats(unsigned int region, chik_profiler_stats_t *stats) {
+    if (region >= CHIK_PROFILER_MAX_REGIONS ||
+        __atomic_load_n(&_profiler_names[region], __ATOMIC_ACQUIRE) == 0) {
+        LOGF_ERR("Profiler region is not registered\n");
+        return -1;
+    }
 
-            _profiled_stack_t *old_stack = _profiled_stack;
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
 
-            _profiled_stack = _profiled_stack->next;
+    *stats      = _profiler_totals[region];
+    stats->name = _profiler_names[region];
 
-            free(old_stack);
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
 
-            return;
+    return 0;
+}
+
+/*
+ *    Fills in the public view of a node.
+ *
+ *    @param unsigned long         index    The node.
+ *    @param chik_profiler_node_t *node     Where to store it.
+ */
+static void _profiler_node(unsigned long index, chik_profiler_node_t *node) {
+    _profiler_node_t *from = &_profiler_nodes[index];
+
+    node->name   = _profiler_names[from->region];
+    node->region = from->region;
+    node->calls  = from->calls;
+    node->time   = from->time;
+    node->self   = from->time > from->children ? from->time - from->children : 0;
+    node->min    = from->calls != 0 ? from->min : 0;
+    node->max    = from->max;
+    node->mean   = from->calls != 0 ? from->time / from->calls : 0;
+}
+
+/*
+ *    Prints a node of the call tree.
+ *
+ *    @param chik_profiler_node_t *node      The node.
+ *    @param unsigned int          indent    How far to indent it.
+ */
+static void _profiler_print(chik_profiler_node_t *node, unsigned int indent) {
+    log_msg("\t\t%*s- %s: %lu calls, %.3f ms, %.3f ms self, "
+            "%.3f/%.3f/%.3f us min/mean/max\n",
+            (int)indent * 2, "", node->name, node->calls, node->time / 1e6,
+            node->self / 1e6, node->min / 1e3, node->mean / 1e3,
+            node->max / 1e3);
+}
+
+/*
+ *    Copies the call tree, as of the last collection, in depth-first
+ *    order.
+ *
+ *    @param chik_profiler_node_t *nodes    Where to copy the nodes.
+ *    @param unsigned long         count    How many nodes fit there.
+ *
+ *    @return unsigned long    The number of nodes in the tree, which
+ *                             may be more than were copied.
+ */
+unsigned long chik_profiler_tree(chik_profiler_node_t *nodes,
+                                 unsigned long         count) {
+    unsigned long parents[CHIK_PROFILER_MAX_DEPTH + 1];
+    unsigned long total = 0;
+    unsigned long node  = 0;
+    unsigned int  depth = 0;
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    parents[0] = CHIK_PROFILER_NO_NODE;
+
+    /*
+     *    The copy of a node's parent is the last one copied at the
+     *    depth above it.
+     */
+    while (_profiler_nodes != 0 && (node = _profiler_next(node, &depth)) != 0) {
+        if (total < count) {
+            _profiler_node(node, &nodes[total]);
+            nodes[total].depth  = depth - 1;
+            nodes[total].parent = parents[depth - 1];
         }
+
+        if (depth <= CHIK_PROFILER_MAX_DEPTH)
+            parents[depth] = total;
+
+        total++;
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    return total;
+}
+
+/*
+ *    Prints the call tree, as of the last collection.
+ */
+void chik_profiler_dump() {
+    chik_profiler_node_t stats;
+    unsigned long        node  = 0;
+    unsigned int         depth = 0;
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    log_msg("\n\t* Profiler call tree:\n\n");
+
+    while (_profiler_nodes != 0 && (node = _profiler_next(node, &depth)) != 0) {
+        _profiler_node(node, &stats);
+        _profiler_print(&stats, depth - 1);
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+}
+
+/*
+ *    Prints every path a region is entered from, with the region's
+ *    times along that path.
+ *
+ *    @param const char *name    The name of the region.
+ */
+void chik_profiler_dump_callers(const char *name) {
+    chik_profiler_node_t stats;
+    unsigned int         region = chik_profiler_find(name);
+    unsigned long        node   = 0;
+    unsigned long        caller;
+    unsigned int         depth  = 0;
+
+    if (region == CHIK_PROFILER_NO_REGION) {
+        log_msg("\n\t* %s is not registered.\n", name);
+        return;
+    }
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    log_msg("\n\t* Callers of %s:\n\n", name);
+
+    while (_profiler_nodes != 0 && (node = _profiler_next(node, &depth)) != 0) {
+        if (_profiler_nodes[node].region != region)
+            continue;
+
+        /*
+         *    The path is printed from the region up to the top.
+         */
+        _profiler_node(node, &stats);
+        _profiler_print(&stats, 0);
+
+        for (caller = _profiler_nodes[node].parent; caller != 0;
+             caller = _profiler_nodes[caller].parent)
+            log_msg("\t\t    from %s\n",
+                    _profiler_names[_profiler_nodes[caller].region]);
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+}
+
+/*
+ *    Shell command that collects and prints the call tree, or the
+ *    callers of a region: profile [region].
+ *
+ *    @param int    argc    The number of arguments.
+ *    @param char **argv    The arguments.
+ */
+void chik_profiler_shell_dump(int argc, char **argv) {
+    chik_profiler_collect();
+
+    if (argc > 1)
+        chik_profiler_dump_callers(argv[1]);
+    else
+        chik_profiler_dump();
+}
+
+/*
+ *    Returns how many events threads dropped because their ring was
+ *    full.
+ *
+ *    @return unsigned long    The number of events.
+ */
+unsigned long chik_profiler_dropped() {
+    unsigned long dropped;
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    dropped = _profiler_dropped;
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    return dropped;
+}
+
+/*
+ *    Records the value of a counter, which shows as a graph in
+ *    captured timelines.
+ *
+ *    @param unsigned int region    The ID of the counter's name.
+ *    @param long         value     The value.
+ */
+void chik_profiler_counter(unsigned int region, long value) {
+    _profiler_event(CHIK_PROFILER_COUNTER, region, (unsigned long)value);
+}
+
+/*
+ *    Takes the ID for a new flow, an arrow in captured timelines from
+ *    where chik_profiler_flow_start() is called to where
+ *    chik_profiler_flow_end() is called with the same ID. Flows are
+ *    only recorded while a capture runs.
+ *
+ *    @return unsigned long    The ID of the flow, 0 if none is needed.
+ */
+unsigned long chik_profiler_flow_new() {
+    if (__atomic_load_n(&_profiler_capture.state, __ATOMIC_RELAXED) !=
+        _CHIK_PROFILER_CAPTURING)
+        return 0;
+
+    return __atomic_add_fetch(&_profiler_flows, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *    Starts a flow in the region the calling thread is in. Taking the
+ *    ID first lets the caller hand it on before deciding to start it.
+ *
+ *    @param unsigned long flow    The ID from chik_profiler_flow_new().
+ */
+void chik_profiler_flow_start(unsigned long flow) {
+    if (flow != 0)
+        _profiler_event(CHIK_PROFILER_FLOW_START, 0, flow);
+}
+
+/*
+ *    Ends a flow in the region the calling thread is in.
+ *
+ *    @param unsigned long flow    The ID from chik_profiler_flow_new().
+ */
+void chik_profiler_flow_end(unsigned long flow) {
+    if (flow != 0)
+        _profiler_event(CHIK_PROFILER_FLOW_END, 0, flow);
+}
+
+/*
+ *    Marks the start of a frame, collects, and starts or finishes a
+ *    capture that is due. Called by frame_begin().
+ *
+ *    @param unsigned long index    The index of the frame.
+ */
+void chik_profiler_frame(unsigned long index) {
+    _profiler_capture_t capture;
+    int                 finished = 0;
+
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED))
+        return;
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    /*
+     *    What happened before the capture is only added to the totals.
+     */
+    if (_profiler_capture.state == _CHIK_PROFILER_ARMED) {
+        _profiler_collect();
+
+        _profiler_capture.start = sync_now();
+        _profiler_capture.done  = 0;
+        _profiler_capture.generation++;
+        __atomic_store_n(&_profiler_capture.state, _CHIK_PROFILER_CAPTURING,
+                         __ATOMIC_RELAXED);
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    _profiler_event(CHIK_PROFILER_FRAME, 0, index);
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    _profiler_collect();
+
+    if (_profiler_capture.state == _CHIK_PROFILER_CAPTURING &&
+        _profiler_capture.done++ == _profiler_capture.frames) {
+        _profiler_capture_finish(&capture);
+        finished = 1;
     }
-#endif
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    if (finished)
+        _profiler_capture_write(&capture);
+}
+
+/*
+ *    Captures a timeline of the next frames, from the next call to
+ *    chik_profiler_frame(), and writes it to a Chrome trace file.
+ *
+ *    @param unsigned long frames    How many frames to capture.
+ *    @param const char   *path      The file to write.
+ *
+ *    @return int    0 on success, -1 if a capture is already pending.
+ */
+int chik_profiler_capture(unsigned long frames, const char *path) {
+    int ret = -1;
+
+    if (frames == 0) {
+        LOGF_ERR("Cannot capture zero frames\n");
+        return -1;
+    }
+
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    if (_profiler_capture.state == _CHIK_PROFILER_IDLE) {
+        _profiler_capture.frames = frames;
+        strncpy(_profiler_capture.path, path, sizeof(_profiler_capture.path) - 1);
+        _profiler_capture.path[sizeof(_profiler_capture.path) - 1] = '\0';
+        _profiler_capture.state = _CHIK_PROFILER_ARMED;
+        ret                     = 0;
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    if (ret != 0)
+        LOGF_ERR("A capture is already pending\n");
+
+    return ret;
+}
+
+/*
+ *    Shell command that captures a timeline: trace [frames] [file].
+ *
+ *    @param int    argc    The number of arguments.
+ *    @param char **argv    The arguments.
+ */
+void chik_profiler_shell_trace(int argc, char **argv) {
+    unsigned long frames = 1;
+    const char   *path   = "chik_trace.json";
+
+    if (!__atomic_load_n(&_profiler_enabled, __ATOMIC_RELAXED)) {
+        log_msg("\n\t* The profiler is not running.\n");
+        return;
+    }
+
+    if (argc > 1)
+        frames = strtoul(argv[1], 0, 10);
+
+    if (argc > 2)
+        path = argv[2];
+
+    if (chik_profiler_capture(frames, path) == 0)
+        log_msg("\n\t* Capturing %lu frames to %s.\n", frames, path);
 }
 
 /*
  *    Ends the profiler.
  */
 void chik_profiler_exit() {
-#if 0
+    _profiler_capture_t capture;
+    int                 finished = 0;
+
     chik_profiler_end();
 
-    for (unsigned long i = 0; i < _CHIK_PROFILER_MAX_PROFILED; ++i) {
-        if (_profiled[i].name != (char *)0x0) {
-            VLOGF_MSG("%s: %lu calls, %lu.%lu seconds.", _profiled[i].name, _profiled[i].calls, _profiled[i].total_time_s, _profiled[i].total_time_ns);
-        }
+#if __unix__
+    pthread_mutex_lock(&_profiler_lock);
+#endif /* __unix__  */
+
+    _profiler_collect();
+
+    /*
+     *    A capture that is cut short is still written.
+     */
+    if (_profiler_capture.state == _CHIK_PROFILER_CAPTURING) {
+        _profiler_capture_finish(&capture);
+        finished = 1;
     }
-#endif
-}
\ No newline at end of file
+
+    _profiler_capture.state = _CHIK_PROFILER_IDLE;
+
+#if __unix__
+    pthread_mutex_unlock(&_profiler_lock);
+#endif /* __unix__  */
+
+    if (finished)
+        _profiler_capture_write(&capture);
+
+    __atomic_store_n(&_profiler_enabled, 0, __ATOMIC_RELEASE);
+
+    chik_profiler_dump();
+
+    if (chik_profiler_dropped() != 0)
+        VLOGF_WARN("%lu events were dropped.\n", chik_profiler_dropped());
+}
@@ -7,28 +7,121 @@
  *    library for the Chik engine and her games.
  *
  *    This file declares the functions and macros used for profiling.
+ *
+ *    Every thread records the regions it enters and leaves as begin
+ *    and end events in a ring of its own. Only the thread writes its
+ *    ring, without locks or allocation, and only chik_profiler_collect()
+ *    reads it, so the profiler is cheap enough to stay enabled. Region
+ *    names are interned into small IDs once, events carry only the ID.
+ *
+ *    A capture keeps what is collected over a number of frames as a
+ *    timeline, written out in the Chrome trace event format, which
+ *    chrome://tracing and Perfetto open.
+ *
+ *    The collector also merges the regions of all threads into a call
+ *    tree, where a region gets a node for every path of regions it is
+ *    entered from, so the time of each caller can be told apart.
+ *
+ *    Builds that define LIBCHIK_PROFILER_DISABLE compile the scopes of
+ *    CHIK_PROFILE_SCOPE() out.
  */
 #ifndef _CHIK_PROFILER_H
 #define _CHIK_PROFILER_H
 
-#define _CHIK_PROFILER_MAX_PROFILED 256
+/*
+ *    The number of region IDs, a power of two. Names registered
+ *    after three quarters of them are taken share ID 0.
+ */
+#define CHIK_PROFILER_MAX_REGIONS 1024
+
+/*
+ *    Events per thread ring, a power of two. A thread drops events
+ *    while its ring is full, until the next collection.
+ */
+#define CHIK_PROFILER_RING_SIZE 16384
 
-#include <time.h>
+/*
+ *    Regions nested deeper than this are recorded but not collected.
+ */
+#define CHIK_PROFILER_MAX_DEPTH 64
+
+/*
+ *    The most timeline events a capture keeps, later ones are lost.
+ */
+#define CHIK_PROFILER_CAPTURE_MAX (1024 * 1024)
+
+/*
+ *    The ID of a region that isn't registered yet.
+ */
+#define CHIK_PROFILER_NO_REGION ((unsigned int)-1)
+
+/*
+ *    The parent of the nodes at the top of the call tree.
+ */
+#define CHIK_PROFILER_NO_NODE ((unsigned long)-1)
+
+#define _CHIK_PROFILER_CONCAT_(a, b) a##b
+#define _CHIK_PROFILER_CONCAT(a, b)  _CHIK_PROFILER_CONCAT_(a, b)
+
+/*
+ *    Profiles the rest of the enclosing block as a region. The region
+ *    is registered the first time the scope is entered and its ID is
+ *    kept in a static, so entering the scope costs no name lookup.
+ *    The region ends when the block is left, by the cleanup attribute.
+ *
+ *    @param name    The name of the region, a string literal.
+ */
+#ifndef LIBCHIK_PROFILER_DISABLE
+#define CHIK_PROFILE_SCOPE(name)                                              \
+    static unsigned int _CHIK_PROFILER_CONCAT(_chik_profiler_region_,         \
+                                              __LINE__) =                     \
+        CHIK_PROFILER_NO_REGION;                                              \
+    int _CHIK_PROFILER_CONCAT(_chik_profiler_scope_, __LINE__)                \
+        __attribute__((cleanup(chik_profiler_scope_end), unused)) =           \
+            chik_profiler_scope_begin(                                        \
+                &_CHIK_PROFILER_CONCAT(_chik_profiler_region_, __LINE__), name)
+#else
+#define CHIK_PROFILE_SCOPE(name)
+#endif /* LIBCHIK_PROFILER_DISABLE  */
+
+typedef enum {
+    CHIK_PROFILER_BEGIN,
+    CHIK_PROFILER_END,
+    CHIK_PROFILER_COUNTER,
+    CHIK_PROFILER_FLOW_START,
+    CHIK_PROFILER_FLOW_END,
+    CHIK_PROFILER_FRAME,
+} chik_profiler_event_e;
 
 typedef struct {
-    const char     *name;
-    unsigned long   calls;
-    unsigned long   total_time_s;
-    unsigned long   total_time_ns;
-    struct timespec start;
-    struct timespec end;
-} _profiled_t;
+    unsigned long  time;   /* sync_now() when the event happened.     */
+    unsigned long  arg;    /* The value of counters, the ID of flows,
+                              the index of frames.                    */
+    unsigned int   region; /* The region, 0 for ends.                 */
+    unsigned short type;   /* chik_profiler_event_e.                  */
+    unsigned short depth;  /* Regions the thread was in before begins
+                              and after ends.                         */
+} chik_profiler_event_t;
 
-typedef struct _profiled_stack_s {
-    const char               *name;
+typedef struct {
+    const char   *name;
+    unsigned long calls;
+    unsigned long time; /* Nanoseconds spent in the region.  */
+} chik_profiler_stats_t;
 
-    struct _profiled_stack_s *next;
-} _profiled_stack_t;
+typedef struct {
+    const char   *name;
+    unsigned int  region;
+    unsigned int  depth;  /* 0 for nodes at the top.                  */
+    unsigned long parent; /* The index of the parent, always before
+                             the node, or CHIK_PROFILER_NO_NODE.      */
+    unsigned long calls;
+    unsigned long time;   /* Nanoseconds, including the children.     */
+    unsigned long self;   /* Nanoseconds, without the children.       */
+    unsigned long min;
+    unsigned long max;
+    unsigned long mean;
+} chik_profiler_node_t;
 
 /*
  *    Initializes the profiler.
@@ -36,6 +129,27 @@ typedef struct _profiled_stack_s {
  */
 void chik_profiler_init();
 
+/*
+ *    Returns the ID of a region without registering it, for names
+ *    that may not stay valid.
+ *
+ *    @param const char *name    The name of the region.
+ *
+ *    @return unsigned int    The ID, CHIK_PROFILER_NO_REGION if the
+ *                            name isn't registered.
+ */
+unsigned int chik_profiler_find(const char *name);
+
+/*
+ *    Returns the ID of a region, registering it on first use.
+ *
+ *    @param const char *name    The name of the region, which must
+ *                               stay valid, a string literal usually.
+ *
+ *    @return unsigned int    The ID.
+ */
+unsigned int chik_profiler_region(const char *name);
+
 /*
  *    Begins profiling a function.
  *
@@ -43,14 +157,161 @@ void chik_profiler_init();
  */
 void chik_profiler_begin(const char *name);
 
+/*
+ *    Begins profiling a region by its ID, which skips the name lookup.
+ *
+ *    @param unsigned int region    The ID from chik_profiler_region().
+ */
+void chik_profiler_begin_region(unsigned int region);
+
 /*
  *    Ends profiling a function.
  */
 void chik_profiler_end();
 
+/*
+ *    Begins the region of a CHIK_PROFILE_SCOPE(), registering it
+ *    first if its ID isn't known yet.
+ *
+ *    @param unsigned int *region    Where the ID of the region is kept.
+ *    @param const char   *name      The name of the region.
+ *
+ *    @return int    0, the value of the scope's variable.
+ */
+int chik_profiler_scope_begin(unsigned int *region, const char *name);
+
+/*
+ *    Ends the region of a CHIK_PROFILE_SCOPE() when its variable goes
+ *    out of scope.
+ *
+ *    @param int *scope    The scope's variable.
+ */
+void chik_profiler_scope_end(int *scope);
+
+/*
+ *    Drains the rings of every thread into the totals of the regions.
+ *    Should be called regularly, once a frame for instance, so rings
+ *    don't fill up.
+ */
+void chik_profiler_collect();
+
+/*
+ *    Reads the totals of a region, as of the last collection.
+ *
+ *    @param unsigned int           region    The ID of the region.
+ *    @param chik_profiler_stats_t *stats     Where to store them.
+ *
+ *    @return int    0 on success, -1 if the ID isn't registered.
+ */
+int chik_profiler_stats(unsigned int region, chik_profiler_stats_t *stats);
+
+/*
+ *    Copies the call tree, as of the last collection, in depth-first
+ *    order.
+ *
+ *    @param chik_profiler_node_t *nodes    Where to copy the nodes.
+ *    @param unsigned long         count    How many nodes fit there.
+ *
+ *    @return unsigned long    The number of nodes in the tree, which
+ *                             may be more than were copied.
+ */
+unsigned long chik_profiler_tree(chik_profiler_node_t *nodes,
+                                 unsigned long         count);
+
+/*
+ *    Prints the call tree, as of the last collection.
+ */
+void chik_profiler_dump();
+
+/*
+ *    Prints every path a region is entered from, with the region's
+ *    times along that path.
+ *
+ *    @param const char *name    The name of the region.
+ */
+void chik_profiler_dump_callers(const char *name);
+
+/*
+ *    Shell command that collects and prints the call tree, or the
+ *    callers of a region: profile [region].
+ *
+ *    @param int    argc    The number of arguments.
+ *    @param char **argv    The arguments.
+ */
+void chik_profiler_shell_dump(int argc, char **argv);
+
+/*
+ *    Returns how many events threads dropped because their ring was
+ *    full.
+ *
+ *    @return unsigned long    The number of events.
+ */
+unsigned long chik_profiler_dropped();
+
+/*
+ *    Records the value of a counter, which shows as a graph in
+ *    captured timelines.
+ *
+ *    @param unsigned int region    The ID of the counter's name.
+ *    @param long         value     The value.
+ */
+void chik_profiler_counter(unsigned int region, long value);
+
+/*
+ *    Takes the ID for a new flow, an arrow in captured timelines from
+ *    where chik_profiler_flow_start() is called to where
+ *    chik_profiler_flow_end() is called with the same ID. Flows are
+ *    only recorded while a capture runs.
+ *
+ *    @return unsigned long    The ID of the flow, 0 if none is needed.
+ */
+unsigned long chik_profiler_flow_new();
+
+/*
+ *    Starts a flow in the region the calling thread is in. Taking the
+ *    ID first lets the caller hand it on before deciding to start it.
+ *
+ *    @param unsigned long flow    The ID from chik_profiler_flow_new().
+ */
+void chik_profiler_flow_start(unsigned long flow);
+
+/*
+ *    Ends a flow in the region the calling thread is in.
+ *
+ *    @param unsigned long flow    The ID from chik_profiler_flow_new().
+ */
+void chik_profiler_flow_end(unsigned long flow);
+
+/*
+ *    Marks the start of a frame, collects, and starts or finishes a
+ *    capture that is due. Called by frame_begin().
+ *
+ *    @param unsigned long index    The index of the frame.
+ */
+void chik_profiler_frame(unsigned long index);
+
+/*
+ *    Captures a timeline of the next frames, from the next call to
+ *    chik_profiler_frame(), and writes it to a Chrome trace file.
+ *
+ *    @param unsigned long frames    How many frames to capture.
+ *    @param const char   *path      The file to write.
+ *
+ *    @return int    0 on success, -1 if a capture is already pending.
+ */
+int chik_profiler_capture(unsigned long frames, const char *path);
+
+/*
+ *    Shell command that captures a timeline: trace [frames] [file].
+ *
+ *    @param int    argc    The number of arguments.
+ *    @param char **argv    The arguments.
+ */
+void chik_profiler_shell_trace(int argc, char **argv);
+
 /*
  *    Ends the profiler.
  */
 void chik_profiler_exit();
 
-#endif /* _CHIK_PROFILER_H  */
\ No newline at end of file
+#endif /* _CHIK_PROFILER_H  */
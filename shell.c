@@ -15,6 +15,8 @@
 #include <string.h>
 
 #include "log.h"
+#include "profiler.h"
+#include "thread.h"
 
 shell_command_t  _coms[LIBCHIK_SHELL_MAX_COMMANDS];
 shell_variable_t _vars[LIBCHIK_SHELL_MAX_VARIABLES];
@@ -93,6 +95,12 @@ void shell_init(void) {
         {"commands", "List all registered commands.", shell_list_commands},
         {"variables", "List all registered variables.", shell_list_variables},
         {"all", "List all registered commands and variables.", shell_list_all},
+        {"threadpool", "Print threadpool counters and histograms.",
+         threadpool_shell_stats},
+        {"trace", "Capture a timeline of the next frames: trace [frames] [file].",
+         chik_profiler_shell_trace},
+        {"profile", "Print the profiler call tree, or the callers of a region.",
+         chik_profiler_shell_dump},
         {nullptr, nullptr, nullptr}};
 
     memset(_coms, 0, sizeof(shell_command_t) * LIBCHIK_SHELL_MAX_COMMANDS);
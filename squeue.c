@@ -0,0 +1,203 @@
+/*
+ *    squeue.c    --    Source for single producer/consumer queue
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file provides the definition of the single producer/consumer
+ *    queue functionality.
+ */
+#include "squeue.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+
+/*
+ *    Creates a new single producer/consumer queue.
+ *    The size is rounded up to the next power of two.
+ *
+ *    @param unsigned long size        The size of the queue.
+ *    @param int           blocking    Non-zero if the consumer may block in
+ *                                     squeue_wait(). This costs the producer
+ *                                     a memory fence per push call.
+ *
+ *    @return squeue_t*    A pointer to the new queue.
+ */
+squeue_t *squeue_new(unsigned long size, int blocking) {
+    unsigned long cap;
+    squeue_t     *queue;
+
+    if (size == 0) {
+        LOGF_ERR("Invalid queue size\n");
+        return nullptr;
+    }
+
+    for (cap = 1; cap < size; cap <<= 1)
+        ;
+
+    queue = (squeue_t *)aligned_alloc(CHIK_CACHE_LINE, sizeof(squeue_t));
+
+    if (queue == nullptr) {
+        LOGF_ERR("Failed to allocate memory for queue\n");
+        return nullptr;
+    }
+
+    queue->items = (void **)malloc(sizeof(void *) * cap);
+
+    if (queue->items == nullptr) {
+        LOGF_ERR("Failed to allocate memory for queue items\n");
+        free(queue);
+        return nullptr;
+    }
+
+    queue->size       = cap;
+    queue->mask       = cap - 1;
+    queue->blocking   = blocking;
+    queue->tail       = 0;
+    queue->head_cache = 0;
+    queue->head       = 0;
+    queue->tail_cache = 0;
+
+    sync_event_init(&queue->event);
+
+    return queue;
+}
+
+/*
+ *    Destroys a single producer/consumer queue.
+ *
+ *    @param squeue_t *queue    The queue to destroy.
+ */
+void squeue_destroy(squeue_t *queue) {
+    free(queue->items);
+    free(queue);
+}
+
+/*
+ *    Pushes an item onto the queue. Producer only.
+ *
+ *    @param squeue_t *queue    The queue to push onto.
+ *    @param void     *item     The item to push.
+ *
+ *    @return int    0 on success, -1 if the queue is full.
+ */
+int squeue_push(squeue_t *queue, void *item) {
+    return squeue_push_many(queue, &item, 1) == 1 ? 0 : -1;
+}
+
+/*
+ *    Pushes as many items as fit onto the queue. Producer only.
+ *
+ *    @param squeue_t     *queue    The queue to push onto.
+ *    @param void        **items    The items to push.
+ *    @param unsigned long count    The number of items to push.
+ *
+ *    @return unsigned long    The number of items pushed.
+ */
+unsigned long squeue_push_many(squeue_t *queue, void **items,
+                               unsigned long count) {
+    unsigned long tail = queue->tail;
+    unsigned long room = queue->size - (tail - queue->head_cache);
+    unsigned long i;
+
+    if (room < count) {
+        queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        room              = queue->size - (tail - queue->head_cache);
+
+        if (room < count)
+            count = room;
+    }
+
+    if (count == 0)
+        return 0;
+
+    for (i = 0; i < count; i++)
+        queue->items[(tail + i) & queue->mask] = items[i];
+
+    __atomic_store_n(&queue->tail, tail + count, __ATOMIC_RELEASE);
+
+    if (queue->blocking)
+        sync_event_notify(&queue->event, 1);
+
+    return count;
+}
+
+/*
+ *    Pops an item from the queue. Consumer only.
+ *
+ *    @param squeue_t *queue    The queue to pop from.
+ *    @param void    **item     Where to store the item.
+ *
+ *    @return int    0 on success, -1 if the queue is empty.
+ */
+int squeue_pop(squeue_t *queue, void **item) {
+    return squeue_pop_many(queue, item, 1) == 1 ? 0 : -1;
+}
+
+/*
+ *    Pops up to max items from the queue. Consumer only.
+ *
+ *    @param squeue_t     *queue    The queue to pop from.
+ *    @param void        **items    The array to store the items in.
+ *    @param unsigned long max      The maximum number of items to pop.
+ *
+ *    @return unsigned long    The number of items popped.
+ */
+unsigned long squeue_pop_many(squeue_t *queue, void **items,
+                              unsigned long max) {
+    unsigned long head  = queue->head;
+    unsigned long avail = queue->tail_cache - head;
+    unsigned long i;
+
+    if (avail < max) {
+        queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        avail             = queue->tail_cache - head;
+
+        if (avail < max)
+            max = avail;
+    }
+
+    if (max == 0)
+        return 0;
+
+    for (i = 0; i < max; i++)
+        items[i] = queue->items[(head + i) & queue->mask];
+
+    __atomic_store_n(&queue->head, head + max, __ATOMIC_RELEASE);
+
+    return max;
+}
+
+/*
+ *    Pops up to max items, blocking until at least one is available.
+ *    Consumer only, and the queue must have been created as blocking.
+ *
+ *    @param squeue_t     *queue    The queue to pop from.
+ *    @param void        **items    The array to store the items in.
+ *    @param unsigned long max      The maximum number of items to pop.
+ *
+ *    @return unsigned long    The number of items popped.
+ */
+unsigned long squeue_wait(squeue_t *queue, void **items, unsigned long max) {
+    unsigned long n;
+    unsigned int  key;
+
+    if (max == 0)
+        return 0;
+
+    while ((n = squeue_pop_many(queue, items, max)) == 0) {
+        key = sync_event_prepare(&queue->event);
+
+        if ((n = squeue_pop_many(queue, items, max)) != 0) {
+            sync_event_cancel(&queue->event);
+            break;
+        }
+
+        sync_event_wait(&queue->event, key);
+    }
+
+    return n;
+}
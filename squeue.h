@@ -0,0 +1,120 @@
+/*
+ *    squeue.h    --    Header for single producer/consumer queue
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file provides the declaration for a wait-free queue
+ *    with exactly one producer and one consumer, for pipeline
+ *    stages that don't need the multi-producer aqueue.
+ *
+ *    Each side keeps a cached copy of the other side's index and
+ *    only reads the shared one when the cache says the ring is
+ *    full or empty, so in steady state neither side touches the
+ *    other's cache line.
+ */
+#ifndef CHIK_SQUEUE_H
+#define CHIK_SQUEUE_H
+
+#include "sync.h"
+
+typedef struct {
+    void        **items;
+    unsigned long size;
+    unsigned long mask;
+    int           blocking;
+
+    /*
+     *    Producer side.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long tail;
+    unsigned long head_cache;
+
+    /*
+     *    Consumer side.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long head;
+    unsigned long tail_cache;
+
+    CHIK_ALIGNED(CHIK_CACHE_LINE) sync_event_t event;
+} squeue_t;
+
+/*
+ *    Creates a new single producer/consumer queue.
+ *    The size is rounded up to the next power of two.
+ *
+ *    @param unsigned long size        The size of the queue.
+ *    @param int           blocking    Non-zero if the consumer may block in
+ *                                     squeue_wait(). This costs the producer
+ *                                     a memory fence per push call.
+ *
+ *    @return squeue_t*    A pointer to the new queue.
+ */
+squeue_t *squeue_new(unsigned long size, int blocking);
+
+/*
+ *    Destroys a single producer/consumer queue.
+ *
+ *    @param squeue_t *queue    The queue to destroy.
+ */
+void squeue_destroy(squeue_t *queue);
+
+/*
+ *    Pushes an item onto the queue. Producer only.
+ *
+ *    @param squeue_t *queue    The queue to push onto.
+ *    @param void     *item     The item to push.
+ *
+ *    @return int    0 on success, -1 if the queue is full.
+ */
+int squeue_push(squeue_t *queue, void *item);
+
+/*
+ *    Pushes as many items as fit onto the queue. Producer only.
+ *
+ *    @param squeue_t     *queue    The queue to push onto.
+ *    @param void        **items    The items to push.
+ *    @param unsigned long count    The number of items to push.
+ *
+ *    @return unsigned long    The number of items pushed.
+ */
+unsigned long squeue_push_many(squeue_t *queue, void **items,
+                               unsigned long count);
+
+/*
+ *    Pops an item from the queue. Consumer only.
+ *
+ *    @param squeue_t *queue    The queue to pop from.
+ *    @param void    **item     Where to store the item.
+ *
+ *    @return int    0 on success, -1 if the queue is empty.
+ */
+int squeue_pop(squeue_t *queue, void **item);
+
+/*
+ *    Pops up to max items from the queue. Consumer only.
+ *
+ *    @param squeue_t     *queue    The queue to pop from.
+ *    @param void        **items    The array to store the items in.
+ *    @param unsigned long max      The maximum number of items to pop.
+ *
+ *    @return unsigned long    The number of items popped.
+ */
+unsigned long squeue_pop_many(squeue_t *queue, void **items,
+                              unsigned long max);
+
+/*
+ *    Pops up to max items, blocking until at least one is available.
+ *    Consumer only, and the queue must have been created as blocking.
+ *
+ *    @param squeue_t     *queue    The queue to pop from.
+ *    @param void        **items    The array to store the items in.
+ *    @param unsigned long max      The maximum number of items to pop.
+ *
+ *    @return unsigned long    The number of items popped.
+ */
+unsigned long squeue_wait(squeue_t *queue, void **items, unsigned long max);
+
+#endif /* CHIK_SQUEUE_H  */
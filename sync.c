@@ -0,0 +1,328 @@
+/*
+ *    sync.c    --    source for low-level synchronization primitives
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file defines the futex wrappers and the event count
+ *    used by the lock-free containers.
+ */
+#include "sync.h"
+
+#if __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+//#error "Unsupported platform"
+#endif /* __linux__  */
+
+#if __unix__
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif /* __unix__  */
+
+#include "types.h"
+
+long _sync_cpus = 0;
+
+/*
+ *    Returns a monotonic timestamp.
+ *
+ *    @return unsigned long    The time in nanoseconds.
+ */
+unsigned long sync_now(void) {
+#if __unix__
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#else
+//#error "Unsupported platform"
+    return 0;
+#endif /* __unix__  */
+}
+
+/*
+ *    Sleeps while the word at addr still holds val.
+ *
+ *    @param unsigned int *addr    The word to wait on.
+ *    @param unsigned int  val     The value the word is expected to hold.
+ */
+void sync_futex_wait(unsigned int *addr, unsigned int val) {
+#if __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+#else
+//#error "Unsupported platform"
+#endif /* __linux__  */
+}
+
+/*
+ *    Sleeps while the word at addr still holds val, for at most ns
+ *    nanoseconds.
+ *
+ *    @param unsigned int *addr    The word to wait on.
+ *    @param unsigned int  val     The value the word is expected to hold.
+ *    @param unsigned long ns      The timeout in nanoseconds.
+ */
+void sync_futex_wait_timeout(unsigned int *addr, unsigned int val,
+                             unsigned long ns) {
+#if __linux__
+    struct timespec timeout;
+
+    timeout.tv_sec  = ns / 1000000000UL;
+    timeout.tv_nsec = ns % 1000000000UL;
+
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, nullptr, 0);
+#else
+//#error "Unsupported platform"
+#endif /* __linux__  */
+}
+
+/*
+ *    Wakes threads sleeping on a word.
+ *
+ *    @param unsigned int *addr    The word to wake.
+ *    @param int           count   The maximum number of threads to wake.
+ */
+void sync_futex_wake(unsigned int *addr, int count) {
+#if __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+//#error "Unsupported platform"
+#endif /* __linux__  */
+}
+
+/*
+ *    Initializes an event count.
+ *
+ *    @param sync_event_t *event    The event count to initialize.
+ */
+void sync_event_init(sync_event_t *event) {
+    event->seq      = 0;
+    event->sleepers = 0;
+    event->armed    = 0;
+    event->spinners = 0;
+}
+
+/*
+ *    Announces that the calling thread is about to sleep on the event.
+ *    The caller must re-check its condition after this call, and then
+ *    either call sync_event_wait() with the returned key or
+ *    sync_event_cancel() if the condition was met.
+ *
+ *    @param sync_event_t *event    The event count.
+ *
+ *    @return unsigned int    The key to pass to sync_event_wait().
+ */
+unsigned int sync_event_prepare(sync_event_t *event) {
+    unsigned int key;
+
+    __atomic_fetch_add(&event->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    /*
+     *    The key must be taken before arming, so that whoever
+     *    disarms the event is guaranteed to move seq past our key.
+     */
+    key = __atomic_load_n(&event->seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&event->armed, 1, __ATOMIC_SEQ_CST);
+
+    return key;
+}
+
+/*
+ *    Withdraws a sleep announced with sync_event_prepare().
+ *
+ *    @param sync_event_t *event    The event count.
+ */
+void sync_event_cancel(sync_event_t *event) {
+    __atomic_fetch_sub(&event->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->armed, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *    Sleeps until the event is notified after the key was taken.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param unsigned int  key      The key from sync_event_prepare().
+ */
+void sync_event_wait(sync_event_t *event, unsigned int key) {
+    while (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) == key)
+        sync_futex_wait(&event->seq, key);
+
+    __atomic_fetch_sub(&event->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->armed, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *    Sleeps until the event is notified after the key was taken, or
+ *    until the timeout runs out.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param unsigned int  key      The key from sync_event_prepare().
+ *    @param unsigned long ns       The timeout in nanoseconds.
+ */
+void sync_event_wait_timeout(sync_event_t *event, unsigned int key,
+                             unsigned long ns) {
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) == key)
+        sync_futex_wait_timeout(&event->seq, key, ns);
+
+    __atomic_fetch_sub(&event->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->armed, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *    Returns the number of online cpus.
+ *
+ *    @return long    The number of cpus, at least 1.
+ */
+static long _sync_online_cpus(void) {
+#if __unix__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? cpus : 1;
+#else
+//#error "Unsupported platform"
+    return 1;
+#endif /* __unix__  */
+}
+
+/*
+ *    Initializes an adaptive backoff.
+ *
+ *    @param sync_backoff_t *backoff    The backoff to initialize.
+ */
+void sync_backoff_init(sync_backoff_t *backoff) {
+    backoff->limit = CHIK_SYNC_SPIN_MIN;
+}
+
+/*
+ *    Spins and then yields until poll(arg) returns nonzero or the
+ *    budget runs out. While it spins, the thread counts as a spinner
+ *    of the event, so single-thread notifications don't wake a
+ *    sleeper for work the spinner is about to pick up. On a single
+ *    cpu it returns 0 right away. A caller that
+ *    gets 0 back must go through sync_event_prepare() and re-check
+ *    before it sleeps.
+ *
+ *    @param sync_backoff_t *backoff    The backoff state.
+ *    @param sync_event_t   *event      The event the caller would sleep on.
+ *    @param int (*poll)(void *)        Looks for work, taking it if found.
+ *    @param void *arg                  The argument to pass to poll.
+ *
+ *    @return int    1 if poll found work, 0 if the caller should sleep.
+ */
+int sync_backoff(sync_backoff_t *backoff, sync_event_t *event,
+                 int (*poll)(void *), void *arg) {
+    long limit = __atomic_load_n(&backoff->limit, __ATOMIC_RELAXED);
+    long i;
+    int  found = 0;
+
+    /*
+     *    With a single cpu the work can only show up once we give the
+     *    cpu away, and a sleeping thread gets it back sooner than a
+     *    yielding one, so go straight to sleep.
+     */
+    if (_sync_cpus == 0)
+        _sync_cpus = _sync_online_cpus();
+
+    if (_sync_cpus == 1)
+        return 0;
+
+    __atomic_fetch_add(&event->spinners, 1, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < limit; i++) {
+        if (poll(arg)) {
+            found = 1;
+            break;
+        }
+
+        sync_pause();
+    }
+
+    /*
+     *    Pairs with the fence in sync_event_notify(): a notifier that
+     *    still saw us spinning has published its work before our
+     *    caller re-checks after sync_event_prepare().
+     */
+    __atomic_fetch_sub(&event->spinners, 1, __ATOMIC_SEQ_CST);
+
+    /*
+     *    Steer the budget towards twice what it took to find work,
+     *    and shrink it when spinning was a waste.
+     */
+    if (found)
+        limit += (2 * i + CHIK_SYNC_SPIN_MIN - limit) / 8;
+    else
+        limit -= limit / 8;
+
+    /*
+     *    A yielding thread may not run again for a whole time slice,
+     *    so it doesn't count as a spinner.
+     */
+    for (i = 0; i < CHIK_SYNC_YIELDS && !found; i++) {
+#if __unix__
+        sched_yield();
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
+        /*
+         *    Work showing up right after the spin means the spin was
+         *    a little too short.
+         */
+        if (poll(arg)) {
+            found = 1;
+            limit += limit / 4;
+        }
+    }
+
+    if (limit < CHIK_SYNC_SPIN_MIN)
+        limit = CHIK_SYNC_SPIN_MIN;
+
+    if (limit > CHIK_SYNC_SPIN_MAX)
+        limit = CHIK_SYNC_SPIN_MAX;
+
+    __atomic_store_n(&backoff->limit, (unsigned int)limit, __ATOMIC_RELAXED);
+
+    return found;
+}
+
+/*
+ *    Wakes threads sleeping on the event. This is a single load
+ *    when nobody is sleeping, and a single-thread wake is skipped
+ *    while an earlier one has not been picked up yet, so a burst
+ *    of notifications costs one system call rather than one each.
+ *    Single-thread wakes are also skipped while a thread is spinning
+ *    in sync_backoff(), since the spinner will find the work.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param int           count    The maximum number of threads to wake.
+ */
+void sync_event_notify(sync_event_t *event, int count) {
+    /*
+     *    Pairs with the increment in sync_event_prepare(), so either
+     *    we see the sleeper or the sleeper sees what we published.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&event->sleepers, __ATOMIC_RELAXED) == 0)
+        return;
+
+    if (count == 1 && __atomic_load_n(&event->spinners, __ATOMIC_RELAXED) != 0)
+        return;
+
+    /*
+     *    Every thread that leaves the sleep path re-arms the event,
+     *    so a skipped wake is always followed by somebody looking.
+     */
+    if (count == 1 && __atomic_exchange_n(&event->armed, 0, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    __atomic_fetch_add(&event->seq, 1, __ATOMIC_SEQ_CST);
+    sync_futex_wake(&event->seq, count);
+}
@@ -0,0 +1,173 @@
+/*
+ *    sync.h    --    header for low-level synchronization primitives
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file declares the small set of primitives that the
+ *    lock-free containers are built on: cache line padding,
+ *    a cpu relax hint, futex waiting and an event count that
+ *    lets a consumer go to sleep without missing a wake-up.
+ *
+ *    Consumers that find nothing to do back off in three steps:
+ *    they spin for a while, yield a few times, and only then sleep.
+ *    How long they spin adapts to how often spinning pays off.
+ */
+#ifndef CHIK_SYNC_H
+#define CHIK_SYNC_H
+
+#define CHIK_CACHE_LINE 64
+
+#define CHIK_ALIGNED(x) __attribute__((aligned(x)))
+
+/*
+ *    Bounds of the adaptive spin, in polls.
+ */
+#define CHIK_SYNC_SPIN_MIN 16
+#define CHIK_SYNC_SPIN_MAX 4096
+
+/*
+ *    How many times a backing off thread yields before it sleeps.
+ */
+#define CHIK_SYNC_YIELDS 4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define sync_pause() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define sync_pause() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define sync_pause() __asm__ __volatile__("" ::: "memory")
+#endif /* __x86_64__  */
+
+typedef struct {
+    unsigned int seq;
+    unsigned int sleepers;
+    unsigned int armed;
+    unsigned int spinners;
+} sync_event_t;
+
+typedef struct {
+    unsigned int limit;
+} sync_backoff_t;
+
+/*
+ *    Returns a monotonic timestamp.
+ *
+ *    @return unsigned long    The time in nanoseconds.
+ */
+unsigned long sync_now(void);
+
+/*
+ *    Sleeps while the word at addr still holds val.
+ *
+ *    @param unsigned int *addr    The word to wait on.
+ *    @param unsigned int  val     The value the word is expected to hold.
+ */
+void sync_futex_wait(unsigned int *addr, unsigned int val);
+
+/*
+ *    Sleeps while the word at addr still holds val, for at most ns
+ *    nanoseconds.
+ *
+ *    @param unsigned int *addr    The word to wait on.
+ *    @param unsigned int  val     The value the word is expected to hold.
+ *    @param unsigned long ns      The timeout in nanoseconds.
+ */
+void sync_futex_wait_timeout(unsigned int *addr, unsigned int val,
+                             unsigned long ns);
+
+/*
+ *    Wakes threads sleeping on a word.
+ *
+ *    @param unsigned int *addr    The word to wake.
+ *    @param int           count   The maximum number of threads to wake.
+ */
+void sync_futex_wake(unsigned int *addr, int count);
+
+/*
+ *    Initializes an event count.
+ *
+ *    @param sync_event_t *event    The event count to initialize.
+ */
+void sync_event_init(sync_event_t *event);
+
+/*
+ *    Announces that the calling thread is about to sleep on the event.
+ *    The caller must re-check its condition after this call, and then
+ *    either call sync_event_wait() with the returned key or
+ *    sync_event_cancel() if the condition was met.
+ *
+ *    @param sync_event_t *event    The event count.
+ *
+ *    @return unsigned int    The key to pass to sync_event_wait().
+ */
+unsigned int sync_event_prepare(sync_event_t *event);
+
+/*
+ *    Withdraws a sleep announced with sync_event_prepare().
+ *
+ *    @param sync_event_t *event    The event count.
+ */
+void sync_event_cancel(sync_event_t *event);
+
+/*
+ *    Sleeps until the event is notified after the key was taken.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param unsigned int  key      The key from sync_event_prepare().
+ */
+void sync_event_wait(sync_event_t *event, unsigned int key);
+
+/*
+ *    Sleeps until the event is notified after the key was taken, or
+ *    until the timeout runs out.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param unsigned int  key      The key from sync_event_prepare().
+ *    @param unsigned long ns       The timeout in nanoseconds.
+ */
+void sync_event_wait_timeout(sync_event_t *event, unsigned int key,
+                             unsigned long ns);
+
+/*
+ *    Initializes an adaptive backoff.
+ *
+ *    @param sync_backoff_t *backoff    The backoff to initialize.
+ */
+void sync_backoff_init(sync_backoff_t *backoff);
+
+/*
+ *    Spins and then yields until poll(arg) returns nonzero or the
+ *    budget runs out. While it spins, the thread counts as a spinner
+ *    of the event, so single-thread notifications don't wake a
+ *    sleeper for work the spinner is about to pick up. On a single
+ *    cpu it returns 0 right away. A caller that
+ *    gets 0 back must go through sync_event_prepare() and re-check
+ *    before it sleeps.
+ *
+ *    @param sync_backoff_t *backoff    The backoff state.
+ *    @param sync_event_t   *event      The event the caller would sleep on.
+ *    @param int (*poll)(void *)        Looks for work, taking it if found.
+ *    @param void *arg                  The argument to pass to poll.
+ *
+ *    @return int    1 if poll found work, 0 if the caller should sleep.
+ */
+int sync_backoff(sync_backoff_t *backoff, sync_event_t *event,
+                 int (*poll)(void *), void *arg);
+
+/*
+ *    Wakes threads sleeping on the event. This is a single load
+ *    when nobody is sleeping, and a single-thread wake is skipped
+ *    while an earlier one has not been picked up yet, so a burst
+ *    of notifications costs one system call rather than one each.
+ *    Single-thread wakes are also skipped while a thread is spinning
+ *    in sync_backoff(), since the spinner will find the work.
+ *
+ *    @param sync_event_t *event    The event count.
+ *    @param int           count    The maximum number of threads to wake.
+ */
+void sync_event_notify(sync_event_t *event, int count);
+
+#endif /* CHIK_SYNC_H  */
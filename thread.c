@@ -10,97 +10,3672 @@
  *
  *    This file will defines the functions for creating and manipulating
  * threads.
+ *
+ *    Every worker owns a work-stealing deque. Tasks submitted by a
+ *    worker go onto its own deque, tasks submitted from anywhere else
+ *    go through the shared injector queue of their priority class,
+ *    and a worker that runs dry steals from a random victim before
+ *    going to sleep.
+ *
+ *    Tasks submitted as fibers run on their own stack. When such a
+ *    task waits, its fiber is parked on the worker and the worker goes
+ *    on with other tasks, resuming the fiber once its wait is over.
  */
+#if __linux__
+#define _GNU_SOURCE
+#endif /* __linux__  */
+
 #include "thread.h"
 
 #include <malloc.h>
 #include <memory.h>
+#include <stdio.h>
+
+#if __linux__
+#include <sched.h>
+#endif /* __linux__  */
 
 #include "aqueue.h"
+#include "deque.h"
+#include "fiber.h"
+#include "log.h"
+#include "mempool.h"
+#include "profiler.h"
+
+typedef struct {
+#if __unix__
+    pthread_t thread;
+#endif /* __unix__  */
+    unsigned int  state;
+    threadpool_t *pool;
+    deque_t      *deque;
+
+    fiber_t *parked;
+    fiber_t *parked_tail;
+
+    sync_backoff_t backoff;
+
+    /*
+     *    Only written by the worker itself, so running a task doesn't
+     *    touch a shared cache line.
+     */
+    threadpool_priority_stats_t stats[THREADPOOL_PRIORITY_COUNT];
+
+    /*
+     *    The remaining counters, see threadpool_worker_stats_pool().
+     *    idle_since is the time the worker last ran out of work while
+     *    it has none, and 0 while it has.
+     */
+    threadpool_worker_stats_t counters;
+    aqueue_stats_t            queue;       /* Counted into by the thread. */
+    unsigned long             born;
+    unsigned long             idle_since;
+    unsigned long             died;
+    unsigned int              sample;
+} _threadpool_worker_t;
+
+typedef struct {
+    aqueue_t *queue;
+
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long depth;
+    unsigned long served; /* When a task was last taken from the queue.  */
+
+    /*
+     *    A growable ring the injector spills into when it is full and
+     *    the pool is elastic. While it holds tasks, new ones go there
+     *    too, so the class stays in submission order.
+     */
+    CHIK_ALIGNED(CHIK_CACHE_LINE) unsigned long overflow;
+#if __unix__
+    pthread_mutex_t overflow_lock;
+#endif /* __unix__  */
+    task_t       *overflow_tasks;
+    unsigned long overflow_head;
+    unsigned long overflow_size;
+} _threadpool_class_t;
 
-aqueue_t *_threadpool = 0;
-int       _threads    = 0;
+/*
+ *   The states of a worker slot. A worker that exited leaves its slot
+ *   to whoever joins it next.
+ */
+#define THREADPOOL_WORKER_FREE    0
+#define THREADPOOL_WORKER_RUNNING 1
+#define THREADPOOL_WORKER_EXITED  2
 
 /*
- *   The thread function.
+ *   A timeout for the submit functions that means no timeout.
+ */
+#define THREADPOOL_FOREVER ((unsigned long)-1)
+
+/*
+ *   Set in the pending count of a group while the task that finished
+ *   it last is still waking its waiters, see _threadpool_group_done_many().
+ */
+#define THREADPOOL_GROUP_CLOSING 0x80000000u
+
+struct threadpool_s {
+    _threadpool_class_t   classes[THREADPOOL_PRIORITY_COUNT];
+    _threadpool_worker_t *workers;
+    int                   threads;
+    sync_event_t          event;
+    unsigned int          parked;
+    unsigned int          stop;
+    int                   elastic;
+
+    /*
+     *   threads counts the worker slots, which min_threads of are
+     *   always running. span covers every slot that has been used, live
+     *   counts the workers running and blocked the ones of them inside
+     *   threadpool_block_begin().
+     */
+    int           min_threads;
+    unsigned int  span;
+    unsigned int  live;
+    unsigned int  blocked;
+    unsigned long idle_ns;
+    unsigned long spawn_ns;
+    unsigned long grown; /* When a queue wait last added a worker.     */
+    int           pin;
+#if __unix__
+    pthread_mutex_t grow_lock;
+#endif /* __unix__  */
+
+    /*
+     *   Statistics of tasks run by threads outside the pool.
+     */
+    threadpool_priority_stats_t outside[THREADPOOL_PRIORITY_COUNT];
+
+    /*
+     *   The cpus workers are placed on, and the ones reserved for the
+     *   application, in placement order.
+     */
+    int          *cpus;
+    unsigned long cpu_count;
+    int          *reserved;
+    unsigned long reserved_count;
+
+    /*
+     *   Every task belongs to this group, so it counts all queued and
+     *   running tasks.
+     */
+    threadpool_group_t all;
+
+    /*
+     *   Timers wait in a wheel that a thread of their own serves,
+     *   started along with the first timer.
+     */
+#if __unix__
+    pthread_mutex_t timer_lock;
+    pthread_t       timer_thread;
+#endif /* __unix__  */
+    timer_wheel_t *timers;
+    unsigned long  timer_base; /* The sync_now() time of tick 0.         */
+    unsigned long  timer_wake; /* The tick the timer thread sleeps until. */
+    sync_event_t   timer_event;
+    unsigned int   timer_stop;
+    char           name[16];
+
+    threadpool_t *next;
+};
+
+/*
+ *   The pool behind the functions that don't take one, set up by
+ *   threadpool_init().
+ */
+threadpool_t _threadpool_default;
+
+/*
+ *   Every running pool, so a fiber becoming ready can wake the pool
+ *   it is parked in. _threadpool_parked counts parked fibers, and
+ *   threads sleeping in _threadpool_wait_ready(), across all of them
+ *   and keeps that cheap while none are.
+ */
+threadpool_t *_threadpool_pools  = 0;
+unsigned int  _threadpool_parked = 0;
+#if __unix__
+pthread_mutex_t _threadpool_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* __unix__  */
+
+typedef struct {
+    unsigned long next;
+    unsigned long end;
+    unsigned long grain;
+    void (*fun)(unsigned long, unsigned long, void *);
+    void (*reduce)(unsigned long, unsigned long, void *, void *);
+    void *ctx;
+
+    const void   *identity;
+    unsigned long size;
+    unsigned long stride;
+    unsigned long slots;
+    char         *accs;
+} _threadpool_range_t;
+
+__thread _threadpool_worker_t *_threadpool_self     = 0;
+__thread unsigned int          _threadpool_seed     = 0;
+__thread unsigned int          _threadpool_priority = THREADPOOL_PRIORITY_NORMAL;
+__thread unsigned int          _threadpool_aging    = 0;
+__thread threadpool_t         *_threadpool_running  = 0;
+__thread mempool_t            *_threadpool_scratch  = 0;
+
+/*
+ *   Scratch arenas are freed along with their thread through this key.
+ */
+#if __unix__
+pthread_key_t  _threadpool_scratch_key;
+pthread_once_t _threadpool_scratch_once = PTHREAD_ONCE_INIT;
+#endif /* __unix__  */
+
+/*
+ *   The profiler region tasks that carry a flow run in.
+ */
+unsigned int _threadpool_task_region = CHIK_PROFILER_NO_REGION;
+
+
+/*
+ *   Returns the next pseudo-random number for the calling thread.
  *
- *   @param void *arg    The argument to pass to the function.
+ *   @return unsigned int    The random number.
+ */
+static unsigned int _threadpool_random(void) {
+    if (_threadpool_seed == 0)
+        _threadpool_seed = (unsigned int)(unsigned long)&_threadpool_seed | 1;
+
+    _threadpool_seed ^= _threadpool_seed << 13;
+    _threadpool_seed ^= _threadpool_seed >> 17;
+    _threadpool_seed ^= _threadpool_seed << 5;
+
+    return _threadpool_seed;
+}
+
+/*
+ *   Bumps a counter of the calling worker. Only the worker writes its
+ *   counters, so there's no need for a locked add.
  *
- *   @return void*    The return value of the function.
+ *   @param unsigned long *counter    The counter.
+ *   @param unsigned long  value      What to add.
  */
-void *_threadpool_thread(void *arg) {
-    task_t *task;
+static void _threadpool_count(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
 
-    while (1) {
-        task = aqueue_get(_threadpool);
+/*
+ *   Adds a value to a histogram of the calling worker. The count is
+ *   left for readers to sum up from the buckets.
+ *
+ *   @param threadpool_histogram_t *hist     The histogram.
+ *   @param unsigned long           value    The value.
+ */
+static void _threadpool_hist_add(threadpool_histogram_t *hist,
+                                 unsigned long value) {
+    unsigned long bucket = 0;
 
-        if (task == 0)
-            break;
+    if (value > 1)
+        bucket = 63 - __builtin_clzl(value);
 
-        task->fun(task->arg);
-    }
+    if (bucket >= LIBCHIK_THREADPOOL_HIST_BUCKETS)
+        bucket = LIBCHIK_THREADPOOL_HIST_BUCKETS - 1;
+
+    _threadpool_count(&hist->buckets[bucket], 1);
+    _threadpool_count(&hist->total, value);
+
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+/*
+ *   Returns the calling thread's worker if it works for a pool.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return _threadpool_worker_t*    The worker, or 0 if the thread
+ *                                    doesn't work for the pool.
+ */
+static _threadpool_worker_t *_threadpool_worker(threadpool_t *pool) {
+    if (_threadpool_self != 0 && _threadpool_self->pool == pool)
+        return _threadpool_self;
 
     return 0;
 }
 
+void *_threadpool_thread(void *arg);
+
 /*
- *   Initializes the global threadpool.
+ *   Starts a worker in a free slot of a pool. The caller counts it
+ *   in pool->live.
  *
- *   @param unsigned long size       The size of the threadpool.
- *   @param unsigned long threads    The number of threads to spawn.
+ *   @param threadpool_t *pool     The pool.
+ *   @param unsigned long index    The slot.
  *
  *   @return int    0 on success, -1 on failure.
  */
-int threadpool_init(unsigned long size, unsigned long threads) {
-    unsigned long i;
+static int _threadpool_spawn(threadpool_t *pool, unsigned long index) {
+    _threadpool_worker_t *worker = &pool->workers[index];
+
 #if __unix__
-    pthread_t thread;
-#endif /* __unix__  */
+    pthread_attr_t attr;
+    char           name[16];
+    int            ret;
+
+    pthread_attr_init(&attr);
+
+#if __linux__
+    if (pool->pin && pool->cpu_count != 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(pool->cpus[index % pool->cpu_count], &set);
+
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+#endif /* __linux__  */
+
+    __atomic_store_n(&worker->state, THREADPOOL_WORKER_RUNNING,
+                     __ATOMIC_RELAXED);
 
-    _threadpool = aqueue_new(size);
-    _threads    = threads;
+    ret = pthread_create(&worker->thread, &attr, _threadpool_thread, worker);
+    pthread_attr_destroy(&attr);
 
-    if (_threadpool == 0)
+    if (ret != 0) {
+        __atomic_store_n(&worker->state, THREADPOOL_WORKER_FREE,
+                         __ATOMIC_RELAXED);
+        LOGF_ERR("Failed to create worker thread\n");
         return -1;
+    }
 
-    for (i = 0; i < threads; i++) {
-#if __unix__
-        if (pthread_create(&thread, 0, _threadpool_thread, 0) != 0)
-            return -1;
+#if __linux__
+    snprintf(name, sizeof(name), "%.10s-%lu", pool->name, index % 10000);
+    pthread_setname_np(worker->thread, name);
+#endif /* __linux__  */
 #else
 //#error "Unsupported platform"
+    return -1;
+#endif /* __unix__  */
+
+    return 0;
+}
+
+/*
+ *   Adds a worker to an elastic pool, in the first slot without a
+ *   running worker.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    0 on success, -1 if the pool is at its maximum.
+ */
+static int _threadpool_grow(threadpool_t *pool) {
+    _threadpool_worker_t *worker;
+    unsigned long         i;
+    int                   ret = -1;
+
+    if (__atomic_load_n(&pool->live, __ATOMIC_RELAXED) >=
+        (unsigned int)pool->threads)
+        return -1;
+
+#if __unix__
+    pthread_mutex_lock(&pool->grow_lock);
+#endif /* __unix__  */
+
+    for (i = 0; i < (unsigned long)pool->threads; i++) {
+        worker = &pool->workers[i];
+
+        if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        if (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) ==
+            THREADPOOL_WORKER_RUNNING)
+            continue;
+
+#if __unix__
+        if (worker->state == THREADPOOL_WORKER_EXITED)
+            pthread_join(worker->thread, 0);
+#endif /* __unix__  */
+
+        worker->state = THREADPOOL_WORKER_FREE;
+
+        __atomic_fetch_add(&pool->live, 1, __ATOMIC_SEQ_CST);
+
+        if (_threadpool_spawn(pool, i) != 0) {
+            __atomic_fetch_sub(&pool->live, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        if (i + 1 > __atomic_load_n(&pool->span, __ATOMIC_RELAXED))
+            __atomic_store_n(&pool->span, (unsigned int)(i + 1),
+                             __ATOMIC_RELEASE);
+
+        ret = 0;
+        break;
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&pool->grow_lock);
 #endif /* __unix__  */
+
+    return ret;
+}
+
+/*
+ *   Lets a surplus worker of an elastic pool exit.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    1 if the worker may exit, 0 if the pool needs it.
+ */
+static int _threadpool_retire(threadpool_t *pool) {
+    unsigned int live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+
+    while (live > (unsigned int)pool->min_threads) {
+        if (__atomic_compare_exchange_n(&pool->live, &live, live - 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return 1;
     }
 
     return 0;
 }
 
 /*
- *   Destroys the global threadpool.
+ *   Adds a worker to an elastic pool if a task waited too long in the
+ *   queue and no worker is asleep, at most once per
+ *   LIBCHIK_THREADPOOL_SPAWN_INTERVAL_NS.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *   @param unsigned long wait    How long the task waited.
+ *   @param unsigned long now     The current time.
+ */
+static void _threadpool_check_wait(threadpool_t *pool, unsigned long wait,
+                                   unsigned long now) {
+    unsigned long grown;
+
+    if (wait < pool->spawn_ns || pool->threads == pool->min_threads)
+        return;
+
+    if (__atomic_load_n(&pool->event.sleepers, __ATOMIC_RELAXED) != 0)
+        return;
+
+    grown = __atomic_load_n(&pool->grown, __ATOMIC_RELAXED);
+
+    if (now - grown < LIBCHIK_THREADPOOL_SPAWN_INTERVAL_NS ||
+        !__atomic_compare_exchange_n(&pool->grown, &grown, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    _threadpool_grow(pool);
+}
+
+/*
+ *   Adds a worker to an elastic pool if blocked tasks leave fewer
+ *   than min_threads workers running.
+ *
+ *   @param threadpool_t *pool    The pool.
  */
-void threadpool_destroy(void) { aqueue_destroy(_threadpool); }
+static void _threadpool_check_blocked(threadpool_t *pool) {
+    unsigned int blocked = __atomic_load_n(&pool->blocked, __ATOMIC_RELAXED);
+
+    if (blocked == 0 || pool->threads == pool->min_threads)
+        return;
+
+    if (__atomic_load_n(&pool->live, __ATOMIC_RELAXED) - blocked <
+        (unsigned int)pool->min_threads)
+        _threadpool_grow(pool);
+}
 
 /*
- *   Submits a task to the global threadpool.
+ *   Tries to steal a task from the other workers, starting at a
+ *   random victim.
  *
- *   @param void *(*fun)(void *)    The function to execute.
- *   @param void *arg               The argument to pass to the function.
+ *   @param threadpool_t         *pool      The pool.
+ *   @param _threadpool_worker_t *worker    The stealing worker, or 0 for
+ *                                          a thread outside the pool.
+ *   @param task_t               *task      Where to store the task.
+ *
+ *   @return int    0 on success, -1 if there was nothing to steal.
+ */
+static int _threadpool_steal(threadpool_t *pool, _threadpool_worker_t *worker,
+                             task_t *task) {
+    unsigned long span;
+    unsigned long start;
+    unsigned long i;
+    int           ret;
+    int           retry;
+
+    do {
+        retry = 0;
+        span  = __atomic_load_n(&pool->span, __ATOMIC_ACQUIRE);
+        start = _threadpool_random() % span;
+
+        for (i = 0; i < span; i++) {
+            _threadpool_worker_t *victim = &pool->workers[(start + i) % span];
+
+            if (victim == worker)
+                continue;
+
+            ret = deque_steal(victim->deque, task);
+
+            if (ret == 0) {
+                if (worker != 0)
+                    _threadpool_count(&worker->counters.steals, 1);
+
+                return 0;
+            }
+
+            if (ret > 0)
+                retry = 1;
+        }
+    } while (retry);
+
+    if (worker != 0)
+        _threadpool_count(&worker->counters.steal_misses, 1);
+
+    return -1;
+}
+
+/*
+ *   Appends tasks to the overflow list of a class, growing it if
+ *   they don't fit.
+ *
+ *   @param _threadpool_class_t *class    The class.
+ *   @param task_t              *task     The tasks.
+ *   @param unsigned long        count    The number of tasks.
  *
  *   @return int    0 on success, -1 on failure.
  */
-int threadpool_submit(void *(*fun)(void *), void *arg) {
-    task_t task;
+static int _threadpool_overflow_push(_threadpool_class_t *class,
+                                     task_t *task, unsigned long count) {
+    task_t       *tasks;
+    unsigned long size;
+    unsigned long i;
+
+#if __unix__
+    pthread_mutex_lock(&class->overflow_lock);
+#endif /* __unix__  */
+
+    if (class->overflow + count > class->overflow_size) {
+        size = class->overflow_size != 0 ? class->overflow_size * 2
+                                         : LIBCHIK_THREADPOOL_OVERFLOW_SIZE;
+
+        while (size < class->overflow + count)
+            size *= 2;
+
+        tasks = (task_t *)malloc(size * sizeof(task_t));
+
+        if (tasks == 0) {
+#if __unix__
+            pthread_mutex_unlock(&class->overflow_lock);
+#endif /* __unix__  */
+            LOGF_ERR("Failed to allocate memory for threadpool overflow\n");
+            return -1;
+        }
+
+        for (i = 0; i < class->overflow; i++)
+            tasks[i] = class->overflow_tasks[(class->overflow_head + i) %
+                                             class->overflow_size];
+
+        free(class->overflow_tasks);
+
+        class->overflow_tasks = tasks;
+        class->overflow_head  = 0;
+        class->overflow_size  = size;
+    }
+
+    for (i = 0; i < count; i++)
+        class->overflow_tasks[(class->overflow_head + class->overflow + i) %
+                              class->overflow_size] = task[i];
+
+    __atomic_store_n(&class->overflow, class->overflow + count, __ATOMIC_RELEASE);
+
+#if __unix__
+    pthread_mutex_unlock(&class->overflow_lock);
+#endif /* __unix__  */
 
-    task.fun = fun;
-    task.arg = arg;
+    return 0;
+}
+
+/*
+ *   Takes the oldest task from the overflow list of a class.
+ *
+ *   @param _threadpool_class_t *class    The class.
+ *   @param task_t              *task     Where to store the task.
+ *
+ *   @return int    0 on success, -1 if the list is empty.
+ */
+static int _threadpool_overflow_pop(_threadpool_class_t *class, task_t *task) {
+    int ret = -1;
+
+    if (__atomic_load_n(&class->overflow, __ATOMIC_ACQUIRE) == 0)
+        return -1;
+
+#if __unix__
+    pthread_mutex_lock(&class->overflow_lock);
+#endif /* __unix__  */
+
+    if (class->overflow != 0) {
+        *task                = class->overflow_tasks[class->overflow_head];
+        class->overflow_head = (class->overflow_head + 1) % class->overflow_size;
+
+        __atomic_store_n(&class->overflow, class->overflow - 1, __ATOMIC_RELEASE);
+        ret = 0;
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&class->overflow_lock);
+#endif /* __unix__  */
 
-    return aqueue_add(_threadpool, &task);
+    return ret;
 }
 
 /*
- *   Waits for all tasks to complete.
+ *   Takes a task from the injector of a priority class and records
+ *   how long it was queued.
+ *
+ *   @param threadpool_t  *pool        The pool.
+ *   @param int            priority    The priority class.
+ *   @param task_t        *task        Where to store the task.
+ *   @param unsigned long *now         The current time, or 0 if it
+ *                                     hasn't been read yet.
+ *
+ *   @return int    0 on success, -1 if the injector is empty.
  */
-void threadpool_wait(void) {
-    while (aqueue_waiting(_threadpool) < _threads)
+static int _threadpool_take(threadpool_t *pool, int priority, task_t *task,
+                            unsigned long *now) {
+    _threadpool_class_t         *class  = &pool->classes[priority];
+    _threadpool_worker_t        *worker = _threadpool_worker(pool);
+    threadpool_priority_stats_t *stats;
+    unsigned long                depth;
+    unsigned long                wait;
+    unsigned long                max;
+
+    if (aqueue_try_get(class->queue, task) != 0 &&
+        _threadpool_overflow_pop(class, task) != 0)
+        return -1;
+
+    depth = __atomic_fetch_sub(&class->depth, 1, __ATOMIC_RELAXED);
+
+    if (*now == 0)
+        *now = sync_now();
+
+    if (priority != THREADPOOL_PRIORITY_HIGH)
+        __atomic_store_n(&class->served, *now, __ATOMIC_RELAXED);
+
+    wait = *now - task->time;
+
+    if (worker != 0) {
+        stats = &worker->stats[priority];
+
+        __atomic_store_n(&stats->queued, stats->queued + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->wait_total, stats->wait_total + wait,
+                         __ATOMIC_RELAXED);
+
+        if (wait > stats->wait_max)
+            __atomic_store_n(&stats->wait_max, wait, __ATOMIC_RELAXED);
+
+        _threadpool_hist_add(&worker->counters.depth, depth);
+        _threadpool_hist_add(&worker->counters.wait, wait);
+        _threadpool_check_wait(pool, wait, *now);
+
+        return 0;
+    }
+
+    stats = &pool->outside[priority];
+
+    __atomic_fetch_add(&stats->queued, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->wait_total, wait, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&stats->wait_max, __ATOMIC_RELAXED);
+    while (wait > max &&
+           !__atomic_compare_exchange_n(&stats->wait_max, &max, wait, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
         ;
-}
\ No newline at end of file
+
+    _threadpool_check_wait(pool, wait, *now);
+
+    return 0;
+}
+
+/*
+ *   Returns the least urgent class with queued work that hasn't been
+ *   served for LIBCHIK_THREADPOOL_AGING_NS.
+ *
+ *   @param threadpool_t  *pool    The pool.
+ *   @param unsigned long *now     Where to store the current time if it
+ *                                 had to be read.
+ *
+ *   @return int    The priority class, or -1 if none is starving.
+ */
+static int _threadpool_aged(threadpool_t *pool, unsigned long *now) {
+    int i;
+
+    if (_threadpool_aging-- != 0)
+        return -1;
+
+    _threadpool_aging = LIBCHIK_THREADPOOL_AGING_CHECK - 1;
+
+    for (i = THREADPOOL_PRIORITY_COUNT - 1; i > THREADPOOL_PRIORITY_HIGH; i--) {
+        _threadpool_class_t *class = &pool->classes[i];
+
+        if (__atomic_load_n(&class->depth, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        if (*now == 0)
+            *now = sync_now();
+
+        if (*now - __atomic_load_n(&class->served, __ATOMIC_RELAXED) >
+            LIBCHIK_THREADPOOL_AGING_NS)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ *   Finds the next task for a worker. A starving class goes first,
+ *   then urgent work, then the worker's own deque, the remaining
+ *   injectors from most to least urgent, and finally the other workers.
+ *   The deque comes after urgent work but before the rest, since its
+ *   tasks continue work that has already started.
+ *
+ *   @param threadpool_t         *pool      The pool.
+ *   @param _threadpool_worker_t *worker    The worker, or 0 for a thread
+ *                                          outside the pool.
+ *   @param task_t               *task      Where to store the task.
+ *
+ *   @return int    0 on success, -1 if there is no work anywhere.
+ */
+static int _threadpool_find(threadpool_t *pool, _threadpool_worker_t *worker,
+                            task_t *task) {
+    unsigned long now  = 0;
+    int           aged = _threadpool_aged(pool, &now);
+    int           i;
+
+    if (aged >= 0 && _threadpool_take(pool, aged, task, &now) == 0)
+        return 0;
+
+    if (_threadpool_take(pool, THREADPOOL_PRIORITY_HIGH, task, &now) == 0)
+        return 0;
+
+    if (worker != 0 && deque_pop(worker->deque, task) == 0)
+        return 0;
+
+    for (i = THREADPOOL_PRIORITY_HIGH + 1; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        if (_threadpool_take(pool, i, task, &now) == 0)
+            return 0;
+    }
+
+    return _threadpool_steal(pool, worker, task);
+}
+
+/*
+ *   Returns whether any work is visible in a pool.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    1 if there is queued work, 0 otherwise.
+ */
+static int _threadpool_has_work(threadpool_t *pool) {
+    int i;
+
+    for (i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        aqueue_t *queue = pool->classes[i].queue;
+
+        if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) !=
+                __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) ||
+            __atomic_load_n(&pool->classes[i].overflow, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+
+    for (i = 0; i < (int)__atomic_load_n(&pool->span, __ATOMIC_ACQUIRE); i++) {
+        if (deque_count(pool->workers[i].deque) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ *   Marks tasks of a group as finished, waking the group's waiters
+ *   if they were the last ones.
+ *
+ *   @param threadpool_group_t *group    The group.
+ *   @param unsigned int        count    The number of tasks.
+ */
+static void _threadpool_group_done_many(threadpool_group_t *group,
+                                        unsigned int        count) {
+    unsigned int pending = __atomic_load_n(&group->pending, __ATOMIC_RELAXED);
+    unsigned int next;
+    unsigned int waiters;
+
+    /*
+     *    A waiter that sees nothing pending may return and free the
+     *    group, so the last task keeps the closing bit in the count
+     *    while it still touches the group, and waiters spin on it.
+     */
+    do {
+        next = pending - count;
+        if (next == 0)
+            next = THREADPOOL_GROUP_CLOSING;
+    } while (!__atomic_compare_exchange_n(&group->pending, &pending, next, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (pending != count)
+        return;
+
+    waiters = __atomic_load_n(&group->waiters, __ATOMIC_SEQ_CST);
+    if (waiters != 0)
+        sync_futex_wake(&group->pending, 0x7FFFFFFF);
+
+    __atomic_fetch_sub(&group->pending, THREADPOOL_GROUP_CLOSING,
+                       __ATOMIC_SEQ_CST);
+
+    if (waiters != 0)
+        threadpool_wake_parked();
+}
+
+/*
+ *   Marks one task of a group as finished, waking the group's waiters
+ *   if it was the last one.
+ *
+ *   @param threadpool_group_t *group    The group.
+ */
+static void _threadpool_group_done(threadpool_group_t *group) {
+    _threadpool_group_done_many(group, 1);
+}
+
+/*
+ *   Runs a task and marks it as finished.
+ *
+ *   @param threadpool_t *pool    The pool the task was taken from.
+ *   @param task_t       *task    The task to run.
+ */
+static void _threadpool_run(threadpool_t *pool, task_t *task) {
+    _threadpool_worker_t        *worker = _threadpool_worker(pool);
+    threadpool_priority_stats_t *stats;
+    threadpool_t                *from  = _threadpool_running;
+    unsigned int                 prev  = _threadpool_priority;
+    unsigned long                start = 0;
+    char                        *mark  = 0;
+    int                          fiber = fiber_current() != 0;
+
+    if (worker != 0) {
+        stats = &worker->stats[task->priority];
+        __atomic_store_n(&stats->run, stats->run + 1, __ATOMIC_RELAXED);
+
+        if (--worker->sample == 0) {
+            worker->sample = LIBCHIK_THREADPOOL_RUN_SAMPLE;
+            start          = sync_now();
+        }
+    } else {
+        __atomic_fetch_add(&pool->outside[task->priority].run, 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    /*
+     *    Tasks nest when a task helps while it waits, so release only
+     *    what this one allocated. A task run on a fiber can't allocate,
+     *    and the fiber may park and come back under another task, whose
+     *    allocations a late reset would release.
+     */
+    if (_threadpool_scratch != 0 && !fiber)
+        mark = mempool_mark(_threadpool_scratch);
+
+    _threadpool_priority = task->priority;
+    _threadpool_running  = pool;
+
+    /*
+     *    Tasks submitted during a capture show up as slices the flow
+     *    from their submitter points to.
+     */
+    if (task->flow != 0) {
+        chik_profiler_scope_begin(&_threadpool_task_region, "Threadpool task");
+        chik_profiler_flow_end(task->flow);
+    }
+
+    task->fun(task->arg);
+
+    if (task->flow != 0)
+        chik_profiler_end();
+
+    _threadpool_priority = prev;
+    _threadpool_running  = from;
+
+    if (_threadpool_scratch != 0 && !fiber)
+        mempool_reset(_threadpool_scratch, mark);
+
+    if (start != 0)
+        _threadpool_hist_add(&worker->counters.run, sync_now() - start);
+
+    if (task->group != 0)
+        _threadpool_group_done((threadpool_group_t *)task->group);
+
+    _threadpool_group_done(&pool->all);
+}
+
+/*
+ *   Finishes a fiber task, releasing its fiber before its group.
+ *
+ *   @param fiber_t *fiber    The finished fiber.
+ */
+static void _threadpool_fiber_done(fiber_t *fiber) {
+    threadpool_group_t *group = (threadpool_group_t *)fiber->group;
+
+    fiber_free(fiber);
+
+    if (group != 0)
+        _threadpool_group_done(group);
+}
+
+/*
+ *   Parks a suspended fiber at the end of a worker's parked list.
+ *
+ *   @param _threadpool_worker_t *worker    The worker.
+ *   @param fiber_t              *fiber     The fiber.
+ */
+static void _threadpool_park(_threadpool_worker_t *worker, fiber_t *fiber) {
+    fiber->next = 0;
+
+    if (worker->parked_tail != 0)
+        worker->parked_tail->next = fiber;
+    else
+        worker->parked = fiber;
+
+    worker->parked_tail = fiber;
+
+    __atomic_fetch_add(&worker->pool->parked, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&_threadpool_parked, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *   Resumes the first parked fiber of a worker whose wait is over.
+ *   A parked fiber still counts as a pending task of the pool.
+ *
+ *   @param _threadpool_worker_t *worker    The worker.
+ *
+ *   @return int    1 if a fiber was resumed, 0 otherwise.
+ */
+static int _threadpool_poll(_threadpool_worker_t *worker) {
+    fiber_t      *prev  = 0;
+    fiber_t      *fiber = worker->parked;
+    threadpool_t *running;
+
+    while (fiber != 0) {
+        if (fiber->wait_fun == 0 || fiber->wait_fun(fiber->wait_arg))
+            break;
+
+        prev  = fiber;
+        fiber = fiber->next;
+    }
+
+    if (fiber == 0)
+        return 0;
+
+    /*
+     *    Unlink before resuming, the fiber may poll this list itself.
+     */
+    if (prev != 0)
+        prev->next = fiber->next;
+    else
+        worker->parked = fiber->next;
+
+    if (worker->parked_tail == fiber)
+        worker->parked_tail = prev;
+
+    __atomic_fetch_sub(&worker->pool->parked, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&_threadpool_parked, 1, __ATOMIC_RELAXED);
+
+    running             = _threadpool_running;
+    _threadpool_running = worker->pool;
+
+    fiber_resume(fiber);
+
+    _threadpool_running = running;
+
+    if (fiber->done) {
+        _threadpool_fiber_done(fiber);
+        _threadpool_group_done(&worker->pool->all);
+    } else {
+        _threadpool_park(worker, fiber);
+    }
+
+    return 1;
+}
+
+/*
+ *   Waits on a thread that isn't a fiber until ready(arg) returns
+ *   nonzero, running the pool's tasks meanwhile. Once there is
+ *   nothing left to run it spins for a while, then sleeps on the
+ *   pool's event counted as parked, so threadpool_wake_parked() and
+ *   new tasks wake it. The condition may become true without either,
+ *   so the sleep is bounded and the condition polled.
+ *
+ *   @param threadpool_t *pool      The pool to help.
+ *   @param int (*ready)(void *)    The condition to wait for.
+ *   @param void *arg               The argument to pass to the condition.
+ */
+static void _threadpool_wait_ready(threadpool_t *pool, int (*ready)(void *),
+                                   void *arg) {
+    unsigned int spins = 0;
+    unsigned int key;
+
+    while (!ready(arg)) {
+        if (threadpool_help_pool(pool)) {
+            spins = 0;
+            continue;
+        }
+
+        if (spins++ < LIBCHIK_THREADPOOL_WAIT_SPIN) {
+            sync_pause();
+            continue;
+        }
+
+        __atomic_fetch_add(&pool->parked, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&_threadpool_parked, 1, __ATOMIC_SEQ_CST);
+
+        key = sync_event_prepare(&pool->event);
+
+        if (ready(arg))
+            sync_event_cancel(&pool->event);
+        else
+            sync_event_wait_timeout(&pool->event, key,
+                                    LIBCHIK_THREADPOOL_FIBER_POLL_NS);
+
+        __atomic_fetch_sub(&pool->parked, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&_threadpool_parked, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ *   Runs a fiber task until it finishes or waits for the first time.
+ *
+ *   @param void *arg    The fiber.
+ *
+ *   @return void*    Always 0.
+ */
+static void *_threadpool_fiber_task(void *arg) {
+    fiber_t              *fiber = (fiber_t *)arg;
+    threadpool_t         *pool  = (threadpool_t *)fiber->pool;
+    _threadpool_worker_t *self  = _threadpool_worker(pool);
+
+    fiber_resume(fiber);
+
+    if (fiber->done) {
+        _threadpool_fiber_done(fiber);
+        return 0;
+    }
+
+    /*
+     *    A thread outside the pool has nowhere to park the fiber, so
+     *    it sees the fiber through itself, helping while it waits.
+     */
+    if (self == 0) {
+        do {
+            if (fiber->wait_fun != 0)
+                _threadpool_wait_ready(pool, fiber->wait_fun, fiber->wait_arg);
+
+            fiber_resume(fiber);
+        } while (!fiber->done);
+
+        _threadpool_fiber_done(fiber);
+        return 0;
+    }
+
+    /*
+     *    The task returns now, but the fiber is still pending until
+     *    it finishes from _threadpool_poll().
+     */
+    __atomic_fetch_add(&pool->all.pending, 1, __ATOMIC_RELAXED);
+    _threadpool_park(self, fiber);
+
+    return 0;
+}
+
+typedef struct {
+    _threadpool_worker_t *worker;
+    task_t               *task;
+} _threadpool_search_t;
+
+/*
+ *   Looks for work while an idle worker backs off.
+ *
+ *   @param void *arg    The _threadpool_search_t of the worker.
+ *
+ *   @return int    1 if a task was found, 0 otherwise.
+ */
+static int _threadpool_search(void *arg) {
+    _threadpool_search_t *search = (_threadpool_search_t *)arg;
+
+    return _threadpool_find(search->worker->pool, search->worker,
+                            search->task) == 0;
+}
+
+/*
+ *   Returns whether a group has no pending tasks.
+ *
+ *   @param void *group    The group.
+ *
+ *   @return int    1 if the group is idle, 0 otherwise.
+ */
+static int _threadpool_group_idle(void *group) {
+    return __atomic_load_n(&((threadpool_group_t *)group)->pending,
+                           __ATOMIC_ACQUIRE) == 0;
+}
+
+/*
+ *   The thread function.
+ *
+ *   @param void *arg    The argument to pass to the function.
+ *
+ *   @return void*    The return value of the function.
+ */
+void *_threadpool_thread(void *arg) {
+    _threadpool_worker_t *self = (_threadpool_worker_t *)arg;
+    threadpool_t         *pool = self->pool;
+    task_t                task;
+    _threadpool_search_t  search;
+    unsigned long         now;
+    unsigned int          key;
+    int                   woken   = 0;
+    int                   retired = 0;
+    int                   resumed;
+
+    _threadpool_self = self;
+
+    /*
+     *    A worker taking over the slot of one that exited carries on
+     *    with its uptime, so idle ratios stay meaningful.
+     */
+    now = sync_now();
+    if (self->died != 0)
+        now -= self->died - self->born;
+
+    self->sample = LIBCHIK_THREADPOOL_RUN_SAMPLE;
+    aqueue_thread_stats_set(&self->queue);
+    __atomic_store_n(&self->born, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->died, 0, __ATOMIC_RELEASE);
+
+    search.worker = self;
+    search.task   = &task;
+
+    while (1) {
+        /*
+         *    Parked fibers and new tasks take turns, so neither can
+         *    starve the other.
+         */
+        resumed = self->parked != 0 && _threadpool_poll(self);
+
+        if (_threadpool_find(pool, self, &task) != 0) {
+            if (resumed)
+                continue;
+
+            woken = 1;
+
+            if (self->idle_since == 0)
+                __atomic_store_n(&self->idle_since, sync_now(),
+                                 __ATOMIC_RELAXED);
+
+            /*
+             *    Spin and yield for a while before sleeping, unless
+             *    fibers are parked, those are polled on a timer below.
+             */
+            if (self->parked != 0 ||
+                !sync_backoff(&self->backoff, &pool->event,
+                              _threadpool_search, &search)) {
+                key = sync_event_prepare(&pool->event);
+
+                if (_threadpool_find(pool, self, &task) != 0) {
+                    /*
+                     *    threadpool_destroy() only stops us once the
+                     *    queues have run dry.
+                     */
+                    if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST) &&
+                        self->parked == 0) {
+                        sync_event_cancel(&pool->event);
+                        break;
+                    }
+
+                    /*
+                     *    Not every wait condition can wake us, so keep
+                     *    polling every now and then while fibers are
+                     *    parked.
+                     */
+                    _threadpool_count(&self->counters.sleeps, 1);
+
+                    if (self->parked != 0) {
+                        sync_event_wait_timeout(&pool->event, key,
+                                                LIBCHIK_THREADPOOL_FIBER_POLL_NS);
+                    } else if (pool->threads != pool->min_threads) {
+                        /*
+                         *    Surplus workers of an elastic pool leave
+                         *    once they've been idle for long enough.
+                         */
+                        sync_event_wait_timeout(&pool->event, key,
+                                                pool->idle_ns);
+
+                        if (self->parked == 0 &&
+                            sync_now() - self->idle_since >= pool->idle_ns &&
+                            _threadpool_retire(pool)) {
+                            retired = 1;
+                            break;
+                        }
+                    } else {
+                        sync_event_wait(&pool->event, key);
+                    }
+                    continue;
+                }
+
+                sync_event_cancel(&pool->event);
+            }
+        }
+
+        /*
+         *    Submitters only wake one sleeper per burst, and none
+         *    while a worker spins, so pass the wake-up along if there
+         *    is more work behind us.
+         */
+        if (woken) {
+            woken = 0;
+
+            if (_threadpool_has_work(pool))
+                sync_event_notify(&pool->event, 1);
+        }
+
+        if (self->idle_since != 0) {
+            _threadpool_count(&self->counters.idle, sync_now() - self->idle_since);
+            __atomic_store_n(&self->idle_since, 0, __ATOMIC_RELAXED);
+        }
+
+        _threadpool_run(pool, &task);
+    }
+
+    /*
+     *    A wake-up meant for the pool may have reached us just as we
+     *    retired, pass it on.
+     */
+    if (retired && _threadpool_has_work(pool))
+        sync_event_notify(&pool->event, 1);
+
+    if (self->idle_since != 0) {
+        _threadpool_count(&self->counters.idle, sync_now() - self->idle_since);
+        __atomic_store_n(&self->idle_since, 0, __ATOMIC_RELAXED);
+    }
+
+    /*
+     *    The slot's counters stay for whoever takes it over next.
+     */
+    aqueue_thread_stats_set(0);
+
+    __atomic_store_n(&self->died, sync_now(), __ATOMIC_RELEASE);
+    __atomic_store_n(&self->state, THREADPOOL_WORKER_EXITED, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+#if __linux__
+/*
+ *   Reads a topology value of a cpu from sysfs.
+ *
+ *   @param int         cpu         The cpu.
+ *   @param const char *file        The topology file to read.
+ *   @param int         fallback    The value to use if it can't be read.
+ *
+ *   @return int    The value.
+ */
+static int _threadpool_sysfs_int(int cpu, const char *file, int fallback) {
+    char  path[128];
+    FILE *fp;
+    int   value;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+             cpu, file);
+
+    fp = fopen(path, "r");
+    if (fp == 0)
+        return fallback;
+
+    if (fscanf(fp, "%d", &value) != 1)
+        value = fallback;
+
+    fclose(fp);
+
+    return value;
+}
+#endif /* __linux__  */
+
+/*
+ *   Orders the cpus the process may run on for worker placement: one
+ *   cpu of every physical core first, then the SMT siblings. The
+ *   first reserved cores are set aside for the application, siblings
+ *   included.
+ *
+ *   @param threadpool_t *pool        The pool.
+ *   @param unsigned long reserved    The number of cores to reserve.
+ *   @param int           skip_smt    Whether to leave SMT siblings out.
+ */
+static void _threadpool_topology(threadpool_t *pool, unsigned long reserved,
+                                 int skip_smt) {
+    pool->cpu_count      = 0;
+    pool->reserved_count = 0;
+
+#if __linux__
+    cpu_set_t     set;
+    int           cpus[CPU_SETSIZE];
+    long          cores[CPU_SETSIZE];
+    char          primary[CPU_SETSIZE];
+    char          skip[CPU_SETSIZE];
+    unsigned long count = 0;
+    unsigned long i;
+    unsigned long j;
+    int           cpu;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        cpus[count]  = cpu;
+        cores[count] = (long)_threadpool_sysfs_int(cpu, "physical_package_id", 0)
+                           << 32 |
+                       (unsigned int)_threadpool_sysfs_int(cpu, "core_id", cpu);
+        count++;
+    }
+
+    pool->cpus     = (int *)calloc(count, sizeof(int));
+    pool->reserved = (int *)calloc(count, sizeof(int));
+
+    if (pool->cpus == 0 || pool->reserved == 0) {
+        LOGF_ERR("Failed to allocate memory for cpu topology\n");
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        primary[i] = 1;
+        skip[i]    = 0;
+
+        for (j = 0; j < i; j++) {
+            if (cores[j] == cores[i]) {
+                primary[i] = 0;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < count && pool->reserved_count < reserved; i++) {
+        if (!primary[i])
+            continue;
+
+        pool->reserved[pool->reserved_count++] = cpus[i];
+
+        for (j = i; j < count; j++) {
+            if (cores[j] == cores[i])
+                skip[j] = 1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (primary[i] && !skip[i])
+            pool->cpus[pool->cpu_count++] = cpus[i];
+    }
+
+    for (i = 0; i < count && !skip_smt; i++) {
+        if (!primary[i] && !skip[i])
+            pool->cpus[pool->cpu_count++] = cpus[i];
+    }
+#else
+//#error "Unsupported platform"
+#endif /* __linux__  */
+}
+
+/*
+ *   Stops the timer thread of a pool, if it has one, and drops the
+ *   timers that are still pending.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+static void _threadpool_timers_stop(threadpool_t *pool) {
+    threadpool_timer_t *timer;
+    timer_node_t       *node;
+
+    if (pool->timers == 0)
+        return;
+
+#if __unix__
+    pthread_mutex_lock(&pool->timer_lock);
+    __atomic_store_n(&pool->timer_stop, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    sync_event_notify(&pool->timer_event, 1);
+    pthread_join(pool->timer_thread, 0);
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
+    while ((node = timer_wheel_expire(pool->timers, CHIK_TIMER_NEVER)) != 0) {
+        timer = (threadpool_timer_t *)node;
+
+        if (timer->owned)
+            free(timer);
+    }
+
+    free(pool->timers);
+    pool->timers = 0;
+}
+
+/*
+ *   Stops a pool and releases everything it holds. Queued tasks are
+ *   run, then the workers are joined. Also cleans up after a pool
+ *   that failed to start.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+static void _threadpool_teardown(threadpool_t *pool) {
+    threadpool_t **link;
+    int            i;
+
+#if __unix__
+    pthread_mutex_lock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+
+    for (link = &_threadpool_pools; *link != 0; link = &(*link)->next) {
+        if (*link == pool) {
+            *link = pool->next;
+            break;
+        }
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+
+    _threadpool_timers_stop(pool);
+
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+    sync_event_notify(&pool->event, 0x7FFFFFFF);
+
+    /*
+     *    Once a worker that is adding another one is through, no more
+     *    are added.
+     */
+#if __unix__
+    pthread_mutex_lock(&pool->grow_lock);
+    pthread_mutex_unlock(&pool->grow_lock);
+#endif /* __unix__  */
+
+    for (i = 0; i < pool->threads; i++) {
+#if __unix__
+        if (pool->workers[i].state != THREADPOOL_WORKER_FREE)
+            pthread_join(pool->workers[i].thread, 0);
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+    }
+
+    for (i = 0; i < pool->threads; i++) {
+        if (pool->workers[i].deque != 0)
+            deque_destroy(pool->workers[i].deque);
+    }
+
+    free(pool->workers);
+
+    for (i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        if (pool->classes[i].queue != 0)
+            aqueue_destroy(pool->classes[i].queue);
+
+        free(pool->classes[i].overflow_tasks);
+#if __unix__
+        pthread_mutex_destroy(&pool->classes[i].overflow_lock);
+#endif /* __unix__  */
+    }
+
+    free(pool->cpus);
+    free(pool->reserved);
+
+#if __unix__
+    pthread_mutex_destroy(&pool->timer_lock);
+    pthread_mutex_destroy(&pool->grow_lock);
+#endif /* __unix__  */
+
+    memset(pool, 0, sizeof(threadpool_t));
+}
+
+/*
+ *   Sets up a pool and spawns its workers.
+ *
+ *   @param threadpool_t              *pool      The pool.
+ *   @param const threadpool_config_t *config    The configuration.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+static int _threadpool_start(threadpool_t              *pool,
+                             const threadpool_config_t *config) {
+    unsigned long size    = config->size;
+    unsigned long threads = config->threads;
+    unsigned long max     = config->max_threads;
+    unsigned long i;
+
+    memset(pool, 0, sizeof(threadpool_t));
+
+    _threadpool_topology(pool, config->reserved, config->skip_smt);
+
+    if (threads == 0)
+        threads = pool->cpu_count != 0 ? pool->cpu_count : 1;
+
+    if (max < threads)
+        max = threads;
+
+    pool->elastic     = config->overflow;
+    pool->min_threads = threads;
+    pool->pin         = config->pin;
+    pool->idle_ns  = config->idle_ns != 0 ? config->idle_ns : LIBCHIK_THREADPOOL_IDLE_NS;
+    pool->spawn_ns = config->spawn_ns != 0 ? config->spawn_ns : LIBCHIK_THREADPOOL_SPAWN_NS;
+
+    threadpool_group_init(&pool->all);
+    sync_event_init(&pool->event);
+    sync_event_init(&pool->timer_event);
+
+    snprintf(pool->name, sizeof(pool->name), "%s",
+             config->name != 0 ? config->name : LIBCHIK_THREADPOOL_NAME);
+
+#if __unix__
+    pthread_mutex_init(&pool->timer_lock, 0);
+    pthread_mutex_init(&pool->grow_lock, 0);
+#endif /* __unix__  */
+
+    for (i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+#if __unix__
+        pthread_mutex_init(&pool->classes[i].overflow_lock, 0);
+#endif /* __unix__  */
+        pool->classes[i].queue = aqueue_new(size);
+
+        if (pool->classes[i].queue == 0) {
+            _threadpool_teardown(pool);
+            return -1;
+        }
+    }
+
+    pool->workers = (_threadpool_worker_t *)calloc(max,
+                                                   sizeof(_threadpool_worker_t));
+
+    if (pool->workers == 0) {
+        LOGF_ERR("Failed to allocate memory for threadpool workers\n");
+        _threadpool_teardown(pool);
+        return -1;
+    }
+
+    pool->threads = max;
+
+    /*
+     *    Every slot gets its deque up front, so stealing never has to
+     *    check whether one exists.
+     */
+    for (i = 0; i < max; i++) {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].deque = deque_new(size);
+        sync_backoff_init(&pool->workers[i].backoff);
+
+        if (pool->workers[i].deque == 0) {
+            _threadpool_teardown(pool);
+            return -1;
+        }
+    }
+
+#if __unix__
+    pthread_mutex_lock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+
+    pool->next        = _threadpool_pools;
+    _threadpool_pools = pool;
+
+#if __unix__
+    pthread_mutex_unlock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+
+    pool->span = threads;
+    pool->live = threads;
+
+    for (i = 0; i < threads; i++) {
+        if (_threadpool_spawn(pool, i) != 0) {
+            _threadpool_teardown(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *   Initializes the global threadpool.
+ *
+ *   @param unsigned long size       The size of the threadpool.
+ *   @param unsigned long threads    The number of threads to spawn.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_init(unsigned long size, unsigned long threads) {
+    threadpool_config_t config;
+
+    memset(&config, 0, sizeof(config));
+
+    config.size    = size;
+    config.threads = threads;
+
+    return threadpool_init_config(&config);
+}
+
+/*
+ *   Initializes the global threadpool with placement options.
+ *   Cores are taken from the process' affinity mask in sysfs topology
+ *   order, the first config->reserved of them are left to the caller.
+ *
+ *   @param const threadpool_config_t *config    The configuration.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_init_config(const threadpool_config_t *config) {
+    return _threadpool_start(&_threadpool_default, config);
+}
+
+/*
+ *   Creates a threadpool of its own, next to the global one. Each
+ *   pool has its own workers and queues, so work submitted to one
+ *   never waits behind work submitted to another.
+ *
+ *   @param const threadpool_config_t *config    The configuration.
+ *
+ *   @return threadpool_t*    The pool, or 0 on failure.
+ *                            Should be released with threadpool_free().
+ */
+threadpool_t *threadpool_create(const threadpool_config_t *config) {
+    threadpool_t *pool;
+
+    pool = (threadpool_t *)aligned_alloc(CHIK_CACHE_LINE, sizeof(threadpool_t));
+
+    if (pool == 0) {
+        LOGF_ERR("Failed to allocate memory for threadpool\n");
+        return 0;
+    }
+
+    if (_threadpool_start(pool, config) != 0) {
+        free(pool);
+        return 0;
+    }
+
+    return pool;
+}
+
+/*
+ *   Destroys a threadpool made with threadpool_create(). Queued tasks
+ *   are run, then the workers are joined.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+void threadpool_free(threadpool_t *pool) {
+    if (pool == 0)
+        return;
+
+    _threadpool_teardown(pool);
+    free(pool);
+}
+
+/*
+ *   Returns the global threadpool.
+ *
+ *   @return threadpool_t*    The pool.
+ */
+threadpool_t *threadpool_default(void) { return &_threadpool_default; }
+
+/*
+ *   Returns the pool of the task the calling thread is running, else
+ *   the pool it works for, else the global one. Functions that don't
+ *   take a pool use this one.
+ *
+ *   @return threadpool_t*    The pool.
+ */
+threadpool_t *threadpool_current(void) {
+    if (_threadpool_running != 0)
+        return _threadpool_running;
+
+    if (_threadpool_self != 0)
+        return _threadpool_self->pool;
+
+    return &_threadpool_default;
+}
+
+/*
+ *   Pins the calling thread to one of the cores reserved with
+ *   threadpool_init_config().
+ *
+ *   @param unsigned long index    The index of the reserved core.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_pin_reserved(unsigned long index) {
+    if (index >= _threadpool_default.reserved_count)
+        return -1;
+
+#if __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(_threadpool_default.reserved[index], &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0
+                                                                          : -1;
+#else
+//#error "Unsupported platform"
+    return -1;
+#endif /* __linux__  */
+}
+
+/*
+ *   Destroys the global threadpool. Queued tasks are run, then the
+ *   workers are joined.
+ */
+void threadpool_destroy(void) { _threadpool_teardown(&_threadpool_default); }
+
+/*
+ *   Submits a task to the current threadpool.
+ *   From a worker thread the task goes onto that worker's deque,
+ *   otherwise it goes through the injector queue.
+ *
+ *   @param void *(*fun)(void *)    The function to execute.
+ *   @param void *arg               The argument to pass to the function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit(void *(*fun)(void *), void *arg) {
+    return threadpool_submit_group(0, fun, arg);
+}
+
+/*
+ *   Waits for every task of a group to complete, running queued
+ *   tasks of a pool while the group is busy. On a fiber, the fiber is
+ *   parked instead.
+ *
+ *   @param threadpool_t       *pool     The pool to help.
+ *   @param threadpool_group_t *group    The group to wait for.
+ */
+static void _threadpool_group_wait(threadpool_t       *pool,
+                                   threadpool_group_t *group) {
+    unsigned int pending;
+    int          i;
+
+    if (fiber_current() != 0) {
+        __atomic_fetch_add(&group->waiters, 1, __ATOMIC_SEQ_CST);
+        threadpool_wait_until(_threadpool_group_idle, group);
+        __atomic_fetch_sub(&group->waiters, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    while (1) {
+        for (i = 0; i < LIBCHIK_THREADPOOL_WAIT_SPIN; i++) {
+            if (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) == 0)
+                return;
+
+            if (threadpool_help_pool(pool))
+                i = 0;
+            else
+                sync_pause();
+        }
+
+        __atomic_fetch_add(&group->waiters, 1, __ATOMIC_SEQ_CST);
+
+        /*
+         *    Fibers parked on this worker can only be resumed from
+         *    here, so don't sleep for long while there are any.
+         */
+        pending = __atomic_load_n(&group->pending, __ATOMIC_SEQ_CST);
+        if (pending & THREADPOOL_GROUP_CLOSING)
+            sync_pause();
+        else if (pending != 0 && _threadpool_self != 0 &&
+                 _threadpool_self->parked != 0)
+            sync_futex_wait_timeout(&group->pending, pending,
+                                    LIBCHIK_THREADPOOL_FIBER_POLL_NS);
+        else if (pending != 0)
+            sync_futex_wait(&group->pending, pending);
+
+        __atomic_fetch_sub(&group->waiters, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ *   Waits for all tasks of the current threadpool to complete.
+ *   Must not be called from inside a task.
+ */
+void threadpool_wait(void) { threadpool_wait_pool(threadpool_current()); }
+
+/*
+ *   Waits for all tasks of a threadpool to complete, helping with
+ *   them in the meantime. Must not be called from inside a task of
+ *   that pool.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+void threadpool_wait_pool(threadpool_t *pool) {
+    _threadpool_group_wait(pool, &pool->all);
+}
+
+/*
+ *   Initializes a task group.
+ *
+ *   @param threadpool_group_t *group    The group to initialize.
+ */
+void threadpool_group_init(threadpool_group_t *group) {
+    group->pending = 0;
+    group->waiters = 0;
+}
+
+/*
+ *   Queues tasks of one class on the calling worker's deque or the
+ *   injector of their class, spilling into the overflow list if the
+ *   pool is elastic. The injector slots for the whole batch are
+ *   claimed at once.
+ *
+ *   @param threadpool_t *pool     The pool.
+ *   @param task_t       *tasks    The tasks.
+ *   @param unsigned long count    The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks queued.
+ */
+static unsigned long _threadpool_push_many(threadpool_t *pool, task_t *tasks,
+                                           unsigned long count) {
+    _threadpool_class_t  *class  = &pool->classes[tasks[0].priority];
+    _threadpool_worker_t *worker = _threadpool_worker(pool);
+    unsigned long         first  = 0;
+    unsigned long         n;
+    unsigned long         now;
+    unsigned long         i;
+
+    /*
+     *    Only work of the running task's own class may go onto the
+     *    deque, anything else would be taken out of its class' order.
+     */
+    if (worker != 0 && tasks[0].priority == _threadpool_priority) {
+        while (first < count && deque_push(worker->deque, &tasks[first]) == 0)
+            first++;
+
+        if (first == count)
+            return count;
+    }
+
+    now = sync_now();
+
+    for (i = first; i < count; i++)
+        tasks[i].time = now;
+
+    /*
+     *    Aging counts from the moment a class has work again.
+     */
+    if (__atomic_fetch_add(&class->depth, count - first, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&class->served, now, __ATOMIC_RELAXED);
+
+    n = first;
+
+    if (!pool->elastic || __atomic_load_n(&class->overflow, __ATOMIC_RELAXED) == 0)
+        n += aqueue_add_many(class->queue, tasks + n, count - n);
+
+    if (n < count && pool->elastic &&
+        _threadpool_overflow_push(class, tasks + n, count - n) == 0)
+        n = count;
+
+    if (n < count)
+        __atomic_fetch_sub(&class->depth, count - n, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/*
+ *   Queues a task, see _threadpool_push_many().
+ *
+ *   @param threadpool_t *pool    The pool.
+ *   @param task_t       *task    The task.
+ *
+ *   @return int    0 on success, -1 if there is no room.
+ */
+static int _threadpool_push(threadpool_t *pool, task_t *task) {
+    return _threadpool_push_many(pool, task, 1) == 1 ? 0 : -1;
+}
+
+/*
+ *   Waits for room to queue a task. Running a queued task is what
+ *   makes room, so the submitter does that before it goes to sleep.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *   @param task_t       *task    The task.
+ *   @param unsigned long ns      The timeout in nanoseconds.
+ *
+ *   @return int    0 on success, -1 on timeout.
+ */
+static int _threadpool_push_wait(threadpool_t *pool, task_t *task,
+                                 unsigned long ns) {
+    aqueue_t     *queue    = pool->classes[task->priority].queue;
+    unsigned long deadline = 0;
+    unsigned long now      = sync_now();
+    unsigned int  key;
+
+    if (ns == 0)
+        return -1;
+
+    if (ns != THREADPOOL_FOREVER && now + ns > now)
+        deadline = now + ns;
+
+    do {
+        if (deadline != 0 && (now = sync_now()) >= deadline)
+            return -1;
+
+        if (threadpool_help_pool(pool))
+            continue;
+
+        key = sync_event_prepare(&queue->space);
+
+        if (_threadpool_push(pool, task) == 0) {
+            sync_event_cancel(&queue->space);
+            return 0;
+        }
+
+        if (deadline != 0)
+            sync_event_wait_timeout(&queue->space, key, deadline - now);
+        else
+            sync_event_wait(&queue->space, key);
+    } while (_threadpool_push(pool, task) != 0);
+
+    return 0;
+}
+
+/*
+ *   Submits a task to a threadpool.
+ *
+ *   @param threadpool_t         *pool        The pool.
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *   @param unsigned long         ns          How long to wait for room,
+ *                                            may be THREADPOOL_FOREVER.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+static int _threadpool_submit(threadpool_t *pool, threadpool_group_t *group,
+                              threadpool_priority_e priority,
+                              void *(*fun)(void *), void *arg,
+                              unsigned long ns) {
+    task_t task;
+
+    if ((unsigned int)priority >= THREADPOOL_PRIORITY_COUNT) {
+        LOGF_ERR("Invalid threadpool priority\n");
+        return -1;
+    }
+
+    if (pool->workers == 0) {
+        LOGF_ERR("Threadpool is not running\n");
+        return -1;
+    }
+
+    task.fun      = fun;
+    task.arg      = arg;
+    task.group    = group;
+    task.priority = priority;
+    task.time     = 0;
+    task.flow     = chik_profiler_flow_new();
+
+    if (group != 0)
+        __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&pool->all.pending, 1, __ATOMIC_RELAXED);
+
+    /*
+     *    Someone may already wait on the counts, and be waiting for
+     *    this very task, so they go back down as if it had run.
+     */
+    if (_threadpool_push(pool, &task) != 0 &&
+        _threadpool_push_wait(pool, &task, ns) != 0) {
+        if (group != 0)
+            _threadpool_group_done(group);
+
+        _threadpool_group_done(&pool->all);
+        return -1;
+    }
+
+    chik_profiler_flow_start(task.flow);
+
+    sync_event_notify(&pool->event, 1);
+    _threadpool_check_blocked(pool);
+
+    return 0;
+}
+
+/*
+ *   Submits a batch of tasks to a threadpool, LIBCHIK_THREADPOOL_BATCH
+ *   at a time. Each of those chunks is queued with a single claim and
+ *   wakes as many sleeping workers as it has tasks for.
+ *
+ *   @param threadpool_t            *pool        The pool.
+ *   @param threadpool_group_t      *group       The group, may be 0.
+ *   @param threadpool_priority_e    priority    The priority class.
+ *   @param const threadpool_task_t *tasks       The tasks.
+ *   @param unsigned long            count       The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks submitted, the first
+ *                            ones of the batch.
+ */
+static unsigned long _threadpool_submit_many(threadpool_t         *pool,
+                                             threadpool_group_t   *group,
+                                             threadpool_priority_e priority,
+                                             const threadpool_task_t *tasks,
+                                             unsigned long            count) {
+    task_t        batch[LIBCHIK_THREADPOOL_BATCH];
+    unsigned long done = 0;
+    unsigned long live;
+    unsigned long queued;
+    unsigned long n;
+    unsigned long i;
+
+    if (count == 0)
+        return 0;
+
+    if ((unsigned int)priority >= THREADPOOL_PRIORITY_COUNT) {
+        LOGF_ERR("Invalid threadpool priority\n");
+        return 0;
+    }
+
+    if (pool->workers == 0) {
+        LOGF_ERR("Threadpool is not running\n");
+        return 0;
+    }
+
+    if (group != 0)
+        __atomic_fetch_add(&group->pending, count, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&pool->all.pending, count, __ATOMIC_RELAXED);
+
+    while (done < count) {
+        n = count - done;
+        if (n > LIBCHIK_THREADPOOL_BATCH)
+            n = LIBCHIK_THREADPOOL_BATCH;
+
+        for (i = 0; i < n; i++) {
+            batch[i].fun      = tasks[done + i].fun;
+            batch[i].arg      = tasks[done + i].arg;
+            batch[i].group    = group;
+            batch[i].priority = priority;
+            batch[i].time     = 0;
+            batch[i].flow     = chik_profiler_flow_new();
+        }
+
+        queued = _threadpool_push_many(pool, batch, n);
+        done  += queued;
+
+        for (i = 0; i < queued; i++)
+            chik_profiler_flow_start(batch[i].flow);
+
+        live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+
+        if (queued != 0)
+            sync_event_notify(&pool->event, queued < live ? (int)queued : (int)live);
+
+        if (queued < n)
+            break;
+    }
+
+    if (done < count) {
+        if (group != 0)
+            _threadpool_group_done_many(group, (unsigned int)(count - done));
+
+        _threadpool_group_done_many(&pool->all, (unsigned int)(count - done));
+    }
+
+    _threadpool_check_blocked(pool);
+
+    return done;
+}
+
+/*
+ *   Submits a task to the current threadpool as part of a group.
+ *
+ *   @param threadpool_group_t *group       The group, may be 0.
+ *   @param void *(*fun)(void *)            The function to execute.
+ *   @param void *arg                       The argument to pass to the
+ *                                          function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_group(threadpool_group_t *group, void *(*fun)(void *),
+                            void *arg) {
+    return threadpool_submit_priority(
+        group, (threadpool_priority_e)_threadpool_priority, fun, arg);
+}
+
+/*
+ *   Submits a task to the current threadpool with a priority class.
+ *   Workers always take the most urgent work first, except that a
+ *   class that has waited for LIBCHIK_THREADPOOL_AGING_NS gets one
+ *   task ahead, so background work keeps moving. Tasks submitted
+ *   without a priority inherit the one of the task submitting them,
+ *   or are THREADPOOL_PRIORITY_NORMAL outside the pool.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_priority(threadpool_group_t   *group,
+                               threadpool_priority_e priority,
+                               void *(*fun)(void *), void *arg) {
+    return _threadpool_submit(threadpool_current(), group, priority, fun, arg,
+                              0);
+}
+
+/*
+ *   Submits a task to a threadpool. From a worker of another pool it
+ *   goes through the injector queue of its class like from any other
+ *   thread outside the pool.
+ *
+ *   @param threadpool_t         *pool        The pool.
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_to(threadpool_t *pool, threadpool_group_t *group,
+                         threadpool_priority_e priority, void *(*fun)(void *),
+                         void *arg) {
+    return _threadpool_submit(pool, group, priority, fun, arg, 0);
+}
+
+/*
+ *   Submits a batch of tasks to the current threadpool. Queueing them
+ *   together costs a fraction of submitting them one by one. Stops at
+ *   the first task there is no room for.
+ *
+ *   @param threadpool_group_t      *group    The group, may be 0.
+ *   @param const threadpool_task_t *tasks    The tasks.
+ *   @param unsigned long            count    The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks submitted, the first
+ *                            ones of the batch.
+ */
+unsigned long threadpool_submit_batch(threadpool_group_t      *group,
+                                      const threadpool_task_t *tasks,
+                                      unsigned long            count) {
+    return _threadpool_submit_many(threadpool_current(), group,
+                                   (threadpool_priority_e)_threadpool_priority,
+                                   tasks, count);
+}
+
+/*
+ *   Submits a batch of tasks to a threadpool with a priority class.
+ *   Stops at the first task there is no room for.
+ *
+ *   @param threadpool_t            *pool        The pool.
+ *   @param threadpool_group_t      *group       The group, may be 0.
+ *   @param threadpool_priority_e    priority    The priority class.
+ *   @param const threadpool_task_t *tasks       The tasks.
+ *   @param unsigned long            count       The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks submitted, the first
+ *                            ones of the batch.
+ */
+unsigned long threadpool_submit_batch_to(threadpool_t            *pool,
+                                         threadpool_group_t      *group,
+                                         threadpool_priority_e    priority,
+                                         const threadpool_task_t *tasks,
+                                         unsigned long            count) {
+    return _threadpool_submit_many(pool, group, priority, tasks, count);
+}
+
+/*
+ *   Submits a task to the current threadpool, waiting for room if the
+ *   queue of its class is full. While it waits the calling thread runs
+ *   queued tasks, which is what makes room.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_wait(threadpool_group_t   *group,
+                           threadpool_priority_e priority,
+                           void *(*fun)(void *), void *arg) {
+    return _threadpool_submit(threadpool_current(), group, priority, fun, arg,
+                              THREADPOOL_FOREVER);
+}
+
+/*
+ *   Submits a task to the current threadpool, waiting at most ns
+ *   nanoseconds for room if the queue of its class is full.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *   @param unsigned long         ns          The timeout in nanoseconds.
+ *
+ *   @return int    0 on success, -1 on timeout or failure.
+ */
+int threadpool_submit_timeout(threadpool_group_t   *group,
+                              threadpool_priority_e priority,
+                              void *(*fun)(void *), void *arg,
+                              unsigned long ns) {
+    return _threadpool_submit(threadpool_current(), group, priority, fun, arg,
+                              ns);
+}
+
+/*
+ *   Converts a sync_now() time into a tick of a pool's timer wheel,
+ *   rounding down.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *   @param unsigned long ns      The time.
+ *
+ *   @return unsigned long    The tick.
+ */
+static unsigned long _threadpool_timer_tick(threadpool_t *pool,
+                                            unsigned long ns) {
+    if (ns < pool->timer_base)
+        return 0;
+
+    return (ns - pool->timer_base) / LIBCHIK_THREADPOOL_TIMER_TICK_NS;
+}
+
+#if __unix__
+/*
+ *   Serves the timers of a pool. Due timers are taken out of the
+ *   wheel under the lock and submitted after it is dropped, sorted by
+ *   priority into batches. Tasks that find their queue full are kept
+ *   for the next tick. When nothing is due the thread sleeps until the
+ *   wheel has work again or a timer that is due sooner is started.
+ *
+ *   @param void *arg    The pool.
+ *
+ *   @return void *    Unused.
+ */
+static void *_threadpool_timer_thread(void *arg) {
+    threadpool_t       *pool = (threadpool_t *)arg;
+    threadpool_timer_t *timer;
+    timer_node_t       *node;
+    threadpool_task_t   tasks[THREADPOOL_PRIORITY_COUNT][LIBCHIK_THREADPOOL_BATCH];
+    unsigned long       counts[THREADPOOL_PRIORITY_COUNT];
+    unsigned long       now;
+    unsigned long       next;
+    unsigned long       deadline;
+    unsigned long       done;
+    unsigned long       n;
+    unsigned int        key;
+    int                 p;
+
+    memset(counts, 0, sizeof(counts));
+    n = 0;
+
+    pthread_mutex_lock(&pool->timer_lock);
+
+    while (__atomic_load_n(&pool->timer_stop, __ATOMIC_ACQUIRE) == 0) {
+        now = _threadpool_timer_tick(pool, sync_now());
+
+        while (n < LIBCHIK_THREADPOOL_BATCH &&
+               (node = timer_wheel_expire(pool->timers, now)) != 0) {
+            timer = (threadpool_timer_t *)node;
+            p     = (int)timer->priority;
+
+            tasks[p][counts[p]].fun = timer->fun;
+            tasks[p][counts[p]].arg = timer->arg;
+            counts[p]++;
+            n++;
+
+            /*
+             *    A periodic timer that fell behind skips the periods it
+             *    missed rather than firing once for each of them.
+             */
+            if (timer->period != 0) {
+                next = node->expires + timer->period;
+
+                if (next <= now)
+                    next += ((now - next) / timer->period + 1) * timer->period;
+
+                timer_wheel_add(pool->timers, node, next);
+            } else if (timer->owned) {
+                free(timer);
+            }
+        }
+
+        if (n != 0) {
+            pthread_mutex_unlock(&pool->timer_lock);
+
+            /*
+             *    Waiting for room here would stall every other timer,
+             *    and helping would run tasks on this thread, so what
+             *    doesn't fit is kept and tried again next tick.
+             */
+            n = 0;
+
+            for (p = 0; p < THREADPOOL_PRIORITY_COUNT; p++) {
+                done = _threadpool_submit_many(pool, 0, (threadpool_priority_e)p,
+                                               tasks[p], counts[p]);
+
+                counts[p] -= done;
+                n         += counts[p];
+
+                memmove(tasks[p], tasks[p] + done,
+                        counts[p] * sizeof(threadpool_task_t));
+            }
+
+            pthread_mutex_lock(&pool->timer_lock);
+
+            if (n == 0)
+                continue;
+        }
+
+        next = timer_wheel_next(pool->timers);
+        if (n != 0 && next > now + 1)
+            next = now + 1;
+
+        pool->timer_wake = next;
+        key              = sync_event_prepare(&pool->timer_event);
+
+        pthread_mutex_unlock(&pool->timer_lock);
+
+        if (next == CHIK_TIMER_NEVER) {
+            sync_event_wait(&pool->timer_event, key);
+        } else {
+            deadline = pool->timer_base + next * LIBCHIK_THREADPOOL_TIMER_TICK_NS;
+            now      = sync_now();
+
+            if (deadline > now)
+                sync_event_wait_timeout(&pool->timer_event, key, deadline - now);
+            else
+                sync_event_cancel(&pool->timer_event);
+        }
+
+        pthread_mutex_lock(&pool->timer_lock);
+    }
+
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    return 0;
+}
+#endif /* __unix__  */
+
+/*
+ *   Creates the timer wheel and thread of a pool, the first time a
+ *   timer is started on it. Called with the timer lock held.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+static int _threadpool_timers_start(threadpool_t *pool) {
+    if (pool->timers != 0)
+        return 0;
+
+    pool->timers = (timer_wheel_t *)malloc(sizeof(timer_wheel_t));
+
+    if (pool->timers == 0) {
+        LOGF_ERR("Failed to allocate timer wheel\n");
+        return -1;
+    }
+
+    pool->timer_base = sync_now();
+    pool->timer_wake = CHIK_TIMER_NEVER;
+
+    timer_wheel_init(pool->timers, 0);
+
+#if __unix__
+    if (pthread_create(&pool->timer_thread, 0, _threadpool_timer_thread, pool) !=
+        0) {
+        LOGF_ERR("Failed to create timer thread\n");
+        free(pool->timers);
+        pool->timers = 0;
+        return -1;
+    }
+
+#if __linux__
+    char name[16];
+
+    snprintf(name, sizeof(name), "%.9s-timer", pool->name);
+    pthread_setname_np(pool->timer_thread, name);
+#endif /* __linux__  */
+#else
+//#error "Unsupported platform"
+#endif /* __unix__  */
+
+    return 0;
+}
+
+/*
+ *   Initializes a timer, which is not pending until started.
+ *
+ *   @param threadpool_timer_t *timer    The timer to initialize.
+ */
+void threadpool_timer_init(threadpool_timer_t *timer) {
+    memset(timer, 0, sizeof(threadpool_timer_t));
+    timer_node_init(&timer->node);
+}
+
+/*
+ *   Starts a timer on the current threadpool, which submits a task
+ *   once delay_ns have passed, and then every period_ns if that isn't
+ *   0. The task runs with the priority of the calling task.
+ *
+ *   @param threadpool_timer_t *timer        The timer, must not be pending.
+ *   @param unsigned long       delay_ns     The delay in nanoseconds.
+ *   @param unsigned long       period_ns    The period in nanoseconds,
+ *                                           0 for a one-shot.
+ *   @param void *(*fun)(void *)             The function to execute.
+ *   @param void *arg                        The argument to pass to the
+ *                                           function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_timer_start(threadpool_timer_t *timer, unsigned long delay_ns,
+                           unsigned long period_ns, void *(*fun)(void *),
+                           void *arg) {
+    return threadpool_timer_start_to(threadpool_current(), timer,
+                                     (threadpool_priority_e)_threadpool_priority,
+                                     delay_ns, period_ns, fun, arg);
+}
+
+/*
+ *   Starts a timer on a threadpool.
+ *
+ *   @param threadpool_t         *pool         The pool.
+ *   @param threadpool_timer_t   *timer        The timer, must not be pending.
+ *   @param threadpool_priority_e priority     The priority class.
+ *   @param unsigned long         delay_ns     The delay in nanoseconds.
+ *   @param unsigned long         period_ns    The period in nanoseconds,
+ *                                             0 for a one-shot.
+ *   @param void *(*fun)(void *)               The function to execute.
+ *   @param void *arg                          The argument to pass to the
+ *                                             function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_timer_start_to(threadpool_t *pool, threadpool_timer_t *timer,
+                              threadpool_priority_e priority,
+                              unsigned long delay_ns, unsigned long period_ns,
+                              void *(*fun)(void *), void *arg) {
+    unsigned long due;
+    unsigned long expires;
+    int           wake = 0;
+
+    if ((unsigned int)priority >= THREADPOOL_PRIORITY_COUNT) {
+        LOGF_ERR("Invalid threadpool priority\n");
+        return -1;
+    }
+
+    if (pool->workers == 0) {
+        LOGF_ERR("Threadpool is not running\n");
+        return -1;
+    }
+
+#if __unix__
+    pthread_mutex_lock(&pool->timer_lock);
+#endif /* __unix__  */
+
+    if (timer_node_pending(&timer->node)) {
+#if __unix__
+        pthread_mutex_unlock(&pool->timer_lock);
+#endif /* __unix__  */
+        LOGF_ERR("Timer is already pending\n");
+        return -1;
+    }
+
+    if (_threadpool_timers_start(pool) != 0) {
+#if __unix__
+        pthread_mutex_unlock(&pool->timer_lock);
+#endif /* __unix__  */
+        return -1;
+    }
+
+    timer->pool     = pool;
+    timer->fun      = fun;
+    timer->arg      = arg;
+    timer->priority = priority;
+
+    /*
+     *    Round up, so a timer never fires before its delay is over.
+     */
+    timer->period = (period_ns + LIBCHIK_THREADPOOL_TIMER_TICK_NS - 1) /
+                    LIBCHIK_THREADPOOL_TIMER_TICK_NS;
+    due = sync_now() - pool->timer_base;
+
+    if (delay_ns > CHIK_TIMER_NEVER / 2 - due)
+        delay_ns = CHIK_TIMER_NEVER / 2 - due;
+
+    expires = (due + delay_ns + LIBCHIK_THREADPOOL_TIMER_TICK_NS - 1) /
+              LIBCHIK_THREADPOOL_TIMER_TICK_NS;
+
+    timer_wheel_add(pool->timers, &timer->node, expires);
+
+    if (expires < pool->timer_wake) {
+        pool->timer_wake = expires;
+        wake             = 1;
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&pool->timer_lock);
+#endif /* __unix__  */
+
+    if (wake)
+        sync_event_notify(&pool->timer_event, 1);
+
+    return 0;
+}
+
+/*
+ *   Cancels a timer. A task the timer has already submitted still runs,
+ *   but a periodic timer won't submit another one.
+ *
+ *   @param threadpool_timer_t *timer    The timer.
+ *
+ *   @return int    1 if the timer was pending, 0 otherwise.
+ */
+int threadpool_timer_cancel(threadpool_timer_t *timer) {
+    threadpool_t *pool = timer->pool;
+    int           ret;
+
+    if (pool == 0)
+        return 0;
+
+#if __unix__
+    pthread_mutex_lock(&pool->timer_lock);
+#endif /* __unix__  */
+    ret = timer_wheel_remove(pool->timers, &timer->node) == 0;
+#if __unix__
+    pthread_mutex_unlock(&pool->timer_lock);
+#endif /* __unix__  */
+
+    return ret;
+}
+
+/*
+ *   Submits a task to the current threadpool once delay_ns have passed.
+ *   The timer is allocated and freed by the pool, so the task can't be
+ *   cancelled.
+ *
+ *   @param unsigned long delay_ns    The delay in nanoseconds.
+ *   @param void *(*fun)(void *)      The function to execute.
+ *   @param void *arg                 The argument to pass to the function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_after(unsigned long delay_ns, void *(*fun)(void *),
+                            void *arg) {
+    threadpool_timer_t *timer;
+
+    timer = (threadpool_timer_t *)malloc(sizeof(threadpool_timer_t));
+
+    if (timer == 0) {
+        LOGF_ERR("Failed to allocate timer\n");
+        return -1;
+    }
+
+    threadpool_timer_init(timer);
+    timer->owned = 1;
+
+    if (threadpool_timer_start(timer, delay_ns, 0, fun, arg) != 0) {
+        free(timer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *   Reads the queue statistics of a priority class of the current
+ *   threadpool.
+ *
+ *   @param threadpool_priority_e        priority    The priority class.
+ *   @param threadpool_priority_stats_t *stats       Where to store them.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_priority_stats(threadpool_priority_e        priority,
+                              threadpool_priority_stats_t *stats) {
+    return threadpool_priority_stats_pool(threadpool_current(), priority, stats);
+}
+
+/*
+ *   Reads the queue statistics of a priority class of a threadpool.
+ *
+ *   @param threadpool_t                *pool        The pool.
+ *   @param threadpool_priority_e        priority    The priority class.
+ *   @param threadpool_priority_stats_t *stats       Where to store them.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_priority_stats_pool(threadpool_t                *pool,
+                                   threadpool_priority_e        priority,
+                                   threadpool_priority_stats_t *stats) {
+    threadpool_priority_stats_t *from;
+    unsigned long                max;
+    int                          i;
+
+    if ((unsigned int)priority >= THREADPOOL_PRIORITY_COUNT || stats == 0)
+        return -1;
+
+    stats->depth      = __atomic_load_n(&pool->classes[priority].depth,
+                                        __ATOMIC_RELAXED);
+    stats->run        = 0;
+    stats->queued     = 0;
+    stats->wait_total = 0;
+    stats->wait_max   = 0;
+
+    for (i = -1; i < pool->threads; i++) {
+        from = i < 0 ? &pool->outside[priority] : &pool->workers[i].stats[priority];
+
+        stats->run        += __atomic_load_n(&from->run, __ATOMIC_RELAXED);
+        stats->queued     += __atomic_load_n(&from->queued, __ATOMIC_RELAXED);
+        stats->wait_total += __atomic_load_n(&from->wait_total, __ATOMIC_RELAXED);
+
+        max = __atomic_load_n(&from->wait_max, __ATOMIC_RELAXED);
+        if (max > stats->wait_max)
+            stats->wait_max = max;
+    }
+
+    return 0;
+}
+
+/*
+ *   Adds a histogram to another one.
+ *
+ *   @param threadpool_histogram_t       *to      The sum.
+ *   @param const threadpool_histogram_t *from    The histogram to add.
+ */
+static void _threadpool_hist_merge(threadpool_histogram_t       *to,
+                                   const threadpool_histogram_t *from) {
+    unsigned long count;
+    unsigned long max;
+    int           i;
+
+    for (i = 0; i < LIBCHIK_THREADPOOL_HIST_BUCKETS; i++) {
+        count           = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+        to->buckets[i] += count;
+        to->count      += count;
+    }
+
+    to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > to->max)
+        to->max = max;
+}
+
+/*
+ *   Adds the counters of a worker to a sum.
+ *
+ *   @param threadpool_worker_stats_t       *to      The sum.
+ *   @param const threadpool_worker_stats_t *from    The counters to add.
+ */
+static void _threadpool_stats_add(threadpool_worker_stats_t       *to,
+                                  const threadpool_worker_stats_t *from) {
+    to->tasks         += __atomic_load_n(&from->tasks, __ATOMIC_RELAXED);
+    to->local         += __atomic_load_n(&from->local, __ATOMIC_RELAXED);
+    to->injected      += __atomic_load_n(&from->injected, __ATOMIC_RELAXED);
+    to->steals        += __atomic_load_n(&from->steals, __ATOMIC_RELAXED);
+    to->steal_misses  += __atomic_load_n(&from->steal_misses, __ATOMIC_RELAXED);
+    to->sleeps        += __atomic_load_n(&from->sleeps, __ATOMIC_RELAXED);
+    to->idle          += __atomic_load_n(&from->idle, __ATOMIC_RELAXED);
+    to->uptime        += __atomic_load_n(&from->uptime, __ATOMIC_RELAXED);
+    to->queue_retries += __atomic_load_n(&from->queue_retries, __ATOMIC_RELAXED);
+    to->queue_full    += __atomic_load_n(&from->queue_full, __ATOMIC_RELAXED);
+    to->queue_empty   += __atomic_load_n(&from->queue_empty, __ATOMIC_RELAXED);
+
+    _threadpool_hist_merge(&to->depth, &from->depth);
+    _threadpool_hist_merge(&to->wait, &from->wait);
+    _threadpool_hist_merge(&to->run, &from->run);
+}
+
+/*
+ *   Reads the counters of one worker of a threadpool.
+ *
+ *   @param threadpool_t              *pool     The pool.
+ *   @param unsigned long              index    The worker.
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if there is no such worker.
+ */
+int threadpool_worker_stats_pool(threadpool_t *pool, unsigned long index,
+                                 threadpool_worker_stats_t *stats) {
+    _threadpool_worker_t *worker;
+    unsigned long         now;
+    unsigned long         born;
+    unsigned long         died;
+    unsigned long         since;
+    int                   i;
+
+    if (pool->workers == 0 || index >= (unsigned long)pool->threads ||
+        stats == 0)
+        return -1;
+
+    worker = &pool->workers[index];
+    now    = sync_now();
+
+    memset(stats, 0, sizeof(threadpool_worker_stats_t));
+    _threadpool_stats_add(stats, &worker->counters);
+
+    for (i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        stats->tasks += __atomic_load_n(&worker->stats[i].run, __ATOMIC_RELAXED);
+        stats->injected +=
+            __atomic_load_n(&worker->stats[i].queued, __ATOMIC_RELAXED);
+    }
+
+    /*
+     *    Popping the deque is the hot path, so it isn't counted; every
+     *    task that wasn't taken from elsewhere came from there.
+     */
+    if (stats->tasks > stats->injected + stats->steals)
+        stats->local = stats->tasks - stats->injected - stats->steals;
+
+    born = __atomic_load_n(&worker->born, __ATOMIC_ACQUIRE);
+    died = __atomic_load_n(&worker->died, __ATOMIC_ACQUIRE);
+
+    if (born != 0)
+        stats->uptime = (died != 0 ? died : now) - born;
+
+    /*
+     *    Count the idle stretch the worker is in right now.
+     */
+    since = __atomic_load_n(&worker->idle_since, __ATOMIC_RELAXED);
+    if (since != 0 && now > since)
+        stats->idle += now - since;
+
+    if (stats->idle > stats->uptime)
+        stats->idle = stats->uptime;
+
+    stats->queue_retries =
+        __atomic_load_n(&worker->queue.retries, __ATOMIC_RELAXED);
+    stats->queue_full  = __atomic_load_n(&worker->queue.full, __ATOMIC_RELAXED);
+    stats->queue_empty = __atomic_load_n(&worker->queue.empty, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ *   Reads the counters of every worker of a threadpool, summed up.
+ *
+ *   @param threadpool_t              *pool     The pool.
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if the pool isn't running.
+ */
+int threadpool_stats_pool(threadpool_t *pool, threadpool_worker_stats_t *stats) {
+    threadpool_worker_stats_t worker;
+    unsigned long             i;
+
+    if (pool->workers == 0 || stats == 0)
+        return -1;
+
+    memset(stats, 0, sizeof(threadpool_worker_stats_t));
+
+    for (i = 0; i < (unsigned long)pool->threads; i++) {
+        if (threadpool_worker_stats_pool(pool, i, &worker) == 0)
+            _threadpool_stats_add(stats, &worker);
+    }
+
+    return 0;
+}
+
+/*
+ *   Reads the counters of every worker of the current threadpool,
+ *   summed up.
+ *
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if the pool isn't running.
+ */
+int threadpool_stats(threadpool_worker_stats_t *stats) {
+    return threadpool_stats_pool(threadpool_current(), stats);
+}
+
+/*
+ *   Estimates a percentile of a histogram.
+ *
+ *   @param const threadpool_histogram_t *hist        The histogram.
+ *   @param double                        fraction    The percentile, 0 to 1.
+ *
+ *   @return unsigned long    The upper bound of the bucket the
+ *                            percentile falls into.
+ */
+unsigned long threadpool_histogram_percentile(const threadpool_histogram_t *hist,
+                                              double fraction) {
+    unsigned long target;
+    unsigned long seen = 0;
+    unsigned long upper;
+    int           i;
+
+    if (hist->count == 0)
+        return 0;
+
+    target = (unsigned long)(fraction * (double)hist->count + 0.5);
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < LIBCHIK_THREADPOOL_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+
+        if (seen >= target) {
+            upper = (2UL << i) - 1;
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+/*
+ *   Prints a line for a histogram.
+ *
+ *   @param const char                   *name    The name of the histogram.
+ *   @param const threadpool_histogram_t *hist    The histogram.
+ */
+static void _threadpool_shell_hist(const char                   *name,
+                                   const threadpool_histogram_t *hist) {
+    log_msg("\t\t%-6s n %lu, mean %lu, p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+            name, hist->count, hist->count != 0 ? hist->total / hist->count : 0,
+            threadpool_histogram_percentile(hist, 0.5),
+            threadpool_histogram_percentile(hist, 0.9),
+            threadpool_histogram_percentile(hist, 0.99), hist->max);
+}
+
+/*
+ *   The "threadpool" shell command, which prints the counters of the
+ *   default threadpool and each of its workers.
+ *
+ *   @param int    argc    The argument count.
+ *   @param char **argv    The arguments.
+ */
+void threadpool_shell_stats(int argc, char **argv) {
+    threadpool_t             *pool = threadpool_default();
+    threadpool_worker_stats_t stats;
+    unsigned long             i;
+
+    (void)argc;
+    (void)argv;
+
+    if (threadpool_stats_pool(pool, &stats) != 0) {
+        log_msg("\n\t* The threadpool is not running.\n");
+        return;
+    }
+
+    log_msg("\n\t* Threadpool, %u of %d workers, %.1f%% idle:\n\n",
+            __atomic_load_n(&pool->live, __ATOMIC_RELAXED), pool->threads,
+            stats.uptime != 0 ? 100.0 * stats.idle / stats.uptime : 0.0);
+    log_msg("\t\t- tasks %lu: %lu local, %lu injected, %lu stolen\n",
+            stats.tasks, stats.local, stats.injected, stats.steals);
+    log_msg("\t\t- %lu steal misses, %lu sleeps\n", stats.steal_misses,
+            stats.sleeps);
+    log_msg("\t\t- injector: %lu retries, %lu full, %lu empty\n",
+            stats.queue_retries, stats.queue_full, stats.queue_empty);
+
+    log_msg("\n\t* Histograms, in ns and tasks, run is sampled 1 in %d:\n\n",
+            LIBCHIK_THREADPOOL_RUN_SAMPLE);
+    _threadpool_shell_hist("wait", &stats.wait);
+    _threadpool_shell_hist("run", &stats.run);
+    _threadpool_shell_hist("depth", &stats.depth);
+
+    log_msg("\n\t* Workers:\n\n");
+    for (i = 0; i < (unsigned long)pool->threads; i++) {
+        if (threadpool_worker_stats_pool(pool, i, &stats) != 0 ||
+            stats.uptime == 0)
+            continue;
+
+        log_msg("\t\t- %lu: %lu tasks, %.1f%% idle, %lu stolen, %lu sleeps\n",
+                i, stats.tasks,
+                stats.uptime != 0 ? 100.0 * stats.idle / stats.uptime : 0.0,
+                stats.steals, stats.sleeps);
+    }
+}
+
+/*
+ *   Waits for every task of a group to complete. While the group is
+ *   busy the calling thread runs queued tasks itself, and only sleeps
+ *   once there is nothing left to help with. On a fiber, the fiber is
+ *   parked instead.
+ *
+ *   @param threadpool_group_t *group    The group to wait for.
+ */
+void threadpool_group_wait(threadpool_group_t *group) {
+    _threadpool_group_wait(threadpool_current(), group);
+}
+
+/*
+ *   Waits for every task of a group to complete, running queued tasks
+ *   of a threadpool while the group is busy.
+ *
+ *   @param threadpool_t       *pool     The pool to help.
+ *   @param threadpool_group_t *group    The group to wait for.
+ */
+void threadpool_group_wait_pool(threadpool_t *pool, threadpool_group_t *group) {
+    _threadpool_group_wait(pool, group);
+}
+
+/*
+ *   Runs one queued task of the current threadpool on the calling
+ *   thread, if there is one.
+ *
+ *   @return int    1 if a task was run, 0 otherwise.
+ */
+int threadpool_help(void) { return threadpool_help_pool(threadpool_current()); }
+
+/*
+ *   Runs one queued task of a threadpool on the calling thread, if
+ *   there is one. A worker resumes its own ready fibers first.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    1 if a task was run, 0 otherwise.
+ */
+int threadpool_help_pool(threadpool_t *pool) {
+    task_t task;
+
+    if (_threadpool_self != 0 && _threadpool_self->parked != 0 &&
+        _threadpool_poll(_threadpool_self))
+        return 1;
+
+    if (pool->workers == 0 ||
+        _threadpool_find(pool, _threadpool_worker(pool), &task) != 0)
+        return 0;
+
+    _threadpool_run(pool, &task);
+
+    return 1;
+}
+
+/*
+ *   Claims the next chunk of a range. The cursor never moves past the
+ *   end, adding to it blindly could wrap around for ranges that end
+ *   near ULONG_MAX.
+ *
+ *   @param _threadpool_range_t *range    The range.
+ *   @param unsigned long       *begin    Where to store the chunk's first index.
+ *   @param unsigned long       *end      Where to store one past its last.
+ *
+ *   @return int    1 if a chunk was claimed, 0 if none are left.
+ */
+static int _threadpool_range_claim(_threadpool_range_t *range,
+                                   unsigned long *begin, unsigned long *end) {
+    *begin = __atomic_load_n(&range->next, __ATOMIC_RELAXED);
+
+    do {
+        if (*begin >= range->end)
+            return 0;
+
+        *end = range->end - *begin > range->grain ? *begin + range->grain
+                                                  : range->end;
+    } while (!__atomic_compare_exchange_n(&range->next, begin, *end, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+/*
+ *   Runs chunks of a range until none are left. Every participant,
+ *   including the submitting thread, claims chunks from a shared
+ *   cursor, so faster threads simply end up taking more of them.
+ *
+ *   @param void *arg    The _threadpool_range_t being processed.
+ *
+ *   @return void*    Always 0.
+ */
+static void *_threadpool_range_task(void *arg) {
+    _threadpool_range_t *range = (_threadpool_range_t *)arg;
+    unsigned long        begin;
+    unsigned long        end;
+    char                *acc = 0;
+
+    while (_threadpool_range_claim(range, &begin, &end)) {
+        if (range->reduce == 0) {
+            range->fun(begin, end, range->ctx);
+            continue;
+        }
+
+        /*
+         *    Only participants that actually get a chunk claim an
+         *    accumulator, so late helpers cost nothing to combine.
+         */
+        if (acc == 0) {
+            acc = range->accs +
+                  __atomic_fetch_add(&range->slots, 1, __ATOMIC_RELAXED) *
+                      range->stride;
+            memcpy(acc, range->identity, range->size);
+        }
+
+        range->reduce(begin, end, acc, range->ctx);
+    }
+
+    return 0;
+}
+
+/*
+ *   Returns how many workers of the current threadpool are running,
+ *   which never exceeds its number of worker slots.
+ *
+ *   @return unsigned long    The number of workers.
+ */
+static unsigned long _threadpool_width(void) {
+    unsigned long live =
+        __atomic_load_n(&threadpool_current()->live, __ATOMIC_RELAXED);
+
+    return live != 0 ? live : 1;
+}
+
+/*
+ *   Splits a range into chunks, runs them on the pool and on the
+ *   calling thread, and waits for them to finish.
+ *
+ *   @param _threadpool_range_t *range    The range to process.
+ *   @param unsigned long        begin    The first index.
+ */
+static void _threadpool_range_run(_threadpool_range_t *range,
+                                  unsigned long        begin) {
+    threadpool_group_t group;
+    threadpool_task_t  tasks[LIBCHIK_THREADPOOL_BATCH];
+    unsigned long      count = range->end - begin;
+    unsigned long      chunks;
+    unsigned long      helpers;
+    unsigned long      done;
+    unsigned long      n;
+    unsigned long      i;
+
+    chunks  = count / range->grain + (count % range->grain != 0);
+    helpers = chunks - 1;
+
+    if (helpers > _threadpool_width())
+        helpers = _threadpool_width();
+
+    range->next = begin;
+
+    threadpool_group_init(&group);
+
+    for (i = 0; i < LIBCHIK_THREADPOOL_BATCH; i++) {
+        tasks[i].fun = _threadpool_range_task;
+        tasks[i].arg = range;
+    }
+
+    /*
+     *    Helpers are all alike, so the same batch is submitted until
+     *    there are enough of them or the queue is full.
+     */
+    for (i = 0; i < helpers; i += n) {
+        n = helpers - i;
+        if (n > LIBCHIK_THREADPOOL_BATCH)
+            n = LIBCHIK_THREADPOOL_BATCH;
+
+        done = threadpool_submit_batch(&group, tasks, n);
+        if (done < n)
+            break;
+    }
+
+    _threadpool_range_task(range);
+
+    threadpool_group_wait(&group);
+}
+
+/*
+ *   Picks a grain size for a range.
+ *
+ *   @param unsigned long count    The number of indices.
+ *   @param unsigned long grain    The requested grain size, or 0.
+ *
+ *   @return unsigned long    The grain size to use.
+ */
+static unsigned long _threadpool_grain(unsigned long count, unsigned long grain) {
+    if (grain != 0)
+        return grain < count ? grain : count;
+
+    /*
+     *    A few chunks per participant is enough to absorb uneven
+     *    chunk costs without paying for many tiny ones.
+     */
+    grain = count / ((_threadpool_width() + 1) *
+                     LIBCHIK_THREADPOOL_CHUNKS_PER_THREAD);
+
+    return grain == 0 ? 1 : grain;
+}
+
+/*
+ *   Runs fun over [begin, end) in parallel, in chunks of at most
+ *   grain indices. The calling thread takes part and returns once
+ *   every chunk has been processed.
+ *
+ *   @param unsigned long begin    The first index.
+ *   @param unsigned long end      One past the last index.
+ *   @param unsigned long grain    The chunk size, or 0 to pick one.
+ *   @param void (*fun)(unsigned long, unsigned long, void *)
+ *                                 The function to run on each chunk.
+ *   @param void *ctx              The context to pass to the function.
+ */
+void threadpool_parallel_for(unsigned long begin, unsigned long end,
+                             unsigned long grain,
+                             void (*fun)(unsigned long, unsigned long, void *),
+                             void *ctx) {
+    _threadpool_range_t range;
+
+    if (end <= begin)
+        return;
+
+    range.end    = end;
+    range.grain  = _threadpool_grain(end - begin, grain);
+    range.fun    = fun;
+    range.reduce = 0;
+    range.ctx    = ctx;
+
+    _threadpool_range_run(&range, begin);
+}
+
+/*
+ *   Reduces [begin, end) in parallel. Each participating thread
+ *   starts from a copy of identity and folds its chunks into it with
+ *   fun, then the partial results are merged into result with combine.
+ *
+ *   @param unsigned long begin    The first index.
+ *   @param unsigned long end      One past the last index.
+ *   @param unsigned long grain    The chunk size, or 0 to pick one.
+ *   @param void (*fun)(unsigned long, unsigned long, void *, void *)
+ *                                 Folds a chunk into an accumulator.
+ *   @param void (*combine)(void *, const void *, void *)
+ *                                 Merges the second accumulator into the
+ *                                 first.
+ *   @param const void *identity   The initial accumulator value.
+ *   @param void *result           Where to store the result.
+ *   @param unsigned long size     The size of an accumulator in bytes.
+ *   @param void *ctx              The context to pass to the functions.
+ */
+void threadpool_parallel_reduce(
+    unsigned long begin, unsigned long end, unsigned long grain,
+    void (*fun)(unsigned long, unsigned long, void *, void *),
+    void (*combine)(void *, const void *, void *), const void *identity,
+    void *result, unsigned long size, void *ctx) {
+    _threadpool_range_t range;
+    char                stack[LIBCHIK_THREADPOOL_REDUCE_STACK]
+        CHIK_ALIGNED(CHIK_CACHE_LINE);
+    char               *accs = stack;
+    unsigned long       stride;
+    unsigned long       bytes;
+    unsigned long       i;
+
+    memcpy(result, identity, size);
+
+    if (end <= begin)
+        return;
+
+    /*
+     *    Accumulators get a cache line each, so participants don't
+     *    false-share while folding. Only few small ones fit on the
+     *    stack, and should the heap be out the caller folds it all.
+     */
+    stride = (size + CHIK_CACHE_LINE - 1) & ~(unsigned long)(CHIK_CACHE_LINE - 1);
+    bytes  = stride * (threadpool_current()->threads + 1);
+
+    if (bytes > sizeof(stack) &&
+        (accs = (char *)aligned_alloc(CHIK_CACHE_LINE, bytes)) == 0) {
+        fun(begin, end, result, ctx);
+        return;
+    }
+
+    range.end      = end;
+    range.grain    = _threadpool_grain(end - begin, grain);
+    range.fun      = 0;
+    range.reduce   = fun;
+    range.ctx      = ctx;
+    range.identity = identity;
+    range.size     = size;
+    range.stride   = stride;
+    range.slots    = 0;
+    range.accs     = accs;
+
+    _threadpool_range_run(&range, begin);
+
+    for (i = 0; i < range.slots; i++)
+        combine(result, accs + i * stride, ctx);
+
+    if (accs != stack)
+        free(accs);
+}
+
+/*
+ *   Runs a graph job, then releases the jobs that depend on it.
+ *
+ *   @param void *arg    The threadpool_job_t to run.
+ *
+ *   @return void*    Always 0.
+ */
+static void *_threadpool_job_task(void *arg) {
+    threadpool_job_t   *job   = (threadpool_job_t *)arg;
+    threadpool_graph_t *graph = (threadpool_graph_t *)job->graph;
+    threadpool_job_t   *next;
+    unsigned long       i;
+
+    job->fun(job->arg);
+
+    for (i = 0; i < job->succs; i++) {
+        next = &graph->jobs[graph->succ[job->first_succ + i]];
+
+        if (__atomic_fetch_sub(&next->remaining, 1, __ATOMIC_ACQ_REL) != 1)
+            continue;
+
+        if (threadpool_submit_group(&graph->group, _threadpool_job_task,
+                                    next) != 0)
+            _threadpool_job_task(next);
+    }
+
+    return 0;
+}
+
+/*
+ *   Lays the graph's dependencies out as per-job successor lists and
+ *   checks that the graph is acyclic.
+ *
+ *   @param threadpool_graph_t *graph    The graph to build.
+ *
+ *   @return int    0 on success, -1 if the graph has a cycle.
+ */
+static int _threadpool_graph_build(threadpool_graph_t *graph) {
+    threadpool_job_t *job;
+    unsigned long     i;
+    unsigned long     j;
+    unsigned long     head;
+    unsigned long     tail;
+
+    for (i = 0; i < graph->count; i++) {
+        graph->jobs[i].preds = 0;
+        graph->jobs[i].succs = 0;
+    }
+
+    for (i = 0; i < graph->edges; i++) {
+        graph->jobs[graph->edge_from[i]].succs++;
+        graph->jobs[graph->edge_to[i]].preds++;
+    }
+
+    for (i = 0, j = 0; i < graph->count; i++) {
+        graph->jobs[i].first_succ = j;
+        graph->jobs[i].remaining  = 0;
+        j += graph->jobs[i].succs;
+    }
+
+    for (i = 0; i < graph->edges; i++) {
+        job = &graph->jobs[graph->edge_from[i]];
+        graph->succ[job->first_succ + job->remaining++] = graph->edge_to[i];
+    }
+
+    /*
+     *    Walk the graph in topological order, reusing edge_from as
+     *    the work list. Every job is reached only if there's no cycle.
+     */
+    for (i = 0, tail = 0; i < graph->count; i++) {
+        graph->jobs[i].remaining = graph->jobs[i].preds;
+
+        if (graph->jobs[i].preds == 0)
+            graph->edge_from[tail++] = i;
+    }
+
+    for (head = 0; head < tail; head++) {
+        job = &graph->jobs[graph->edge_from[head]];
+
+        for (i = 0; i < job->succs; i++) {
+            j = graph->succ[job->first_succ + i];
+
+            if (--graph->jobs[j].remaining == 0)
+                graph->edge_from[tail++] = j;
+        }
+    }
+
+    /*
+     *    Rewrite the edge list from the successor lists.
+     */
+    for (i = 0, j = 0; i < graph->count; i++) {
+        for (head = 0; head < graph->jobs[i].succs; head++, j++) {
+            graph->edge_from[j] = i;
+            graph->edge_to[j]   = graph->succ[j];
+        }
+    }
+
+    if (tail != graph->count) {
+        LOGF_ERR("Job graph has a cycle.\n");
+        return -1;
+    }
+
+    graph->built = 1;
+
+    return 0;
+}
+
+/*
+ *   Creates a job graph. All storage is allocated up front, so the
+ *   graph can be run every frame without allocating.
+ *
+ *   @param unsigned long max_jobs     The maximum number of jobs.
+ *   @param unsigned long max_edges    The maximum number of dependencies.
+ *
+ *   @return threadpool_graph_t*    The new graph, or 0 on failure.
+ */
+threadpool_graph_t *threadpool_graph_new(unsigned long max_jobs,
+                                         unsigned long max_edges) {
+    threadpool_graph_t *graph;
+
+    graph = (threadpool_graph_t *)calloc(1, sizeof(threadpool_graph_t));
+
+    if (graph == 0) {
+        LOGF_ERR("Failed to allocate memory for job graph.\n");
+        return 0;
+    }
+
+    graph->jobs      = (threadpool_job_t *)calloc(max_jobs + 1,
+                                                  sizeof(threadpool_job_t));
+    graph->edge_from = (unsigned long *)calloc(max_edges + max_jobs + 1,
+                                               sizeof(unsigned long));
+    graph->edge_to   = (unsigned long *)calloc(max_edges + 1,
+                                               sizeof(unsigned long));
+    graph->succ      = (unsigned long *)calloc(max_edges + 1,
+                                               sizeof(unsigned long));
+
+    if (graph->jobs == 0 || graph->edge_from == 0 || graph->edge_to == 0 ||
+        graph->succ == 0) {
+        LOGF_ERR("Failed to allocate memory for job graph.\n");
+        threadpool_graph_destroy(graph);
+        return 0;
+    }
+
+    graph->max_jobs  = max_jobs;
+    graph->max_edges = max_edges;
+
+    threadpool_group_init(&graph->group);
+
+    return graph;
+}
+
+/*
+ *   Destroys a job graph. The graph must not be running.
+ *
+ *   @param threadpool_graph_t *graph    The graph to destroy.
+ */
+void threadpool_graph_destroy(threadpool_graph_t *graph) {
+    free(graph->jobs);
+    free(graph->edge_from);
+    free(graph->edge_to);
+    free(graph->succ);
+    free(graph);
+}
+
+/*
+ *   Adds a job to a graph.
+ *
+ *   @param threadpool_graph_t *graph    The graph.
+ *   @param void *(*fun)(void *)         The function to execute.
+ *   @param void *arg                    The argument to pass to the
+ *                                       function.
+ *
+ *   @return long    The job's index, or -1 if the graph is full.
+ */
+long threadpool_graph_add(threadpool_graph_t *graph, void *(*fun)(void *),
+                          void *arg) {
+    threadpool_job_t *job;
+
+    if (graph->count == graph->max_jobs) {
+        LOGF_ERR("Job graph is full.\n");
+        return -1;
+    }
+
+    job        = &graph->jobs[graph->count];
+    job->fun   = fun;
+    job->arg   = arg;
+    job->graph = graph;
+
+    graph->built = 0;
+
+    return (long)graph->count++;
+}
+
+/*
+ *   Makes a job wait for another job to finish.
+ *
+ *   @param threadpool_graph_t *graph    The graph.
+ *   @param unsigned long       job      The dependent job.
+ *   @param unsigned long       pred     The job it depends on.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_graph_depend(threadpool_graph_t *graph, unsigned long job,
+                            unsigned long pred) {
+    if (job >= graph->count || pred >= graph->count || job == pred) {
+        LOGF_ERR("Invalid job graph dependency.\n");
+        return -1;
+    }
+
+    if (graph->edges == graph->max_edges) {
+        LOGF_ERR("Job graph has too many dependencies.\n");
+        return -1;
+    }
+
+    graph->edge_from[graph->edges] = pred;
+    graph->edge_to[graph->edges]   = job;
+    graph->edges++;
+
+    graph->built = 0;
+
+    return 0;
+}
+
+/*
+ *   Starts running a graph. Jobs without dependencies are submitted
+ *   right away, and every other job is submitted as soon as its last
+ *   dependency finishes.
+ *
+ *   @param threadpool_graph_t *graph    The graph to run.
+ *
+ *   @return int    0 on success, -1 if the graph has a cycle.
+ */
+int threadpool_graph_submit(threadpool_graph_t *graph) {
+    unsigned long i;
+
+    if (!graph->built && _threadpool_graph_build(graph) != 0)
+        return -1;
+
+    for (i = 0; i < graph->count; i++)
+        graph->jobs[i].remaining = graph->jobs[i].preds;
+
+    /*
+     *    Hold the group open until every root is queued, so an early
+     *    finisher can't make a concurrent wait return.
+     */
+    __atomic_fetch_add(&graph->group.pending, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < graph->count; i++) {
+        if (graph->jobs[i].preds != 0)
+            continue;
+
+        if (threadpool_submit_group(&graph->group, _threadpool_job_task,
+                                    &graph->jobs[i]) != 0)
+            _threadpool_job_task(&graph->jobs[i]);
+    }
+
+    _threadpool_group_done(&graph->group);
+
+    return 0;
+}
+
+/*
+ *   Waits for a submitted graph to finish, helping with queued work.
+ *
+ *   @param threadpool_graph_t *graph    The graph to wait for.
+ */
+void threadpool_graph_wait(threadpool_graph_t *graph) {
+    threadpool_group_wait(&graph->group);
+}
+
+/*
+ *   Runs a graph to completion.
+ *
+ *   @param threadpool_graph_t *graph    The graph to run.
+ *
+ *   @return int    0 on success, -1 if the graph has a cycle.
+ */
+int threadpool_graph_run(threadpool_graph_t *graph) {
+    if (threadpool_graph_submit(graph) != 0)
+        return -1;
+
+    threadpool_graph_wait(graph);
+
+    return 0;
+}
+
+/*
+ *   Submits a task that runs on its own fiber. Unlike a plain task it
+ *   may wait on groups, futures or threadpool_wait_until() without
+ *   holding up its worker, which runs other tasks in the meantime.
+ *
+ *   @param threadpool_group_t *group       The group, may be 0.
+ *   @param void *(*fun)(void *)            The function to execute.
+ *   @param void *arg                       The argument to pass to the
+ *                                          function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_fiber(threadpool_group_t *group, void *(*fun)(void *),
+                            void *arg) {
+    fiber_t *fiber = fiber_new(fun, arg);
+
+    if (fiber == 0)
+        return -1;
+
+    /*
+     *    The group is finished by the fiber rather than by the task
+     *    that starts it, as the fiber may outlive that task.
+     */
+    fiber->pool  = threadpool_current();
+    fiber->group = group;
+
+    if (group != 0)
+        __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+
+    if (threadpool_submit(_threadpool_fiber_task, fiber) != 0) {
+        if (group != 0)
+            _threadpool_group_done(group);
+
+        fiber_free(fiber);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *   Waits until ready(arg) returns nonzero. On a fiber the fiber is
+ *   parked and its worker moves on, anywhere else the calling thread
+ *   runs queued tasks until the condition holds.
+ *
+ *   @param int (*ready)(void *)    The condition to wait for.
+ *   @param void *arg               The argument to pass to the condition.
+ */
+void threadpool_wait_until(int (*ready)(void *), void *arg) {
+    fiber_t *fiber = fiber_current();
+
+    if (fiber == 0) {
+        _threadpool_wait_ready(threadpool_current(), ready, arg);
+        return;
+    }
+
+    while (!ready(arg)) {
+        fiber->wait_fun = ready;
+        fiber->wait_arg = arg;
+
+        fiber_suspend();
+    }
+
+    fiber->wait_fun = 0;
+    fiber->wait_arg = 0;
+}
+
+#if __unix__
+/*
+ *   Destroys the scratch arena of a thread that exits.
+ *
+ *   @param void *arena    The arena.
+ */
+static void _threadpool_scratch_free(void *arena) {
+    mempool_destroy((mempool_t *)arena);
+}
+
+/*
+ *   Creates the key scratch arenas are freed through.
+ */
+static void _threadpool_scratch_key_init(void) {
+    pthread_key_create(&_threadpool_scratch_key, _threadpool_scratch_free);
+}
+#endif /* __unix__  */
+
+/*
+ *   Allocates temporary memory for the running task from the calling
+ *   thread's scratch arena, without locking. Everything a task
+ *   allocates is released when it returns, so the memory must not be
+ *   freed or outlive the task. Fibers can't use the arena, as other
+ *   tasks run on their thread while they wait.
+ *
+ *   @param unsigned long size    The size in bytes.
+ *
+ *   @return void*    16-byte aligned memory, or 0 outside a task, on a
+ *                    fiber, or if the arena is out of room.
+ */
+void *threadpool_scratch_alloc(unsigned long size) {
+    if (_threadpool_running == 0 || fiber_current() != 0)
+        return 0;
+
+    if (_threadpool_scratch == 0) {
+        _threadpool_scratch = mempool_new(LIBCHIK_THREADPOOL_SCRATCH_SIZE);
+
+        if (_threadpool_scratch == 0)
+            return 0;
+
+#if __unix__
+        pthread_once(&_threadpool_scratch_once, _threadpool_scratch_key_init);
+        pthread_setspecific(_threadpool_scratch_key, _threadpool_scratch);
+#endif /* __unix__  */
+    }
+
+    return mempool_bump(_threadpool_scratch, (long)size, 16);
+}
+
+/*
+ *   Lets other work run before continuing. On a fiber the fiber is
+ *   parked behind the worker's next task, anywhere else one queued
+ *   task is run.
+ */
+void threadpool_yield(void) {
+    fiber_t *fiber = fiber_current();
+
+    if (fiber == 0) {
+        threadpool_help();
+        return;
+    }
+
+    fiber->wait_fun = 0;
+    fiber->wait_arg = 0;
+
+    fiber_suspend();
+}
+
+/*
+ *   Tells the pool of the running task that the task is about to
+ *   block, in a system call for instance. If that leaves fewer
+ *   workers running than the pool was started with and work is
+ *   queued, an elastic pool adds a worker to make up for it.
+ *   Outside a task this does nothing.
+ */
+void threadpool_block_begin(void) {
+    threadpool_t *pool = _threadpool_running;
+
+    if (pool == 0)
+        return;
+
+    __atomic_fetch_add(&pool->blocked, 1, __ATOMIC_RELAXED);
+
+    if (_threadpool_has_work(pool))
+        _threadpool_check_blocked(pool);
+}
+
+/*
+ *   Ends a threadpool_block_begin(). The worker added for it exits
+ *   once it is idle again.
+ */
+void threadpool_block_end(void) {
+    threadpool_t *pool = _threadpool_running;
+
+    if (pool == 0)
+        return;
+
+    __atomic_fetch_sub(&pool->blocked, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *   Wakes sleeping workers so they re-check their parked fibers.
+ *   Anything a fiber can wait on should call this when it becomes
+ *   ready and has waiters. Costs a single load while no fiber is parked.
+ */
+void threadpool_wake_parked(void) {
+    threadpool_t *pool;
+
+    if (__atomic_load_n(&_threadpool_parked, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+#if __unix__
+    pthread_mutex_lock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+
+    for (pool = _threadpool_pools; pool != 0; pool = pool->next) {
+        if (__atomic_load_n(&pool->parked, __ATOMIC_SEQ_CST) != 0)
+            sync_event_notify(&pool->event, 0x7FFFFFFF);
+    }
+
+#if __unix__
+    pthread_mutex_unlock(&_threadpool_pools_lock);
+#endif /* __unix__  */
+}
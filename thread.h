@@ -16,7 +16,17 @@
  *    In order to do this, some assembly will be required, as C
  *    does not have a standard way of pushing all registers onto
  *    the stack in a manner that could be used to allow for waitless
- *    parallelism.
+ *    parallelism. That assembly lives in fiber.c: tasks submitted
+ *    with threadpool_submit_fiber() run on their own stack, and
+ *    park instead of blocking their worker when they wait.
+ *
+ *    Besides the global threadpool, subsystems can create pools of
+ *    their own with threadpool_create(). Functions that don't take a
+ *    pool use the one of the task the calling thread is running, so
+ *    work forked by a task stays in its pool.
+ *
+ *    Delayed and periodic tasks are kept in a timer wheel per pool,
+ *    served by a thread that sleeps until the next one is due.
  */
 #ifndef LIBCHIK_THREAD_H
 #define LIBCHIK_THREAD_H
@@ -27,6 +37,207 @@
 //#error "Unsupported platform"
 #endif /* __unix__  */
 
+#include "timer.h"
+
+#define LIBCHIK_THREADPOOL_WAIT_SPIN 4096
+
+#define LIBCHIK_THREADPOOL_CHUNKS_PER_THREAD 4
+
+/*
+ *    How many tasks of a batch are queued with a single claim.
+ */
+#define LIBCHIK_THREADPOOL_BATCH 64
+
+/*
+ *    How long a worker with parked fibers sleeps before it checks
+ *    their wait conditions again.
+ */
+#define LIBCHIK_THREADPOOL_FIBER_POLL_NS 100000
+
+#define LIBCHIK_THREADPOOL_NAME "chik-worker"
+
+/*
+ *    The initial size of a priority class' overflow list, which
+ *    doubles whenever it fills up.
+ */
+#define LIBCHIK_THREADPOOL_OVERFLOW_SIZE 256
+
+/*
+ *    A priority class that hasn't been served for this long gets its
+ *    next task ahead of the more urgent classes.
+ */
+#define LIBCHIK_THREADPOOL_AGING_NS 2000000
+
+/*
+ *    Looking for a starving class costs a clock read, so a thread
+ *    only does so once every this many searches for work.
+ */
+#define LIBCHIK_THREADPOOL_AGING_CHECK 32
+
+/*
+ *    The resolution of threadpool timers. A timer never fires early,
+ *    and usually within a tick of when it is due.
+ */
+#define LIBCHIK_THREADPOOL_TIMER_TICK_NS 1000000
+
+/*
+ *    The size of the scratch arena each thread running tasks gets on
+ *    its first threadpool_scratch_alloc().
+ */
+#define LIBCHIK_THREADPOOL_SCRATCH_SIZE (256 * 1024)
+
+/*
+ *    Bytes of accumulators threadpool_parallel_reduce() keeps on the
+ *    stack, more are allocated.
+ */
+#define LIBCHIK_THREADPOOL_REDUCE_STACK 2048
+
+/*
+ *    Histogram bucket i counts values in [2^i, 2^(i+1)), the last one
+ *    everything above.
+ */
+#define LIBCHIK_THREADPOOL_HIST_BUCKETS 32
+
+/*
+ *    One in this many tasks has its run time measured, reading the
+ *    clock twice costs about as much as running a small task.
+ */
+#define LIBCHIK_THREADPOOL_RUN_SAMPLE 16
+
+/*
+ *    Defaults for elastic pools: how long a surplus worker idles
+ *    before it exits, and how long a task may wait in the queue before
+ *    another worker is added. Workers are added at most once per
+ *    LIBCHIK_THREADPOOL_SPAWN_INTERVAL_NS for queue waits.
+ */
+#define LIBCHIK_THREADPOOL_IDLE_NS           2000000000
+#define LIBCHIK_THREADPOOL_SPAWN_NS          2000000
+#define LIBCHIK_THREADPOOL_SPAWN_INTERVAL_NS 1000000
+
+typedef enum {
+    THREADPOOL_PRIORITY_HIGH,   /* Frame-critical work.             */
+    THREADPOOL_PRIORITY_NORMAL, /* The default.                     */
+    THREADPOOL_PRIORITY_LOW,    /* Background work, loads, saves.   */
+    THREADPOOL_PRIORITY_COUNT,
+} threadpool_priority_e;
+
+/*
+ *    Wait times cover tasks that went through the injector queue of
+ *    their class. Tasks a worker forks onto its own deque continue
+ *    work that has already started and aren't timed.
+ */
+typedef struct {
+    unsigned long depth;      /* Tasks in the injector right now.       */
+    unsigned long run;        /* Tasks started since the pool was made. */
+    unsigned long queued;     /* Tasks taken from the injector.         */
+    unsigned long wait_total; /* Nanoseconds they spent queued, total.  */
+    unsigned long wait_max;   /* The longest one of them spent queued.  */
+} threadpool_priority_stats_t;
+
+typedef struct {
+    unsigned long count;
+    unsigned long total;
+    unsigned long max;
+    unsigned long buckets[LIBCHIK_THREADPOOL_HIST_BUCKETS];
+} threadpool_histogram_t;
+
+/*
+ *    Counters of a worker, or of all workers of a pool summed up.
+ *    Each worker only writes its own, so keeping them costs no
+ *    contention; readers add them up on demand.
+ */
+typedef struct {
+    unsigned long tasks;         /* Tasks run.                              */
+    unsigned long local;         /* Tasks taken from the worker's deque.    */
+    unsigned long injected;      /* Tasks taken from the injector queues.   */
+    unsigned long steals;        /* Tasks stolen from other workers.        */
+    unsigned long steal_misses;  /* Searches of the others that found none. */
+    unsigned long sleeps;        /* Times the worker went to sleep.         */
+    unsigned long idle;          /* Nanoseconds spent without a task.       */
+    unsigned long uptime;        /* Nanoseconds since the worker started.   */
+    unsigned long queue_retries; /* Injector claims lost to other threads.  */
+    unsigned long queue_full;    /* Injector adds that found it full.       */
+    unsigned long queue_empty;   /* Injector polls that found it empty.     */
+
+    threadpool_histogram_t depth; /* Injector depth when a task was taken.  */
+    threadpool_histogram_t wait;  /* Nanoseconds tasks spent queued.        */
+    threadpool_histogram_t run;   /* Nanoseconds tasks ran, sampled.        */
+} threadpool_worker_stats_t;
+
+typedef struct {
+    unsigned long size;     /* The size of the queues.                    */
+    unsigned long threads;  /* Workers to spawn, 0 for one per free core.  */
+    unsigned long reserved; /* Cores kept free for the main and render
+                               threads, see threadpool_pin_reserved().    */
+    int           pin;      /* Pins each worker to its own core.          */
+    int           skip_smt; /* Leaves SMT siblings of used cores idle.    */
+    const char   *name;     /* Worker name prefix, 0 for the default.     */
+    int           overflow; /* Lets full queues spill into a growable
+                               list instead of rejecting tasks.           */
+
+    /*
+     *    Elastic pools start with threads workers and add more, up to
+     *    max_threads, while tasks queue up or workers block. Workers
+     *    above threads exit once they've been idle for idle_ns.
+     */
+    unsigned long max_threads; /* 0 to keep the pool at threads.          */
+    unsigned long idle_ns;     /* 0 for LIBCHIK_THREADPOOL_IDLE_NS.        */
+    unsigned long spawn_ns;    /* Queue wait that adds a worker, 0 for
+                                  LIBCHIK_THREADPOOL_SPAWN_NS.            */
+} threadpool_config_t;
+
+typedef struct threadpool_s threadpool_t;
+
+typedef struct {
+    void *(*fun)(void *);
+    void *arg;
+} threadpool_task_t;
+
+typedef struct {
+    unsigned int pending;
+    unsigned int waiters;
+} threadpool_group_t;
+
+/*
+ *    A timer is owned by the caller and must stay alive while it is
+ *    pending. Its fields are only touched under the lock of its pool.
+ */
+typedef struct {
+    timer_node_t  node;
+    threadpool_t *pool;
+    void *(*fun)(void *);
+    void         *arg;
+    unsigned long period;   /* Ticks between runs, 0 for a one-shot.     */
+    unsigned int  priority; /* The class the task is submitted to.       */
+    int           owned;    /* Freed by the pool once it has fired.      */
+} threadpool_timer_t;
+
+typedef struct {
+    void *(*fun)(void *);
+    void *arg;
+    void *graph;
+
+    unsigned int  preds;
+    unsigned int  remaining;
+    unsigned long first_succ;
+    unsigned long succs;
+} threadpool_job_t;
+
+typedef struct {
+    threadpool_job_t *jobs;
+    unsigned long     count;
+    unsigned long     max_jobs;
+
+    unsigned long *edge_from;
+    unsigned long *edge_to;
+    unsigned long *succ;
+    unsigned long  edges;
+    unsigned long  max_edges;
+
+    int                built;
+    threadpool_group_t group;
+} threadpool_graph_t;
+
 /*
  *   Initializes the global threadpool.
  *
@@ -38,12 +249,70 @@
 int threadpool_init(unsigned long size, unsigned long threads);
 
 /*
- *   Destroys the global threadpool.
+ *   Initializes the global threadpool with placement options.
+ *   Cores are taken from the process' affinity mask in sysfs topology
+ *   order, the first config->reserved of them are left to the caller.
+ *
+ *   @param const threadpool_config_t *config    The configuration.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_init_config(const threadpool_config_t *config);
+
+/*
+ *   Pins the calling thread to one of the cores reserved with
+ *   threadpool_init_config().
+ *
+ *   @param unsigned long index    The index of the reserved core.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_pin_reserved(unsigned long index);
+
+/*
+ *   Destroys the global threadpool. Queued tasks are run, then the
+ *   workers are joined.
  */
 void threadpool_destroy(void);
 
 /*
- *   Submits a task to the global threadpool.
+ *   Creates a threadpool of its own, next to the global one. Each
+ *   pool has its own workers and queues, so work submitted to one
+ *   never waits behind work submitted to another.
+ *
+ *   @param const threadpool_config_t *config    The configuration.
+ *
+ *   @return threadpool_t*    The pool, or 0 on failure.
+ *                            Should be released with threadpool_free().
+ */
+threadpool_t *threadpool_create(const threadpool_config_t *config);
+
+/*
+ *   Destroys a threadpool made with threadpool_create(). Queued tasks
+ *   are run, then the workers are joined.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+void threadpool_free(threadpool_t *pool);
+
+/*
+ *   Returns the global threadpool.
+ *
+ *   @return threadpool_t*    The pool.
+ */
+threadpool_t *threadpool_default(void);
+
+/*
+ *   Returns the pool of the task the calling thread is running, else
+ *   the pool it works for, else the global one. Functions that don't
+ *   take a pool use this one.
+ *
+ *   @return threadpool_t*    The pool.
+ */
+threadpool_t *threadpool_current(void);
+
+/*
+ *   Submits a task to the current threadpool.
  *
  *   @param void *(*fun)(void *)    The function to execute.
  *   @param void *arg               The argument to pass to the function.
@@ -53,8 +322,512 @@ void threadpool_destroy(void);
 int threadpool_submit(void *(*fun)(void *), void *arg);
 
 /*
- *   Waits for all tasks to complete.
+ *   Waits for all tasks of the current threadpool to complete.
+ *   Must not be called from inside a task.
  */
 void threadpool_wait(void);
 
+/*
+ *   Waits for all tasks of a threadpool to complete, helping with
+ *   them in the meantime. Must not be called from inside a task of
+ *   that pool.
+ *
+ *   @param threadpool_t *pool    The pool.
+ */
+void threadpool_wait_pool(threadpool_t *pool);
+
+/*
+ *   Initializes a task group.
+ *
+ *   @param threadpool_group_t *group    The group to initialize.
+ */
+void threadpool_group_init(threadpool_group_t *group);
+
+/*
+ *   Submits a task to the current threadpool as part of a group.
+ *
+ *   @param threadpool_group_t *group       The group, may be 0.
+ *   @param void *(*fun)(void *)            The function to execute.
+ *   @param void *arg                       The argument to pass to the
+ *                                          function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_group(threadpool_group_t *group, void *(*fun)(void *),
+                            void *arg);
+
+/*
+ *   Submits a task to the current threadpool with a priority class.
+ *   Workers always take the most urgent work first, except that a
+ *   class that has waited for LIBCHIK_THREADPOOL_AGING_NS gets one
+ *   task ahead, so background work keeps moving. Tasks submitted
+ *   without a priority inherit the one of the task submitting them,
+ *   or are THREADPOOL_PRIORITY_NORMAL outside the pool.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_priority(threadpool_group_t   *group,
+                               threadpool_priority_e priority,
+                               void *(*fun)(void *), void *arg);
+
+/*
+ *   Submits a task to a threadpool. From a worker of another pool it
+ *   goes through the injector queue of its class like from any other
+ *   thread outside the pool.
+ *
+ *   @param threadpool_t         *pool        The pool.
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_to(threadpool_t *pool, threadpool_group_t *group,
+                         threadpool_priority_e priority, void *(*fun)(void *),
+                         void *arg);
+
+/*
+ *   Submits a batch of tasks to the current threadpool. Queueing them
+ *   together costs a fraction of submitting them one by one. Stops at
+ *   the first task there is no room for.
+ *
+ *   @param threadpool_group_t      *group    The group, may be 0.
+ *   @param const threadpool_task_t *tasks    The tasks.
+ *   @param unsigned long            count    The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks submitted, the first
+ *                            ones of the batch.
+ */
+unsigned long threadpool_submit_batch(threadpool_group_t      *group,
+                                      const threadpool_task_t *tasks,
+                                      unsigned long            count);
+
+/*
+ *   Submits a batch of tasks to a threadpool with a priority class.
+ *   Stops at the first task there is no room for.
+ *
+ *   @param threadpool_t            *pool        The pool.
+ *   @param threadpool_group_t      *group       The group, may be 0.
+ *   @param threadpool_priority_e    priority    The priority class.
+ *   @param const threadpool_task_t *tasks       The tasks.
+ *   @param unsigned long            count       The number of tasks.
+ *
+ *   @return unsigned long    The number of tasks submitted, the first
+ *                            ones of the batch.
+ */
+unsigned long threadpool_submit_batch_to(threadpool_t            *pool,
+                                         threadpool_group_t      *group,
+                                         threadpool_priority_e    priority,
+                                         const threadpool_task_t *tasks,
+                                         unsigned long            count);
+
+/*
+ *   Submits a task to the current threadpool, waiting for room if the
+ *   queue of its class is full. While it waits the calling thread runs
+ *   queued tasks, which is what makes room.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_wait(threadpool_group_t   *group,
+                           threadpool_priority_e priority,
+                           void *(*fun)(void *), void *arg);
+
+/*
+ *   Submits a task to the current threadpool, waiting at most ns
+ *   nanoseconds for room if the queue of its class is full.
+ *
+ *   @param threadpool_group_t   *group       The group, may be 0.
+ *   @param threadpool_priority_e priority    The priority class.
+ *   @param void *(*fun)(void *)              The function to execute.
+ *   @param void *arg                         The argument to pass to the
+ *                                            function.
+ *   @param unsigned long         ns          The timeout in nanoseconds.
+ *
+ *   @return int    0 on success, -1 on timeout or failure.
+ */
+int threadpool_submit_timeout(threadpool_group_t   *group,
+                              threadpool_priority_e priority,
+                              void *(*fun)(void *), void *arg,
+                              unsigned long ns);
+
+/*
+ *   Reads the counters of one worker of a threadpool.
+ *
+ *   @param threadpool_t              *pool     The pool.
+ *   @param unsigned long              index    The worker.
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if there is no such worker.
+ */
+int threadpool_worker_stats_pool(threadpool_t *pool, unsigned long index,
+                                 threadpool_worker_stats_t *stats);
+
+/*
+ *   Reads the counters of every worker of a threadpool, summed up.
+ *
+ *   @param threadpool_t              *pool     The pool.
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if the pool isn't running.
+ */
+int threadpool_stats_pool(threadpool_t *pool, threadpool_worker_stats_t *stats);
+
+/*
+ *   Reads the counters of every worker of the current threadpool,
+ *   summed up.
+ *
+ *   @param threadpool_worker_stats_t *stats    Where to store them.
+ *
+ *   @return int    0 on success, -1 if the pool isn't running.
+ */
+int threadpool_stats(threadpool_worker_stats_t *stats);
+
+/*
+ *   Estimates a percentile of a histogram.
+ *
+ *   @param const threadpool_histogram_t *hist        The histogram.
+ *   @param double                        fraction    The percentile, 0 to 1.
+ *
+ *   @return unsigned long    The upper bound of the bucket the
+ *                            percentile falls into.
+ */
+unsigned long threadpool_histogram_percentile(const threadpool_histogram_t *hist,
+                                              double fraction);
+
+/*
+ *   The "threadpool" shell command, which prints the counters of the
+ *   default threadpool and each of its workers.
+ *
+ *   @param int    argc    The argument count.
+ *   @param char **argv    The arguments.
+ */
+void threadpool_shell_stats(int argc, char **argv);
+
+/*
+ *   Initializes a timer, which is not pending until started.
+ *
+ *   @param threadpool_timer_t *timer    The timer to initialize.
+ */
+void threadpool_timer_init(threadpool_timer_t *timer);
+
+/*
+ *   Starts a timer on the current threadpool, which submits a task
+ *   once delay_ns have passed, and then every period_ns if that isn't
+ *   0. The task runs with the priority of the calling task.
+ *
+ *   @param threadpool_timer_t *timer        The timer, must not be pending.
+ *   @param unsigned long       delay_ns     The delay in nanoseconds.
+ *   @param unsigned long       period_ns    The period in nanoseconds,
+ *                                           0 for a one-shot.
+ *   @param void *(*fun)(void *)             The function to execute.
+ *   @param void *arg                        The argument to pass to the
+ *                                           function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_timer_start(threadpool_timer_t *timer, unsigned long delay_ns,
+                           unsigned long period_ns, void *(*fun)(void *),
+                           void *arg);
+
+/*
+ *   Starts a timer on a threadpool.
+ *
+ *   @param threadpool_t         *pool         The pool.
+ *   @param threadpool_timer_t   *timer        The timer, must not be pending.
+ *   @param threadpool_priority_e priority     The priority class.
+ *   @param unsigned long         delay_ns     The delay in nanoseconds.
+ *   @param unsigned long         period_ns    The period in nanoseconds,
+ *                                             0 for a one-shot.
+ *   @param void *(*fun)(void *)               The function to execute.
+ *   @param void *arg                          The argument to pass to the
+ *                                             function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_timer_start_to(threadpool_t *pool, threadpool_timer_t *timer,
+                              threadpool_priority_e priority,
+                              unsigned long delay_ns, unsigned long period_ns,
+                              void *(*fun)(void *), void *arg);
+
+/*
+ *   Cancels a timer. A task the timer has already submitted still runs,
+ *   but a periodic timer won't submit another one.
+ *
+ *   @param threadpool_timer_t *timer    The timer.
+ *
+ *   @return int    1 if the timer was pending, 0 otherwise.
+ */
+int threadpool_timer_cancel(threadpool_timer_t *timer);
+
+/*
+ *   Submits a task to the current threadpool once delay_ns have passed.
+ *   The timer is allocated and freed by the pool, so the task can't be
+ *   cancelled.
+ *
+ *   @param unsigned long delay_ns    The delay in nanoseconds.
+ *   @param void *(*fun)(void *)      The function to execute.
+ *   @param void *arg                 The argument to pass to the function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_after(unsigned long delay_ns, void *(*fun)(void *),
+                            void *arg);
+
+/*
+ *   Reads the queue statistics of a priority class of the current
+ *   threadpool.
+ *
+ *   @param threadpool_priority_e        priority    The priority class.
+ *   @param threadpool_priority_stats_t *stats       Where to store them.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_priority_stats(threadpool_priority_e        priority,
+                              threadpool_priority_stats_t *stats);
+
+/*
+ *   Reads the queue statistics of a priority class of a threadpool.
+ *
+ *   @param threadpool_t                *pool        The pool.
+ *   @param threadpool_priority_e        priority    The priority class.
+ *   @param threadpool_priority_stats_t *stats       Where to store them.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_priority_stats_pool(threadpool_t                *pool,
+                                   threadpool_priority_e        priority,
+                                   threadpool_priority_stats_t *stats);
+
+/*
+ *   Waits for every task of a group to complete. While the group is
+ *   busy the calling thread runs queued tasks itself, and only sleeps
+ *   once there is nothing left to help with. On a fiber, the fiber is
+ *   parked instead.
+ *
+ *   @param threadpool_group_t *group    The group to wait for.
+ */
+void threadpool_group_wait(threadpool_group_t *group);
+
+/*
+ *   Waits for every task of a group to complete, running queued tasks
+ *   of a threadpool while the group is busy.
+ *
+ *   @param threadpool_t       *pool     The pool to help.
+ *   @param threadpool_group_t *group    The group to wait for.
+ */
+void threadpool_group_wait_pool(threadpool_t *pool, threadpool_group_t *group);
+
+/*
+ *   Runs one queued task of the current threadpool on the calling
+ *   thread, if there is one.
+ *
+ *   @return int    1 if a task was run, 0 otherwise.
+ */
+int threadpool_help(void);
+
+/*
+ *   Runs one queued task of a threadpool on the calling thread, if
+ *   there is one. A worker resumes its own ready fibers first.
+ *
+ *   @param threadpool_t *pool    The pool.
+ *
+ *   @return int    1 if a task was run, 0 otherwise.
+ */
+int threadpool_help_pool(threadpool_t *pool);
+
+/*
+ *   Runs fun over [begin, end) in parallel, in chunks of at most
+ *   grain indices. The calling thread takes part and returns once
+ *   every chunk has been processed.
+ *
+ *   @param unsigned long begin    The first index.
+ *   @param unsigned long end      One past the last index.
+ *   @param unsigned long grain    The chunk size, or 0 to pick one.
+ *   @param void (*fun)(unsigned long, unsigned long, void *)
+ *                                 The function to run on each chunk.
+ *   @param void *ctx              The context to pass to the function.
+ */
+void threadpool_parallel_for(unsigned long begin, unsigned long end,
+                             unsigned long grain,
+                             void (*fun)(unsigned long, unsigned long, void *),
+                             void *ctx);
+
+/*
+ *   Reduces [begin, end) in parallel. Each participating thread
+ *   starts from a copy of identity and folds its chunks into it with
+ *   fun, then the partial results are merged into result with combine.
+ *
+ *   @param unsigned long begin    The first index.
+ *   @param unsigned long end      One past the last index.
+ *   @param unsigned long grain    The chunk size, or 0 to pick one.
+ *   @param void (*fun)(unsigned long, unsigned long, void *, void *)
+ *                                 Folds a chunk into an accumulator.
+ *   @param void (*combine)(void *, const void *, void *)
+ *                                 Merges the second accumulator into the
+ *                                 first.
+ *   @param const void *identity   The initial accumulator value.
+ *   @param void *result           Where to store the result.
+ *   @param unsigned long size     The size of an accumulator in bytes.
+ *   @param void *ctx              The context to pass to the functions.
+ */
+void threadpool_parallel_reduce(
+    unsigned long begin, unsigned long end, unsigned long grain,
+    void (*fun)(unsigned long, unsigned long, void *, void *),
+    void (*combine)(void *, const void *, void *), const void *identity,
+    void *result, unsigned long size, void *ctx);
+
+/*
+ *   Creates a job graph. All storage is allocated up front, so the
+ *   graph can be run every frame without allocating.
+ *
+ *   @param unsigned long max_jobs     The maximum number of jobs.
+ *   @param unsigned long max_edges    The maximum number of dependencies.
+ *
+ *   @return threadpool_graph_t*    The new graph, or 0 on failure.
+ */
+threadpool_graph_t *threadpool_graph_new(unsigned long max_jobs,
+                                         unsigned long max_edges);
+
+/*
+ *   Destroys a job graph. The graph must not be running.
+ *
+ *   @param threadpool_graph_t *graph    The graph to destroy.
+ */
+void threadpool_graph_destroy(threadpool_graph_t *graph);
+
+/*
+ *   Adds a job to a graph.
+ *
+ *   @param threadpool_graph_t *graph    The graph.
+ *   @param void *(*fun)(void *)         The function to execute.
+ *   @param void *arg                    The argument to pass to the
+ *                                       function.
+ *
+ *   @return long    The job's index, or -1 if the graph is full.
+ */
+long threadpool_graph_add(threadpool_graph_t *graph, void *(*fun)(void *),
+                          void *arg);
+
+/*
+ *   Makes a job wait for another job to finish.
+ *
+ *   @param threadpool_graph_t *graph    The graph.
+ *   @param unsigned long       job      The dependent job.
+ *   @param unsigned long       pred     The job it depends on.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_graph_depend(threadpool_graph_t *graph, unsigned long job,
+                            unsigned long pred);
+
+/*
+ *   Starts running a graph. Jobs without dependencies are submitted
+ *   right away, and every other job is submitted as soon as its last
+ *   dependency finishes.
+ *
+ *   @param threadpool_graph_t *graph    The graph to run.
+ *
+ *   @return int    0 on success, -1 if the graph has a cycle.
+ */
+int threadpool_graph_submit(threadpool_graph_t *graph);
+
+/*
+ *   Waits for a submitted graph to finish, helping with queued work.
+ *
+ *   @param threadpool_graph_t *graph    The graph to wait for.
+ */
+void threadpool_graph_wait(threadpool_graph_t *graph);
+
+/*
+ *   Runs a graph to completion.
+ *
+ *   @param threadpool_graph_t *graph    The graph to run.
+ *
+ *   @return int    0 on success, -1 if the graph has a cycle.
+ */
+int threadpool_graph_run(threadpool_graph_t *graph);
+
+/*
+ *   Submits a task that runs on its own fiber. Unlike a plain task it
+ *   may wait on groups, futures or threadpool_wait_until() without
+ *   holding up its worker, which runs other tasks in the meantime.
+ *   A parked fiber is always resumed by the worker that parked it.
+ *
+ *   @param threadpool_group_t *group       The group, may be 0.
+ *   @param void *(*fun)(void *)            The function to execute.
+ *   @param void *arg                       The argument to pass to the
+ *                                          function.
+ *
+ *   @return int    0 on success, -1 on failure.
+ */
+int threadpool_submit_fiber(threadpool_group_t *group, void *(*fun)(void *),
+                            void *arg);
+
+/*
+ *   Waits until ready(arg) returns nonzero. On a fiber the fiber is
+ *   parked and its worker moves on, anywhere else the calling thread
+ *   runs queued tasks until the condition holds.
+ *
+ *   @param int (*ready)(void *)    The condition to wait for.
+ *   @param void *arg               The argument to pass to the condition.
+ */
+void threadpool_wait_until(int (*ready)(void *), void *arg);
+
+/*
+ *   Lets other work run before continuing. On a fiber the fiber is
+ *   parked behind the worker's next task, anywhere else one queued
+ *   task is run.
+ */
+void threadpool_yield(void);
+
+/*
+ *   Allocates temporary memory for the running task from the calling
+ *   thread's scratch arena, without locking. Everything a task
+ *   allocates is released when it returns, so the memory must not be
+ *   freed or outlive the task. Fibers can't use the arena, as other
+ *   tasks run on their thread while they wait.
+ *
+ *   @param unsigned long size    The size in bytes.
+ *
+ *   @return void*    16-byte aligned memory, or 0 outside a task, on a
+ *                    fiber, or if the arena is out of room.
+ */
+void *threadpool_scratch_alloc(unsigned long size);
+
+/*
+ *   Tells the pool of the running task that the task is about to
+ *   block, in a system call for instance. If that leaves fewer
+ *   workers running than the pool was started with and work is
+ *   queued, an elastic pool adds a worker to make up for it.
+ *   Outside a task this does nothing.
+ */
+void threadpool_block_begin(void);
+
+/*
+ *   Ends a threadpool_block_begin(). The worker added for it exits
+ *   once it is idle again.
+ */
+void threadpool_block_end(void);
+
+/*
+ *   Wakes sleeping workers so they re-check their parked fibers.
+ *   Anything a fiber can wait on should call this when it becomes
+ *   ready and has waiters. Costs a single load while no fiber is parked.
+ */
+void threadpool_wake_parked(void);
+
 #endif /* LIBCHIK_THREAD_H  */
\ No newline at end of file
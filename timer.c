@@ -0,0 +1,284 @@
+/*
+ *    timer.c    --    Source for hierarchical timer wheels
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file defines the timer wheel. Level l has CHIK_TIMER_SLOTS
+ *    slots of CHIK_TIMER_SLOTS^l ticks each, and a timer goes into the
+ *    lowest level that reaches its expiry. Whenever the wheel's time
+ *    crosses the boundary of a coarser slot, the timers in it are
+ *    added again and land in a finer level.
+ */
+#include "timer.h"
+
+/*
+ *    Unlinks a node from its slot.
+ *
+ *    @param timer_node_t *node    The node.
+ */
+static void _timer_unlink(timer_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next       = 0;
+    node->prev       = 0;
+}
+
+/*
+ *    Links a node into the slot its expiry hashes to, relative to
+ *    the wheel's current tick.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param timer_node_t  *node     The node.
+ */
+static void _timer_link(timer_wheel_t *wheel, timer_node_t *node) {
+    timer_node_t *head;
+    unsigned long expires = node->expires;
+    unsigned long delta;
+    int           level;
+
+    if (expires < wheel->tick)
+        expires = wheel->tick;
+
+    delta = expires - wheel->tick;
+
+    for (level = 0; level < CHIK_TIMER_LEVELS - 1; level++) {
+        if (delta < 1UL << (CHIK_TIMER_BITS * (level + 1)))
+            break;
+    }
+
+    /*
+     *    Anything beyond the last level waits in its farthest slot
+     *    and is sorted again once that slot cascades.
+     */
+    if (delta >= 1UL << (CHIK_TIMER_BITS * CHIK_TIMER_LEVELS))
+        expires = wheel->tick + (1UL << (CHIK_TIMER_BITS * CHIK_TIMER_LEVELS)) - 1;
+
+    head = &wheel->slots[level][(expires >> (CHIK_TIMER_BITS * level)) &
+                                CHIK_TIMER_MASK];
+
+    node->next       = head;
+    node->prev       = head->prev;
+    head->prev->next = node;
+    head->prev       = node;
+}
+
+/*
+ *    Moves the wheel to a tick and cascades every coarser slot whose
+ *    boundary the tick is on.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param unsigned long  tick     The new tick.
+ */
+static void _timer_enter(timer_wheel_t *wheel, unsigned long tick) {
+    timer_node_t *head;
+    timer_node_t *node;
+    timer_node_t  list;
+    int           level;
+
+    wheel->tick = tick;
+
+    for (level = 1; level < CHIK_TIMER_LEVELS; level++) {
+        if ((tick & ((1UL << (CHIK_TIMER_BITS * level)) - 1)) != 0)
+            break;
+
+        head = &wheel->slots[level][(tick >> (CHIK_TIMER_BITS * level)) &
+                                    CHIK_TIMER_MASK];
+
+        if (head->next == head)
+            continue;
+
+        /*
+         *    Detach the whole slot first, a timer can land in the
+         *    same slot again if it is beyond the last level.
+         */
+        list.next       = head->next;
+        list.prev       = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->next      = head;
+        head->prev      = head;
+
+        while (list.next != &list) {
+            node = list.next;
+            _timer_unlink(node);
+            _timer_link(wheel, node);
+        }
+    }
+}
+
+/*
+ *    Initializes a timer wheel.
+ *
+ *    @param timer_wheel_t *wheel    The wheel to initialize.
+ *    @param unsigned long  tick     The current tick.
+ */
+void timer_wheel_init(timer_wheel_t *wheel, unsigned long tick) {
+    unsigned long i;
+    int           level;
+
+    for (level = 0; level < CHIK_TIMER_LEVELS; level++) {
+        for (i = 0; i < CHIK_TIMER_SLOTS; i++) {
+            wheel->slots[level][i].next = &wheel->slots[level][i];
+            wheel->slots[level][i].prev = &wheel->slots[level][i];
+        }
+    }
+
+    wheel->tick  = tick;
+    wheel->count = 0;
+}
+
+/*
+ *    Initializes a timer node, which is not pending until added.
+ *
+ *    @param timer_node_t *node    The node to initialize.
+ */
+void timer_node_init(timer_node_t *node) {
+    node->next    = 0;
+    node->prev    = 0;
+    node->expires = 0;
+}
+
+/*
+ *    Returns whether a timer node is pending in a wheel.
+ *
+ *    @param timer_node_t *node    The node.
+ *
+ *    @return int    1 if the node is pending, 0 otherwise.
+ */
+int timer_node_pending(timer_node_t *node) { return node->next != 0; }
+
+/*
+ *    Adds a timer to the wheel. A tick in the past is due right away.
+ *
+ *    @param timer_wheel_t *wheel      The wheel.
+ *    @param timer_node_t  *node       The timer, must not be pending.
+ *    @param unsigned long  expires    The tick the timer is due at.
+ */
+void timer_wheel_add(timer_wheel_t *wheel, timer_node_t *node,
+                     unsigned long expires) {
+    node->expires = expires;
+
+    _timer_link(wheel, node);
+
+    wheel->count++;
+}
+
+/*
+ *    Removes a pending timer from the wheel.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param timer_node_t  *node     The timer.
+ *
+ *    @return int    0 on success, -1 if the timer wasn't pending.
+ */
+int timer_wheel_remove(timer_wheel_t *wheel, timer_node_t *node) {
+    if (node->next == 0)
+        return -1;
+
+    _timer_unlink(node);
+
+    wheel->count--;
+
+    return 0;
+}
+
+/*
+ *    Takes one timer that is due by a tick out of the wheel,
+ *    advancing the wheel's time as far as needed to find it.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param unsigned long  now      The current tick.
+ *
+ *    @return timer_node_t*    The timer, or 0 if none is due.
+ */
+timer_node_t *timer_wheel_expire(timer_wheel_t *wheel, unsigned long now) {
+    timer_node_t *head;
+    timer_node_t *node;
+    unsigned long next;
+
+    while (1) {
+        head = &wheel->slots[0][wheel->tick & CHIK_TIMER_MASK];
+
+        if (head->next != head) {
+            node = head->next;
+            _timer_unlink(node);
+            wheel->count--;
+
+            return node;
+        }
+
+        if (wheel->tick >= now)
+            return 0;
+
+        /*
+         *    Skip straight to the next tick with something to do,
+         *    nothing can be missed on the way.
+         */
+        next = timer_wheel_next(wheel);
+
+        if (next > now)
+            next = now;
+
+        if (next <= wheel->tick)
+            next = wheel->tick + 1;
+
+        _timer_enter(wheel, next);
+    }
+}
+
+/*
+ *    Returns the next tick the wheel has work at, either because a
+ *    timer is due or because coarser timers have to cascade down.
+ *    Sleeping until then never misses a timer.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *
+ *    @return unsigned long    The tick, or CHIK_TIMER_NEVER if the
+ *                             wheel is empty.
+ */
+unsigned long timer_wheel_next(timer_wheel_t *wheel) {
+    timer_node_t *head;
+    unsigned long next = CHIK_TIMER_NEVER;
+    unsigned long base;
+    unsigned long tick;
+    unsigned long i;
+    int           level;
+
+    if (wheel->count == 0)
+        return CHIK_TIMER_NEVER;
+
+    for (i = 0; i < CHIK_TIMER_SLOTS; i++) {
+        head = &wheel->slots[0][(wheel->tick + i) & CHIK_TIMER_MASK];
+
+        if (head->next != head) {
+            next = wheel->tick + i;
+            break;
+        }
+    }
+
+    /*
+     *    A coarser slot needs attention at the first boundary it
+     *    cascades on, which may come before a timer in the first level.
+     */
+    for (level = 1; level < CHIK_TIMER_LEVELS; level++) {
+        base = wheel->tick >> (CHIK_TIMER_BITS * level);
+
+        for (i = 1; i <= CHIK_TIMER_SLOTS; i++) {
+            head = &wheel->slots[level][(base + i) & CHIK_TIMER_MASK];
+
+            if (head->next != head) {
+                tick = (base + i) << (CHIK_TIMER_BITS * level);
+
+                if (tick < next)
+                    next = tick;
+
+                break;
+            }
+        }
+    }
+
+    return next;
+}
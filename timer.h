@@ -0,0 +1,114 @@
+/*
+ *    timer.h    --    Header for hierarchical timer wheels
+ *
+ *    Authored by Karl "p0lyh3dron" Kreuze on October 18, 2026
+ *
+ *    This file is part of the Chik library, a general purpose
+ *    library for the Chik engine and her games.
+ *
+ *    This file provides the declaration for a hierarchical timer
+ *    wheel. Timers are intrusive nodes hashed into slots by their
+ *    expiry tick, so adding and removing one is constant time no
+ *    matter how many are pending. Timers too far out for the lowest
+ *    level wait in a coarser one and cascade down as their time
+ *    comes closer.
+ *
+ *    The wheel only keeps time in ticks and does no locking, the
+ *    owner decides what a tick is and serializes access.
+ */
+#ifndef CHIK_TIMER_H
+#define CHIK_TIMER_H
+
+#define CHIK_TIMER_BITS   6
+#define CHIK_TIMER_SLOTS  (1UL << CHIK_TIMER_BITS)
+#define CHIK_TIMER_MASK   (CHIK_TIMER_SLOTS - 1)
+#define CHIK_TIMER_LEVELS 4
+
+/*
+ *    Returned by timer_wheel_next() when no timer is pending.
+ */
+#define CHIK_TIMER_NEVER ((unsigned long)-1)
+
+typedef struct timer_node_s {
+    struct timer_node_s *next;
+    struct timer_node_s *prev;
+    unsigned long        expires; /* The tick the timer is due at.  */
+} timer_node_t;
+
+typedef struct {
+    /*
+     *    Every slot is a circular list headed by a sentinel node.
+     */
+    timer_node_t  slots[CHIK_TIMER_LEVELS][CHIK_TIMER_SLOTS];
+    unsigned long tick;
+    unsigned long count;
+} timer_wheel_t;
+
+/*
+ *    Initializes a timer wheel.
+ *
+ *    @param timer_wheel_t *wheel    The wheel to initialize.
+ *    @param unsigned long  tick     The current tick.
+ */
+void timer_wheel_init(timer_wheel_t *wheel, unsigned long tick);
+
+/*
+ *    Initializes a timer node, which is not pending until added.
+ *
+ *    @param timer_node_t *node    The node to initialize.
+ */
+void timer_node_init(timer_node_t *node);
+
+/*
+ *    Returns whether a timer node is pending in a wheel.
+ *
+ *    @param timer_node_t *node    The node.
+ *
+ *    @return int    1 if the node is pending, 0 otherwise.
+ */
+int timer_node_pending(timer_node_t *node);
+
+/*
+ *    Adds a timer to the wheel. A tick in the past is due right away.
+ *
+ *    @param timer_wheel_t *wheel      The wheel.
+ *    @param timer_node_t  *node       The timer, must not be pending.
+ *    @param unsigned long  expires    The tick the timer is due at.
+ */
+void timer_wheel_add(timer_wheel_t *wheel, timer_node_t *node,
+                     unsigned long expires);
+
+/*
+ *    Removes a pending timer from the wheel.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param timer_node_t  *node     The timer.
+ *
+ *    @return int    0 on success, -1 if the timer wasn't pending.
+ */
+int timer_wheel_remove(timer_wheel_t *wheel, timer_node_t *node);
+
+/*
+ *    Takes one timer that is due by a tick out of the wheel,
+ *    advancing the wheel's time as far as needed to find it.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *    @param unsigned long  now      The current tick.
+ *
+ *    @return timer_node_t*    The timer, or 0 if none is due.
+ */
+timer_node_t *timer_wheel_expire(timer_wheel_t *wheel, unsigned long now);
+
+/*
+ *    Returns the next tick the wheel has work at, either because a
+ *    timer is due or because coarser timers have to cascade down.
+ *    Sleeping until then never misses a timer.
+ *
+ *    @param timer_wheel_t *wheel    The wheel.
+ *
+ *    @return unsigned long    The tick, or CHIK_TIMER_NEVER if the
+ *                             wheel is empty.
+ */
+unsigned long timer_wheel_next(timer_wheel_t *wheel);
+
+#endif /* CHIK_TIMER_H  */